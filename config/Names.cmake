@@ -1,6 +1,8 @@
 set ( CLIENTNAME ${PROJECT_NAME} )
 
 set ( DPSHAREDLIB "drawpilenet" )
+set ( DPCORELIB "drawpilecore" )
+set ( DPSERVERLIB "drawpileserver" )
 
 set ( SRVNAME "${PROJECT_NAME}-srv" )
 set ( SRVLIB "lib${SRVNAME}" )
@@ -12,6 +12,7 @@
 #endif
 
 #cmakedefine USE_ASM 1
+#cmakedefine SERVER_CANVAS 1
 
 #cmakedefine DRAWPILE_VERSION "${DRAWPILE_VERSION}"
 #cmakedefine DRAWPILE_PROTO_MAJOR_VERSION ${DRAWPILE_PROTO_MAJOR_VERSION}
@@ -28,6 +28,7 @@
 #include "selectionitem.h"
 #include "annotationitem.h"
 #include "statetracker.h"
+#include "core/snapshotgenerator.h"
 
 #include "core/layerstack.h"
 #include "core/layer.h"
@@ -373,17 +374,41 @@ void CanvasScene::handleDrawingCommand(protocol::MessagePtr cmd)
 {
 	if(_statetracker) {
 		_statetracker->receiveCommand(cmd);
-		emit canvasModified();
+		if(!_statetracker->isCatchupMode())
+			emit canvasModified();
 	} else {
 		qWarning() << "Received a drawing command but canvas does not exist!";
 	}
 }
 
+void CanvasScene::startCatchup()
+{
+	if(_statetracker)
+		_statetracker->setCatchupMode(true);
+}
+
+void CanvasScene::endCatchup()
+{
+	if(_statetracker && _statetracker->isCatchupMode()) {
+		_statetracker->setCatchupMode(false);
+		emit canvasModified();
+	}
+}
+
 void CanvasScene::sendSnapshot(bool forcenew)
 {
 	if(_statetracker) {
+		// Parts of two snapshots must not get mixed up
+		if(_snapshotGenerator) {
+			qWarning() << "cancelling the unfinished snapshot";
+			delete _snapshotGenerator;
+		}
+
 		qDebug() << "generating snapshot point...";
-		emit newSnapshot(_statetracker->generateSnapshot(forcenew));
+		_snapshotGenerator = _statetracker->generateSnapshot(forcenew);
+		_snapshotGenerator->setParent(this);
+		connect(_snapshotGenerator, SIGNAL(snapshotPart(QList<protocol::MessagePtr>,bool)), this, SIGNAL(newSnapshot(QList<protocol::MessagePtr>,bool)));
+		_snapshotGenerator->start(QThread::LowPriority);
 	} else {
 		qWarning() << "This shouldn't happen... Received a snapshot request but canvas does not exist!";
 	}
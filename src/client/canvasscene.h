@@ -21,6 +21,7 @@
 #define CANVAS_SCENE_H
 
 #include <QGraphicsScene>
+#include <QPointer>
 
 #include "core/point.h"
 #include "../shared/net/message.h"
@@ -40,6 +41,7 @@ class QGraphicsItem;
 namespace drawingboard {
 
 class StateTracker;
+class SnapshotGenerator;
 class CanvasItem;
 class AnnotationItem;
 class SelectionItem;
@@ -177,6 +179,12 @@ public slots:
 
 	void handleDrawingCommand(protocol::MessagePtr cmd);
 
+	//! Start replaying session history without updating the view
+	void startCatchup();
+
+	//! Session history replayed: refresh the view
+	void endCatchup();
+
 	//! Generate a snapshot point and send it to the server
 	void sendSnapshot(bool forcenew);
 
@@ -199,8 +207,14 @@ signals:
 	//! Emitted when a canvas modifying command is received
 	void canvasModified();
 
-	//! Emitted when a new snapshot point was generated
-	void newSnapshot(QList<protocol::MessagePtr>);
+	/**
+	 * @brief Part of a new snapshot point was generated
+	 *
+	 * Snapshots are generated in the background and delivered in parts.
+	 * @param messages snapshot commands
+	 * @param complete is this the last part
+	 */
+	void newSnapshot(QList<protocol::MessagePtr> messages, bool complete);
 
 private:
 	//! The board contents
@@ -208,6 +222,7 @@ private:
 
 	//! Drawing context state tracker
 	StateTracker *_statetracker;
+	QPointer<SnapshotGenerator> _snapshotGenerator;
 
 	//! Preview strokes currently on screen
 	QList<QGraphicsLineItem*> _previewstrokes;
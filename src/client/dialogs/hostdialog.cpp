@@ -66,6 +66,7 @@ HostDialog::HostDialog(const QImage& original, QWidget *parent)
 	ui_->username->setText(cfg.value("username").toString());
 	ui_->sessiontitle->setText(cfg.value("sessiontitle").toString());
 	ui_->remotehost->insertItems(0, cfg.value("recentremotehosts").toStringList());
+	ui_->undolimit->setValue(cfg.value("undolimit", ui_->undolimit->value()).toInt());
 
 	new MandatoryFields(this, ui_->buttons->button(QDialogButtonBox::Ok));
 }
@@ -81,6 +82,7 @@ void HostDialog::rememberSettings() const
 	cfg.beginGroup("history");
 	cfg.setValue("username", getUserName());
 	cfg.setValue("sessiontitle", getTitle());
+	cfg.setValue("undolimit", getUndoLimit());
 	QStringList hosts;
 	// Move current address to the top of the list
 	const QString current = ui_->remotehost->currentText();
@@ -164,6 +166,11 @@ int HostDialog::getUserLimit() const
 	return ui_->userlimit->value();
 }
 
+int HostDialog::getUndoLimit() const
+{
+	return ui_->undolimit->value();
+}
+
 QString HostDialog::getPassword() const
 {
 	return ui_->sessionpassword->text();
@@ -59,6 +59,9 @@ class HostDialog : public QDialog
 		//! Get max. user count
 		int getUserLimit() const;
 
+		//! Get the number of undo steps kept per user
+		int getUndoLimit() const;
+
 		//! Should users be allowed to draw by default
 		bool getAllowDrawing() const;
 
@@ -49,6 +49,12 @@ SettingsDialog::SettingsDialog(const QList<QAction*>& actions, QWidget *parent)
 	QSettings& cfg = DrawPileApp::getSettings();
 	cfg.beginGroup("settings/server");
 	ui_->serverport->setValue(cfg.value("port",DRAWPILE_PROTO_DEFAULT_PORT).toInt());
+	ui_->compression->setChecked(cfg.value("compression", true).toBool());
+	cfg.endGroup();
+
+	cfg.beginGroup("settings/input");
+	ui_->strokebatch->setValue(cfg.value("batchtime", 10).toInt());
+	cfg.endGroup();
 
 	// Generate an editable list of shortcuts
 	ui_->shortcuts->verticalHeader()->setVisible(false);
@@ -90,6 +96,14 @@ void SettingsDialog::rememberSettings() const
 		cfg.remove("port");
 	else
 		cfg.setValue("port", ui_->serverport->value());
+	cfg.setValue("compression", ui_->compression->isChecked());
+	cfg.endGroup();
+
+	cfg.beginGroup("settings/input");
+	if(ui_->strokebatch->value() != cfg.value("batchtime", 10).toInt()) {
+		cfg.setValue("batchtime", ui_->strokebatch->value());
+		emit inputSettingsChanged();
+	}
 	cfg.endGroup();
 
 	// Remember shortcuts. Only shortcuts that have been changed
@@ -37,6 +37,9 @@ class SettingsDialog : public QDialog
 		//! Shortcuts have changed, reload them from the settings
 		void shortcutsChanged() const;
 
+		//! Pen input settings have changed
+		void inputSettingsChanged() const;
+
 	public slots:
 		void rememberSettings() const;
 
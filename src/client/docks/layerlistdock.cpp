@@ -63,6 +63,7 @@ LayerListDock::LayerListDock(QWidget *parent)
 	_ui->lockButton->setMenu(_aclmenu);
 
 	connect(_ui->addButton, SIGNAL(clicked()), this, SLOT(addLayer()));
+	connect(_ui->duplicateButton, SIGNAL(clicked()), this, SLOT(duplicateSelected()));
 	connect(_ui->deleteButton, SIGNAL(clicked()), this, SLOT(deleteSelected()));
 	connect(_ui->hideButton, SIGNAL(clicked()), this, SLOT(hiddenToggled()));
 	connect(_ui->opacity, SIGNAL(valueChanged(int)), this, SLOT(opacityAdjusted()));
@@ -88,6 +89,7 @@ void LayerListDock::setClient(net::Client *client)
 	connect(_client->layerlist(), SIGNAL(layerCreated(bool)), this, SLOT(onLayerCreate(bool)));
 	connect(_client->layerlist(), SIGNAL(layerDeleted(int,int)), this, SLOT(onLayerDelete(int,int)));
 	connect(_client->layerlist(), SIGNAL(layersReordered()), this, SLOT(onLayerReorder()));
+	connect(_client->layerlist(), SIGNAL(modelReset()), this, SLOT(onLayersReset()));
 
 	connect(client->layerlist(), SIGNAL(dataChanged(QModelIndex,QModelIndex)), this, SLOT(dataChanged(QModelIndex,QModelIndex)));
 	connect(_ui->layerlist->selectionModel(), SIGNAL(selectionChanged(QItemSelection,QItemSelection)), this, SLOT(selectionChanged(QItemSelection)));
@@ -176,6 +178,19 @@ void LayerListDock::addLayer()
 	}
 }
 
+/**
+ * @brief Layer duplicate button pressed
+ */
+void LayerListDock::duplicateSelected()
+{
+	QModelIndex index = currentSelection();
+	if(!index.isValid())
+		return;
+
+	const net::LayerListItem layer = index.data().value<net::LayerListItem>();
+	_client->sendDuplicateLayer(layer.id, tr("%1 copy").arg(layer.title));
+}
+
 /**
  * @brief Layer delete button pressed
  */
@@ -249,6 +264,19 @@ void LayerListDock::onLayerReorder()
 		selectLayer(_selected);
 }
 
+/**
+ * @brief Restore selection after the whole layer list was rebuilt
+ */
+void LayerListDock::onLayersReset()
+{
+	if(_selected && _client->layerlist()->layerIndex(_selected).isValid())
+		selectLayer(_selected);
+	else if(_ui->layerlist->model()->rowCount() > 0)
+		_ui->layerlist->selectionModel()->select(_ui->layerlist->model()->index(0,0), QItemSelectionModel::SelectCurrent);
+	else
+		_selected = 0;
+}
+
 QModelIndex LayerListDock::currentSelection()
 {
 	QModelIndexList sel = _ui->layerlist->selectionModel()->selectedIndexes();
@@ -278,6 +306,7 @@ void LayerListDock::selectionChanged(const QItemSelection &selected)
 	_ui->hideButton->setEnabled(on);
 	_ui->opacity->setEnabled(on);
 	_ui->lockButton->setEnabled(on);
+	_ui->duplicateButton->setEnabled(on);
 	_ui->deleteButton->setEnabled(on);
 
 	if(on) {
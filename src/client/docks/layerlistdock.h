@@ -62,8 +62,10 @@ private slots:
 	void onLayerCreate(bool wasfirst);
 	void onLayerDelete(int id, int idx);
 	void onLayerReorder();
+	void onLayersReset();
 
 	void addLayer();
+	void duplicateSelected();
 	void deleteSelected();
 	void opacityAdjusted();
 	void blendModeChanged();
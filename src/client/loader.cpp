@@ -22,15 +22,17 @@
 #include <QApplication>
 #include <QImage>
 #include <QMessageBox>
+#include <QScopedPointer>
 
 #include "loader.h"
 #include "textloader.h"
 #include "net/client.h"
-#include "net/utils.h"
+#include "core/netutils.h"
 #include "ora/orareader.h"
 #include "canvasscene.h"
 #include "annotationitem.h"
 #include "statetracker.h"
+#include "core/checkpoint.h"
 #include "core/layerstack.h"
 #include "core/layer.h"
 
@@ -45,7 +47,7 @@ QList<MessagePtr> BlankCanvasLoader::loadInitCommands()
 {
 	QList<MessagePtr> msgs;
 	msgs.append(MessagePtr(new protocol::CanvasResize(_size.width(), _size.height())));
-	msgs.append(MessagePtr(new protocol::LayerCreate(1, 1, _color.rgba(), "Background")));
+	msgs.append(MessagePtr(new protocol::LayerCreate(0, 1, _color.rgba(), "Background")));
 	return msgs;
 }
 
@@ -102,49 +104,14 @@ QList<MessagePtr> QImageCanvasLoader::loadInitCommands()
 	QImage image = _image.convertToFormat(QImage::Format_ARGB32);
 
 	msgs.append(MessagePtr(new protocol::CanvasResize(image.size().width(), image.size().height())));
-	msgs.append(MessagePtr(new protocol::LayerCreate(1, 1, 0, "Background")));
-	msgs.append(net::putQImage(1, 0, 0, image, false));
+	msgs.append(MessagePtr(new protocol::LayerCreate(0, 1, 0, "Background")));
+	msgs.append(net::putQImage(0, 1, 0, 0, image, false));
 
 	return msgs;
 }
 
 QList<MessagePtr> SnapshotLoader::loadInitCommands()
 {
-	QList<MessagePtr> msgs;
-
-	// Most important bit first: canvas initialization
-	msgs.append(MessagePtr(new protocol::CanvasResize(_scene->width(), _scene->height())));
-
-	// Less important, but it's nice to see it straight away
-	if(!_scene->title().isEmpty())
-		msgs.append((MessagePtr(new protocol::SessionTitle(_scene->title()))));
-
-	// Create layers
-	for(int i=0;i<_scene->layers()->layers();++i) {
-		const dpcore::Layer *layer = _scene->layers()->getLayerByIndex(i);
-		msgs.append(MessagePtr(new protocol::LayerCreate(1, layer->id(), 0, layer->title())));
-		msgs.append(MessagePtr(new protocol::LayerAttributes(layer->id(), layer->opacity(), 1)));
-		msgs.append(net::putQImage(layer->id(), 0, 0, layer->toImage(), false));
-	}
-
-	// Create annotations
-	foreach(const drawingboard::AnnotationItem *a, _scene->getAnnotations()) {
-		QRect g = a->geometry();
-		msgs.append(MessagePtr(new protocol::AnnotationCreate(0, a->id(), g.x(), g.y(), g.width(), g.height())));
-		msgs.append((MessagePtr(new protocol::AnnotationEdit(a->id(), a->backgroundColor().rgba(), a->text()))));
-	}
-
-	// User tool changes
-	QHashIterator<int, drawingboard::DrawingContext> iter(_scene->statetracker()->drawingContexts());
-	while(iter.hasNext()) {
-		iter.next();
-
-		msgs.append(net::brushToToolChange(
-			iter.key(),
-			iter.value().tool.layer_id,
-			iter.value().tool.brush
-		));
-	}
-
-	return msgs;
+	QScopedPointer<drawingboard::CanvasCheckpoint> checkpoint(_scene->statetracker()->createCheckpoint());
+	return checkpoint->toMessages();
 }
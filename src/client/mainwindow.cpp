@@ -162,6 +162,7 @@ MainWindow::MainWindow(bool restoreWindowPosition)
 
 	// Create the network client
 	_client = new net::Client(this);
+	updateInputSettings();
 	_view->setClient(_client);
 	_layerlist->setClient(_client);
 	_toolsettings->getAnnotationSettings()->setClient(_client);
@@ -171,7 +172,9 @@ MainWindow::MainWindow(bool restoreWindowPosition)
 	// Client command receive signals
 	connect(_client, SIGNAL(drawingCommandReceived(protocol::MessagePtr)), _canvas, SLOT(handleDrawingCommand(protocol::MessagePtr)));
 	connect(_client, SIGNAL(needSnapshot(bool)), _canvas, SLOT(sendSnapshot(bool)));
-	connect(_canvas, SIGNAL(newSnapshot(QList<protocol::MessagePtr>)), _client, SLOT(sendSnapshot(QList<protocol::MessagePtr>)));
+	connect(_client, SIGNAL(catchupStarted()), _canvas, SLOT(startCatchup()));
+	connect(_client, SIGNAL(catchupFinished()), _canvas, SLOT(endCatchup()));
+	connect(_canvas, SIGNAL(newSnapshot(QList<protocol::MessagePtr>,bool)), _client, SLOT(sendSnapshot(QList<protocol::MessagePtr>,bool)));
 
 	// Meta commands
 	connect(_client, SIGNAL(chatMessageReceived(QString,QString, bool)),
@@ -196,8 +199,10 @@ MainWindow::MainWindow(bool restoreWindowPosition)
 	connect(_client, SIGNAL(serverDisconnecting()), netstatus, SLOT(hostDisconnecting()));
 	connect(_client, SIGNAL(serverDisconnected(QString)), netstatus, SLOT(hostDisconnected()));
 	connect(_client, SIGNAL(expectingBytes(int)),netstatus, SLOT(expectBytes(int)));
+	connect(_client, SIGNAL(catchupFinished()), netstatus, SLOT(expectedBytesReceived()));
 	connect(_client, SIGNAL(bytesReceived(int)), netstatus, SLOT(bytesReceived(int)));
 	connect(_client, SIGNAL(bytesSent(int)), netstatus, SLOT(bytesSent(int)));
+	connect(_client, SIGNAL(messageBacklog(int)), netstatus, SLOT(messageBacklog(int)));
 
 	connect(_client, SIGNAL(userJoined(QString)), netstatus, SLOT(join(QString)));
 	connect(_client, SIGNAL(userLeft(QString)), netstatus, SLOT(leave(QString)));
@@ -273,6 +278,8 @@ MainWindow *MainWindow::loadDocument(SessionLoader &loader)
 	win->saveas_->setEnabled(true);
 	win->_copy->setEnabled(true);
 	win->_copylayer->setEnabled(true);
+	win->_undo->setEnabled(true);
+	win->_redo->setEnabled(true);
 	return win;
 }
 
@@ -707,6 +714,7 @@ void MainWindow::showSettings()
 {
 	dialogs::SettingsDialog *dlg = new dialogs::SettingsDialog(customacts_, this);
 	connect(dlg, SIGNAL(shortcutsChanged()), this, SLOT(updateShortcuts()));
+	connect(dlg, SIGNAL(inputSettingsChanged()), this, SLOT(updateInputSettings()));
 	dlg->setAttribute(Qt::WA_DeleteOnClose);
 	dlg->setWindowModality(Qt::WindowModal);
 	dlg->show();
@@ -824,7 +832,9 @@ void MainWindow::finishHost(int i)
 		login->setPassword(hostdlg_->getPassword());
 		login->setTitle(hostdlg_->getTitle());
 		login->setMaxUsers(hostdlg_->getUserLimit());
+		login->setUndoLimit(hostdlg_->getUndoLimit());
 		login->setAllowDrawing(hostdlg_->getAllowDrawing());
+		login->setCompression(DrawPileApp::getSettings().value("settings/server/compression", true).toBool());
 		w->_client->connectToServer(login);
 
 	}
@@ -886,6 +896,7 @@ void MainWindow::joinSession(const QUrl& url)
 		win = new MainWindow(false);
 
 	net::LoginHandler *login = new net::LoginHandler(net::LoginHandler::JOIN, url);
+	login->setCompression(DrawPileApp::getSettings().value("settings/server/compression", true).toBool());
 	win->_client->connectToServer(login);
 }
 
@@ -940,6 +951,8 @@ void MainWindow::loggedin(bool join)
 	if(join) {
 		_canvas->initCanvas(_client);
 		_layerlist->init();
+		_undo->setEnabled(true);
+		_redo->setEnabled(true);
 	}
 }
 
@@ -1183,6 +1196,28 @@ void MainWindow::paste()
 	}
 }
 
+void MainWindow::undo()
+{
+	_client->sendUndo();
+}
+
+void MainWindow::redo()
+{
+	_client->sendRedo();
+}
+
+/**
+ * @brief Apply the pen input batching window from the settings
+ */
+void MainWindow::updateInputSettings()
+{
+	QSettings& cfg = DrawPileApp::getSettings();
+	_client->setStrokeBatching(
+		cfg.value("settings/input/batchtime", 10).toInt(),
+		cfg.value("settings/input/batchpoints", 32).toInt()
+	);
+}
+
 void MainWindow::about()
 {
 	QMessageBox::about(this, tr("About DrawPile"),
@@ -1320,13 +1355,19 @@ void MainWindow::initActions()
 	_copy = makeAction("copyvisible", "edit-copy", tr("&Copy visible"), tr("Copy selected area to the clipboard"), QKeySequence::Copy);
 	_copylayer = makeAction("copylayer", "edit-copy", tr("Copy layer"), tr("Copy selected area of the current layer to the clipboard"));
 	_paste = makeAction("paste", "edit-paste", tr("&Paste"), tr("Paste an image onto the canvas"), QKeySequence::Paste);
+	_undo = makeAction("undo", "edit-undo", tr("&Undo"), tr("Undo your latest change"), QKeySequence::Undo);
+	_redo = makeAction("redo", "edit-redo", tr("&Redo"), tr("Redo your latest undone change"), QKeySequence::Redo);
 
 	_copy->setEnabled(false);
 	_copylayer->setEnabled(false);
+	_undo->setEnabled(false);
+	_redo->setEnabled(false);
 
 	connect(_copy, SIGNAL(triggered()), this, SLOT(copyVisible()));
 	connect(_copylayer, SIGNAL(triggered()), this, SLOT(copyLayer()));
 	connect(_paste, SIGNAL(triggered()), this, SLOT(paste()));
+	connect(_undo, SIGNAL(triggered()), this, SLOT(undo()));
+	connect(_redo, SIGNAL(triggered()), this, SLOT(redo()));
 
 	// View actions
 	zoomin_ = makeAction("zoomin", "zoom-in.png",tr("Zoom &in"), QString(), QKeySequence::ZoomIn);
@@ -1384,6 +1425,9 @@ void MainWindow::createMenus()
 			this, SLOT(openRecent(QAction*)));
 
 	QMenu *editmenu = menuBar()->addMenu(tr("&Edit"));
+	editmenu->addAction(_undo);
+	editmenu->addAction(_redo);
+	editmenu->addSeparator();
 	editmenu->addAction(_copy);
 	editmenu->addAction(_copylayer);
 	editmenu->addAction(_paste);
@@ -124,6 +124,10 @@ class MainWindow : public QMainWindow {
 		void copyLayer();
 		void paste();
 
+		void undo();
+		void redo();
+		void updateInputSettings();
+
 	signals:
 		//! This signal is emitted when the current tool is changed
 		void toolChanged(tools::Type);
@@ -204,6 +208,8 @@ class MainWindow : public QMainWindow {
 		QAction *_copy;
 		QAction *_copylayer;
 		QAction *_paste;
+		QAction *_undo;
+		QAction *_redo;
 
 		QAction *host_;
 		QAction *join_;
@@ -20,11 +20,13 @@
 */
 #include <QDebug>
 #include <QImage>
+#include <QPainter>
+#include <QTimer>
 
 #include "net/client.h"
 #include "net/loopbackserver.h"
 #include "net/tcpserver.h"
-#include "net/utils.h"
+#include "core/netutils.h"
 #include "net/login.h"
 #include "net/userlist.h"
 #include "net/layerlist.h"
@@ -39,6 +41,7 @@
 #include "../shared/net/meta.h"
 #include "../shared/net/pen.h"
 #include "../shared/net/snapshot.h"
+#include "../shared/net/undo.h"
 
 using protocol::MessagePtr;
 
@@ -53,6 +56,14 @@ Client::Client(QObject *parent)
 	_isOp = false;
 	_isSessionLocked = false;
 	_isUserLocked = false;
+	_sendingSnapshot = false;
+	_catchingup = false;
+	_strokeBatchMaxPoints = 32;
+
+	_strokeBatchTimer = new QTimer(this);
+	_strokeBatchTimer->setSingleShot(true);
+	_strokeBatchTimer->setInterval(10);
+	connect(_strokeBatchTimer, SIGNAL(timeout()), this, SLOT(flushStroke()));
 
 	_userlist = new UserListModel(this);
 	_layerlist = new LayerListModel(this);
@@ -88,10 +99,13 @@ void Client::connectToServer(LoginHandler *loginhandler)
 	connect(server, SIGNAL(serverDisconnected(QString)), this, SLOT(handleDisconnect(QString)));
 	connect(server, SIGNAL(loggedIn(int, bool)), this, SLOT(handleConnect(int, bool)));
 	connect(server, SIGNAL(messageReceived(protocol::MessagePtr)), this, SLOT(handleMessage(protocol::MessagePtr)));
+	connect(server, SIGNAL(catchupStarted()), this, SLOT(handleCatchupStart()));
+	connect(server, SIGNAL(catchupFinished()), this, SLOT(handleCatchupEnd()));
 
 	connect(server, SIGNAL(expectingBytes(int)), this, SIGNAL(expectingBytes(int)));
 	connect(server, SIGNAL(bytesReceived(int)), this, SIGNAL(bytesReceived(int)));
 	connect(server, SIGNAL(bytesSent(int)), this, SIGNAL(bytesSent(int)));
+	connect(server, SIGNAL(messageBacklog(int)), this, SIGNAL(messageBacklog(int)));
 
 	if(loginhandler->mode() == LoginHandler::HOST)
 		loginhandler->setUserId(_my_id);
@@ -118,6 +132,11 @@ void Client::handleConnect(int userid, bool join)
 
 void Client::handleDisconnect(const QString &message)
 {
+	// Points not yet sent have nowhere to go anymore
+	_strokeBatchTimer->stop();
+	_strokeBatch.clear();
+	_pendingImages.clear();
+
 	emit serverDisconnected(message);
 	_userlist->clearUsers();
 	_layerlist->unlockAll();
@@ -131,6 +150,29 @@ void Client::handleDisconnect(const QString &message)
 	emit lockBitsChanged();
 }
 
+/**
+ * @brief Start replaying the session history
+ *
+ * Layer ACL changes are deferred until the end of the catch-up, since
+ * the layer list is not updated while the history is being replayed.
+ */
+void Client::handleCatchupStart()
+{
+	_catchingup = true;
+	emit catchupStarted();
+}
+
+void Client::handleCatchupEnd()
+{
+	_catchingup = false;
+	emit catchupFinished();
+
+	QList<MessagePtr> acls = _catchupAcls;
+	_catchupAcls.clear();
+	foreach(MessagePtr msg, acls)
+		handleLayerAcl(msg.cast<protocol::LayerACL>());
+}
+
 void Client::init()
 {
 	_loopback->reset();
@@ -152,11 +194,13 @@ int Client::uploadQueueBytes() const
 	return _server->uploadQueueBytes();
 }
 
-void Client::sendCanvasResize(const QSize &newsize)
+void Client::sendCanvasResize(const QSize &newsize, const QPoint &offset)
 {
 	_server->sendMessage(MessagePtr(new protocol::CanvasResize(
 		newsize.width(),
-		newsize.height()
+		newsize.height(),
+		offset.x(),
+		offset.y()
 	)));
 }
 
@@ -166,16 +210,22 @@ void Client::sendNewLayer(int id, const QColor &fill, const QString &title)
 	_server->sendMessage(MessagePtr(new protocol::LayerCreate(_my_id, id, fill.rgba(), title)));
 }
 
+void Client::sendDuplicateLayer(int source, const QString &title)
+{
+	Q_ASSERT(source>0 && source<256);
+	_server->sendMessage(MessagePtr(new protocol::LayerDuplicate(_my_id, 0, source, title)));
+}
+
 void Client::sendLayerAttribs(int id, float opacity, int blend)
 {
 	Q_ASSERT(id>=0 && id<256);
-	_server->sendMessage(MessagePtr(new protocol::LayerAttributes(id, opacity*255, blend)));
+	_server->sendMessage(MessagePtr(new protocol::LayerAttributes(_my_id, id, opacity*255, blend)));
 }
 
 void Client::sendLayerTitle(int id, const QString &title)
 {
 	Q_ASSERT(id>=0 && id<256);
-	_server->sendMessage(MessagePtr(new protocol::LayerRetitle(id, title)));
+	_server->sendMessage(MessagePtr(new protocol::LayerRetitle(_my_id, id, title)));
 }
 
 void Client::sendLayerVisibility(int id, bool hide)
@@ -188,53 +238,185 @@ void Client::sendLayerVisibility(int id, bool hide)
 void Client::sendDeleteLayer(int id, bool merge)
 {
 	Q_ASSERT(id>=0 && id<256);
-	_server->sendMessage(MessagePtr(new protocol::LayerDelete(id, merge)));
+	_server->sendMessage(MessagePtr(new protocol::LayerDelete(_my_id, id, merge)));
 }
 
 void Client::sendLayerReorder(const QList<uint8_t> &ids)
 {
 	Q_ASSERT(ids.size()>0);
-	_server->sendMessage(MessagePtr(new protocol::LayerOrder(ids)));
+	_server->sendMessage(MessagePtr(new protocol::LayerOrder(_my_id, ids)));
+}
+
+/**
+ * Points are collected for at most <i>interval</i> milliseconds or until
+ * <i>maxpoints</i> points have been gathered and then sent in a single PenMove message.
+ * Batching is not used with the loopback server.
+ * @param interval batching window in milliseconds (0 to disable batching)
+ * @param maxpoints maximum number of points to collect
+ */
+void Client::setStrokeBatching(int interval, int maxpoints)
+{
+	flushStroke();
+	_strokeBatchTimer->setInterval(qMax(0, interval));
+	_strokeBatchMaxPoints = qBound(1, maxpoints, int(protocol::PenMove::MAX_POINTS));
 }
 
 void Client::sendToolChange(const drawingboard::ToolContext &ctx)
 {
+	// Tool change applies only to the points that come after it
+	flushStroke();
+
 	// TODO check if needs resending
 	_server->sendMessage(brushToToolChange(_my_id, ctx.layer_id, ctx.brush));
 }
 
 void Client::sendStroke(const dpcore::Point &point)
 {
-	protocol::PenPointVector v(1);
-	v[0] = pointToProtocol(point);
-	_server->sendMessage(MessagePtr(new protocol::PenMove(_my_id, v)));
+	_strokeBatch.append(pointToProtocol(point));
+	batchStroke();
 }
 
 void Client::sendStroke(const dpcore::PointVector &points)
 {
-	_server->sendMessage(MessagePtr(new protocol::PenMove(_my_id, pointsToProtocol(points))));
+	_strokeBatch += pointsToProtocol(points);
+	batchStroke();
+}
+
+void Client::batchStroke()
+{
+	if(_isloopback || _strokeBatchTimer->interval() == 0 || _strokeBatch.size() >= _strokeBatchMaxPoints)
+		flushStroke();
+	else if(!_strokeBatchTimer->isActive())
+		_strokeBatchTimer->start();
+}
+
+/**
+ * Send the collected points now
+ */
+void Client::flushStroke()
+{
+	_strokeBatchTimer->stop();
+	if(_strokeBatch.isEmpty())
+		return;
+
+	for(int i=0;i<_strokeBatch.size();i+=protocol::PenMove::MAX_POINTS)
+		_server->sendMessage(MessagePtr(new protocol::PenMove(_my_id, _strokeBatch.mid(i, protocol::PenMove::MAX_POINTS))));
+	_strokeBatch.clear();
 }
 
 void Client::sendPenup()
 {
+	flushStroke();
 	_server->sendMessage(MessagePtr(new protocol::PenUp(_my_id)));
 }
 
 /**
  * This one is a bit tricky, since the whole image might not fit inside
  * a single message. In that case, multiple PUTIMAGE commands will be sent.
+ *
+ * If the current content of the area is given, the image is sent delta coded
+ * against it when that is smaller. Should someone else draw in the same area
+ * before the delta arrives, the delta is rejected and the image is resent
+ * in full when the rejection is noticed.
  * 
  * @param layer layer onto which the image should be drawn
  * @param x image x coordinate
  * @param y imagee y coordinate
  * @param image image data
+ * @param blend alpha blend the image with the layer
+ * @param current current layer content under the image (optional)
  */
-void Client::sendImage(int layer, int x, int y, const QImage &image, bool blend)
-{
-	foreach(MessagePtr msg, putQImage(layer, x, y, image, blend))
+void Client::sendImage(int layer, int x, int y, const QImage &image, bool blend, const QImage &current)
+{
+	const QList<MessagePtr> full = putQImage(_my_id, layer, x, y, image, blend);
+
+	if(!current.isNull()) {
+		// The delta is made against the final result, just like Layer::putImage would draw it
+		QImage result = current.convertToFormat(QImage::Format_ARGB32);
+		if(blend) {
+			QPainter painter(&result);
+			painter.drawImage(0, 0, image);
+		} else {
+			result = image.convertToFormat(QImage::Format_ARGB32);
+		}
+
+		const QList<MessagePtr> delta = putQImageDelta(_my_id, layer, x, y, result, current);
+
+		int fullBytes = 0;
+		foreach(const MessagePtr &msg, full)
+			fullBytes += msg->length();
+
+		if(!delta.isEmpty() && delta.first()->length() < fullBytes) {
+			qDebug() << "Sending delta coded image:" << delta.first()->length() << "bytes instead of" << fullBytes;
+			const protocol::PutImage &cmd = delta.first().cast<protocol::PutImage>();
+			const PendingImage pending = {
+				layer, x, y, image, blend,
+				QRect(cmd.x(), cmd.y(), cmd.width(), cmd.height()),
+				deltaChecksum(cmd)
+			};
+			_pendingImages.append(pending);
+			_server->sendMessage(delta.first());
+			return;
+		}
+	}
+
+	foreach(MessagePtr msg, full)
 		_server->sendMessage(msg);
 }
 
+/**
+ * The echoed image is matched to the pending one by its layer, area and
+ * base checksum. Images the server dropped are never echoed, so the order
+ * of the echoes alone can't be relied on.
+ * @param layer target layer ID
+ * @param rect target area
+ * @param checksum checksum of the content the delta was made against
+ * @param applied was the image applied
+ */
+void Client::handleImageDelta(int layer, const QRect &rect, quint32 checksum, bool applied)
+{
+	for(int i=0;i<_pendingImages.size();++i) {
+		const PendingImage &p = _pendingImages.at(i);
+		if(p.layer != layer || p.rect != rect || p.checksum != checksum)
+			continue;
+
+		const PendingImage pending = _pendingImages.takeAt(i);
+		if(!applied) {
+			qDebug() << "Delta coded image was rejected, resending in full";
+			foreach(MessagePtr msg, putQImage(_my_id, pending.layer, pending.x, pending.y, pending.image, pending.blend))
+				_server->sendMessage(msg);
+		}
+		return;
+	}
+}
+
+/**
+ * The server drops images sent to a deleted or locked layer, so those
+ * will never be echoed back.
+ * @param layer layer ID or -1 for all layers
+ */
+void Client::dropPendingImages(int layer)
+{
+	QMutableListIterator<PendingImage> i(_pendingImages);
+	while(i.hasNext()) {
+		const PendingImage &p = i.next();
+		if(layer < 0 || p.layer == layer) {
+			qDebug() << "Delta coded image to layer" << p.layer << "will not be echoed back";
+			i.remove();
+		}
+	}
+}
+
+void Client::sendUndo()
+{
+	_server->sendMessage(MessagePtr(new protocol::Undo(_my_id)));
+}
+
+void Client::sendRedo()
+{
+	_server->sendMessage(MessagePtr(new protocol::Redo(_my_id)));
+}
+
 void Client::sendAnnotationCreate(int id, const QRect &rect)
 {
 	Q_ASSERT(id>=0 && id < 256);
@@ -277,16 +459,23 @@ void Client::sendAnnotationDelete(int id)
 }
 
 /**
- * @brief Send the session initialization command stream
+ * @brief Send (a part of) the session initialization command stream
  * @param commands snapshot point commands
+ * @param complete is this the last part of the snapshot
  */
-void Client::sendSnapshot(const QList<protocol::MessagePtr> commands)
+void Client::sendSnapshot(const QList<protocol::MessagePtr> commands, bool complete)
 {
-	// Send ACK to indicate the rest of the data is on its way
-	_server->sendMessage(MessagePtr(new protocol::SnapshotMode(protocol::SnapshotMode::ACK)));
+	if(!_sendingSnapshot) {
+		// Send ACK to indicate the rest of the data is on its way
+		_server->sendMessage(MessagePtr(new protocol::SnapshotMode(protocol::SnapshotMode::ACK)));
+		_sendingSnapshot = true;
+	}
 
 	// The actual snapshot data will be sent in parallel with normal session traffic
-	_server->sendSnapshotMessages(commands);
+	_server->sendSnapshotMessages(commands, complete);
+
+	if(complete)
+		_sendingSnapshot = false;
 }
 
 void Client::sendChat(const QString &message)
@@ -364,6 +553,8 @@ void Client::handleMessage(protocol::MessagePtr msg)
 {
 	// TODO should meta commands go here too for session recording purposes?
 	if(msg->isCommand()) {
+		if(msg->type() == protocol::MSG_LAYER_DELETE)
+			dropPendingImages(msg.cast<protocol::LayerDelete>().id());
 		emit drawingCommandReceived(msg);
 		return;
 	}
@@ -392,7 +583,10 @@ void Client::handleMessage(protocol::MessagePtr msg)
 		handleSessionConfChange(msg.cast<SessionConf>());
 		break;
 	case MSG_LAYER_ACL:
-		handleLayerAcl(msg.cast<LayerACL>());
+		if(_catchingup)
+			_catchupAcls.append(msg);
+		else
+			handleLayerAcl(msg.cast<LayerACL>());
 		break;
 	default:
 		qWarning() << "received unhandled meta command" << msg->type();
@@ -407,6 +601,13 @@ void Client::handleSnapshotRequest(const protocol::SnapshotMode &msg)
 		return;
 	}
 
+	// A new request replaces the snapshot still being uploaded
+	if(_sendingSnapshot) {
+		qWarning() << "new snapshot requested while the previous one is still being uploaded";
+		_server->abortSnapshot();
+		_sendingSnapshot = false;
+	}
+
 	emit needSnapshot(msg.mode() == protocol::SnapshotMode::REQUEST_NEW);
 }
 
@@ -435,6 +636,8 @@ void Client::handleUserAttr(const protocol::UserAttr &msg)
 	if(msg.id() == _my_id) {
 		_isOp = msg.isOp();
 		_isUserLocked = msg.isLocked();
+		if(_isUserLocked)
+			dropPendingImages(-1);
 		emit opPrivilegeChange(msg.isOp());
 		emit lockBitsChanged();
 	}
@@ -451,12 +654,16 @@ void Client::handleUserLeave(const protocol::UserLeave &msg)
 void Client::handleSessionConfChange(const protocol::SessionConf &msg)
 {
 	_isSessionLocked = msg.locked();
+	if(_isSessionLocked)
+		dropPendingImages(-1);
 	emit sessionConfChange(msg.locked(), msg.closed());
 	emit lockBitsChanged();
 }
 
 void Client::handleLayerAcl(const protocol::LayerACL &msg)
 {
+	if(msg.locked() || !(msg.exclusive().isEmpty() || msg.exclusive().contains(_my_id)))
+		dropPendingImages(msg.id());
 	_layerlist->updateLayerAcl(msg.id(), msg.locked(), msg.exclusive());
 	emit lockBitsChanged();
 }
@@ -22,9 +22,14 @@
 #define DP_NET_CLIENT_H
 
 #include <QObject>
+#include <QImage>
+#include <QRect>
 
 #include "core/point.h"
 #include "../shared/net/message.h"
+#include "../shared/net/pen.h"
+
+class QTimer;
 
 namespace dpcore {
 	class Point;
@@ -141,10 +146,14 @@ public:
 	//! Reinitialize after clearing out the old board
 	void init();
 
+	//! Set how pen input is batched into PenMove messages
+	void setStrokeBatching(int interval, int maxpoints);
+
 public slots:
 	// Layer changing
-	void sendCanvasResize(const QSize &newsize);
+	void sendCanvasResize(const QSize &newsize, const QPoint &offset=QPoint());
 	void sendNewLayer(int id, const QColor &fill, const QString &title);
+	void sendDuplicateLayer(int source, const QString &title);
 	void sendLayerAttribs(int id, float opacity, int blend);
 	void sendLayerTitle(int id, const QString &title);
 	void sendLayerVisibility(int id, bool hide);
@@ -156,7 +165,12 @@ public slots:
 	void sendStroke(const dpcore::Point &point);
 	void sendStroke(const dpcore::PointVector &points);
 	void sendPenup();
-	void sendImage(int layer, int x, int y, const QImage &image, bool blend);
+	void flushStroke();
+	void sendImage(int layer, int x, int y, const QImage &image, bool blend, const QImage &current=QImage());
+
+	// Undo
+	void sendUndo();
+	void sendRedo();
 
 	// Annotations
 	void sendAnnotationCreate(int id, const QRect &rect);
@@ -166,7 +180,7 @@ public slots:
 
 	// Snapshot	
 	void sendLocalInit(const QList<protocol::MessagePtr> commands);
-	void sendSnapshot(const QList<protocol::MessagePtr> commands);
+	void sendSnapshot(const QList<protocol::MessagePtr> commands, bool complete);
 
 	// Misc.
 	void sendChat(const QString &message);
@@ -200,16 +214,27 @@ signals:
 
 	void layerVisibilityChange(int id, bool hidden);
 
+	//! Session history replay started: UI updates can be deferred
+	void catchupStarted();
+
+	//! Session history replay finished
+	void catchupFinished();
+
 	void expectingBytes(int);
 	void bytesReceived(int);
 	void bytesSent(int);
+	void messageBacklog(int);
 
 private slots:
 	void handleMessage(protocol::MessagePtr msg);
 	void handleConnect(int userid, bool join);
 	void handleDisconnect(const QString &message);
+	void handleCatchupStart();
+	void handleCatchupEnd();
+	void handleImageDelta(int layer, const QRect &rect, quint32 checksum, bool applied);
 
 private:
+	void batchStroke();
 	void handleSnapshotRequest(const protocol::SnapshotMode &msg);
 	void handleChatMessage(const protocol::Chat &msg);
 	void handleUserJoin(const protocol::UserJoin &msg);
@@ -217,6 +242,7 @@ private:
 	void handleUserLeave(const protocol::UserLeave &msg);
 	void handleSessionConfChange(const protocol::SessionConf &msg);
 	void handleLayerAcl(const protocol::LayerACL &msg);
+	void dropPendingImages(int layer);
 
 	Server *_server;
 	LoopbackServer *_loopback;
@@ -225,6 +251,26 @@ private:
 	bool _isloopback;
 	bool _isOp;
 	bool _isSessionLocked, _isUserLocked;
+	bool _catchingup;
+	bool _sendingSnapshot;
+	QList<protocol::MessagePtr> _catchupAcls;
+
+	//! An image sent delta coded, kept until the server echoes it back
+	struct PendingImage {
+		int layer;
+		int x, y;
+		QImage image;
+		bool blend;
+
+		//! The area and base checksum of the delta, used to recognize the echo
+		QRect rect;
+		quint32 checksum;
+	};
+	QList<PendingImage> _pendingImages;
+
+	protocol::PenPointVector _strokeBatch;
+	QTimer *_strokeBatchTimer;
+	int _strokeBatchMaxPoints;
 	UserListModel *_userlist;
 	LayerListModel *_layerlist;
 };
@@ -148,6 +148,34 @@ void LayerListModel::clear()
 	endRemoveRows();
 }
 
+/**
+ * @brief Replace the whole layer list
+ *
+ * This is used to refresh the list in one go after a batch of layer
+ * commands has been processed without updating the model.
+ * @param items new layer list (topmost layer first)
+ */
+void LayerListModel::setLayers(const QVector<LayerListItem> &items)
+{
+	const bool wasempty = _items.isEmpty();
+
+	// Access controls are not part of the canvas, so keep the existing ones
+	QVector<LayerListItem> newitems = items;
+	for(int i=0;i<newitems.size();++i) {
+		const int old = indexOf(newitems[i].id);
+		if(old>=0) {
+			newitems[i].locked = _items.at(old).locked;
+			newitems[i].exclusive = _items.at(old).exclusive;
+		}
+	}
+
+	beginResetModel();
+	_items = newitems;
+	endResetModel();
+	if(wasempty && !_items.isEmpty())
+		emit layerCreated(true);
+}
+
 void LayerListModel::changeLayer(int id, float opacity, int blend)
 {
 	int row = indexOf(id);
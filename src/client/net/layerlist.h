@@ -72,6 +72,7 @@ public:
 	QModelIndex layerIndex(int id);
 	
 	void clear();
+	void setLayers(const QVector<LayerListItem> &items);
 	void createLayer(int id, const QString &title);
 	void deleteLayer(int id);
 	void changeLayer(int id, float opacity, int blend);
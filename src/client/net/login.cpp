@@ -31,6 +31,14 @@
 
 namespace net {
 
+QString LoginHandler::sessionName() const
+{
+	QString name = _address.path();
+	while(name.startsWith('/'))
+		name = name.mid(1);
+	return name;
+}
+
 void LoginHandler::receiveMessage(protocol::MessagePtr message)
 {
 	if(message->type() != protocol::MSG_LOGIN) {
@@ -80,6 +88,17 @@ void LoginHandler::expectHello(const QString &msg)
 		return;
 	}
 
+	// Select the session first. The server responds with a new hello
+	// describing the selected session.
+	if(!_sessionSelected) {
+		_sessionSelected = true;
+		const QString name = sessionName();
+		if(!name.isEmpty()) {
+			_server->sendMessage(protocol::MessagePtr(new protocol::Login(QString("SESSION %1").arg(name))));
+			return;
+		}
+	}
+
 	// Minor version (if set) must also match ours
 	int minorVersion = versions[1].toInt(&ok);
 	if(!ok || (minorVersion>0 && minorVersion != DRAWPILE_PROTO_MINOR_VERSION)) {
@@ -134,13 +153,15 @@ void LoginHandler::sendLogin()
 	QString msg;
 	switch(_mode) {
 	case HOST:
-		msg = QString("HOST %1 %2 %3").arg(DRAWPILE_PROTO_MINOR_VERSION).arg(_userid).arg(_address.userName());
+		msg = QString("HOST %1 %2 %3 %4").arg(DRAWPILE_PROTO_MINOR_VERSION).arg(_userid).arg(_undolimit).arg(_address.userName());
 		break;
 	case JOIN:
 		msg = QString("JOIN %1").arg(_address.userName());
 		break;
 	}
 
+	// When joining, the session's minor version was already checked to match ours
+	_server->setProtocolVersion(DRAWPILE_PROTO_MINOR_VERSION);
 	_server->sendMessage(protocol::MessagePtr(new protocol::Login(msg)));
 }
 
@@ -158,9 +179,9 @@ void LoginHandler::expectLoginOk(const QString &msg)
 		return;
 	}
 
-	// OK response should be in format "OK <userid>"
+	// OK response should be in format "OK <userid> [DEFLATE]"
 	QStringList tokens = msg.split(' ', QString::SkipEmptyParts);
-	if(tokens.length() != 2 || tokens[0] != "OK") {
+	if(tokens.length() < 2 || tokens.length() > 3 || tokens[0] != "OK") {
 		qWarning() << "Login error. Expected OK, got:" << msg;
 		_server->loginFailure(QApplication::tr("Incompatible server"));
 		return;
@@ -174,11 +195,25 @@ void LoginHandler::expectLoginOk(const QString &msg)
 		return;
 	}
 
+	bool compressionOffered = false;
+	if(tokens.length() == 3) {
+		if(tokens[2] != protocol::Login::COMPRESSION_MARKER) {
+			qWarning() << "Login error. Unknown login option:" << tokens[2];
+			_server->loginFailure(QApplication::tr("Incompatible server"));
+			return;
+		}
+		compressionOffered = true;
+	}
+
 	_userid = userid;
 
 	// Login complete!
 	_server->loginSuccess();
 
+	// Switch on compression before anything else is sent
+	if(compressionOffered && _compress)
+		_server->startCompression();
+
 	// If in host mode, send initial session settings
 	if(_mode==HOST) {
 		if(!_password.isEmpty())
@@ -26,6 +26,7 @@
 #include <QObject>
 
 #include "../shared/net/message.h"
+#include "../shared/net/undo.h"
 
 namespace net {
 
@@ -40,7 +41,8 @@ public:
 	enum Mode {HOST, JOIN};
 
 	LoginHandler(Mode mode, const QUrl &url)
-		: QObject(0), _mode(mode), _address(url), _maxusers(0), _allowdrawing(true), _state(0) { }
+		: QObject(0), _mode(mode), _address(url), _maxusers(0), _allowdrawing(true), _undolimit(protocol::UndoHorizon::DEFAULT_UNDO_LIMIT),
+		  _compress(false), _state(0), _sessionSelected(false) { }
 
 	/**
 	 * @brief Set the desired user ID. Only for host mode.
@@ -72,6 +74,18 @@ public:
 	 */
 	void setAllowDrawing(bool allowdrawing) { Q_ASSERT(_mode==HOST); _allowdrawing = allowdrawing; }
 
+	/**
+	 * @brief Set the number of undo steps the session keeps per user
+	 * @param undolimit
+	 */
+	void setUndoLimit(int undolimit) { Q_ASSERT(_mode==HOST); _undolimit = undolimit; }
+
+	/**
+	 * @brief Set whether to accept stream compression if the server offers it
+	 * @param compress
+	 */
+	void setCompression(bool compress) { _compress = compress; }
+
 	/**
 	 * @brief Set the server we're communicating with
 	 * @param server
@@ -88,6 +102,15 @@ public:
 
 	const QUrl &url() const { return _address; }
 
+	/**
+	 * @brief Get the name of the session to host or join
+	 *
+	 * The session name is given as the path part of the URL. An empty
+	 * name means the server's default session.
+	 * @return session name
+	 */
+	QString sessionName() const;
+
 	/**
 	 * @brief get the user ID assigned by the server
 	 * @return user id
@@ -109,10 +132,14 @@ private:
 	QString _title;
 	int _maxusers;
 	bool _allowdrawing;
+	int _undolimit;
+
+	bool _compress;
 
 	Server *_server;
 	int _state;
 	bool _requirepass;
+	bool _sessionSelected;
 };
 
 }
@@ -71,6 +71,14 @@ void LoopbackServer::sendMessage(protocol::MessagePtr msg)
 				_layer_ids.reserve(lc.id());
 			break;
 		}
+		case MSG_LAYER_DUPLICATE: {
+			LayerDuplicate &ld = msg.cast<LayerDuplicate>();
+			if(ld.id() == 0)
+				ld.setId(_layer_ids.takeNext());
+			else
+				_layer_ids.reserve(ld.id());
+			break;
+		}
 		case MSG_ANNOTATION_CREATE: {
 			AnnotationCreate &ac = msg.cast<AnnotationCreate>();
 			if(ac.id() == 0)
@@ -91,7 +99,7 @@ void LoopbackServer::sendMessage(protocol::MessagePtr msg)
 #endif
 }
 
-void LoopbackServer::sendSnapshotMessages(QList<protocol::MessagePtr> msgs)
+void LoopbackServer::sendSnapshotMessages(QList<protocol::MessagePtr> msgs, bool complete)
 {
 	// There are no snapshots in loopback mode
 }
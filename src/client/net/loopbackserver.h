@@ -54,7 +54,7 @@ public:
 	 */
 	void sendMessage(protocol::MessagePtr msg);
 
-	void sendSnapshotMessages(QList<protocol::MessagePtr> msgs);
+	void sendSnapshotMessages(QList<protocol::MessagePtr> msgs, bool complete);
 
 	void logout();
 signals:
@@ -44,9 +44,16 @@ public:
      *
      * Unlike normal messages, the snapshot messages are kept in a separate queue
      * and are sent asynchronously so snapshot uploading won't entirely block this user.
+     * The snapshot may be sent in parts.
      * @param msgs
+     * @param complete is this the last part of the snapshot
      */
-    virtual void sendSnapshotMessages(QList<protocol::MessagePtr> msgs) = 0;
+    virtual void sendSnapshotMessages(QList<protocol::MessagePtr> msgs, bool complete) = 0;
+
+    /**
+     * @brief Discard the snapshot messages that haven't been sent yet
+     */
+    virtual void abortSnapshot() {}
 
     /**
      * @brief Log out from the server
@@ -67,6 +74,22 @@ protected:
     virtual void loginFailure(const QString &message) {}
     virtual void loginSuccess() {}
 
+    /**
+     * @brief The protocol minor version of the session has been agreed on
+     *
+     * This is called just before the HOST or JOIN command is sent.
+     * @param minor protocol minor version
+     */
+    virtual void setProtocolVersion(int minor) {}
+
+    /**
+     * @brief Start compressing the message stream
+     *
+     * This is called right after a successful login, if the server offered
+     * compression and the user has it enabled.
+     */
+    virtual void startCompression() {}
+
 private:
     bool _local;
 };
@@ -21,17 +21,30 @@
 
 #include <QDebug>
 #include <QTcpSocket>
+#include <QTimer>
+#include <QElapsedTimer>
 
 #include "config.h"
 #include "tcpserver.h"
 #include "login.h"
 
 #include "../shared/net/messagequeue.h"
+#include "../shared/net/meta.h"
+#include "../shared/net/login.h"
+#include "../shared/net/pen.h"
 
 namespace net {
 
+/**
+ * Maximum time (in milliseconds) to spend processing received messages
+ * before returning to the event loop. Remaining messages are processed
+ * in the next event loop iteration, so the UI stays responsive even when
+ * a large burst of data is received.
+ */
+static const int PROCESSING_TIME_BUDGET = 8;
+
 TcpServer::TcpServer(QObject *parent) :
-	QObject(parent), Server(false), _loginstate(0)
+	QObject(parent), Server(false), _loginstate(0), _catchup(0), _backlog(0), _processingScheduled(false)
 {
 	_socket = new QTcpSocket(this);
 	_msgqueue = new protocol::MessageQueue(_socket, this);
@@ -72,20 +85,67 @@ void TcpServer::sendMessage(protocol::MessagePtr msg)
 	_msgqueue->send(msg);
 }
 
-void TcpServer::sendSnapshotMessages(QList<protocol::MessagePtr> msgs)
+void TcpServer::sendSnapshotMessages(QList<protocol::MessagePtr> msgs, bool complete)
 {
 	qDebug() << "sending" << msgs.length() << "snapshot messages";
-	_msgqueue->sendSnapshot(msgs);
+	_msgqueue->sendSnapshot(msgs, complete);
+}
+
+void TcpServer::abortSnapshot()
+{
+	_msgqueue->abortSnapshot();
 }
 
 void TcpServer::handleMessage()
 {
+	QElapsedTimer timer;
+	timer.start();
+
 	while(_msgqueue->isPending()) {
-		protocol::MessagePtr msg = _msgqueue->getPending();
-		if(_loginstate)
-			_loginstate->receiveMessage(msg);
-		else
-			emit messageReceived(msg);
+		if(timer.elapsed() >= PROCESSING_TIME_BUDGET) {
+			// Out of time: continue in the next event loop iteration
+			if(!_processingScheduled) {
+				_processingScheduled = true;
+				QTimer::singleShot(0, this, SLOT(handleScheduledMessages()));
+			}
+			break;
+		}
+		processMessage(_msgqueue->getPending());
+	}
+
+	const int backlog = _msgqueue->pendingCount();
+	if(backlog != _backlog) {
+		_backlog = backlog;
+		emit messageBacklog(backlog);
+	}
+}
+
+void TcpServer::handleScheduledMessages()
+{
+	_processingScheduled = false;
+	handleMessage();
+}
+
+void TcpServer::processMessage(protocol::MessagePtr msg)
+{
+	if(msg->type() == protocol::MSG_STREAMPOS) {
+		// The messages following this one are the session history
+		// we need to catch up with.
+		_catchup = msg.cast<protocol::StreamPos>().bytes();
+		if(_catchup>0)
+			emit catchupStarted();
+	} else if(_loginstate) {
+		_loginstate->receiveMessage(msg);
+	} else if(msg->type() == protocol::MSG_LOGIN && msg.cast<protocol::Login>().isCompressionMarker()) {
+		// The server switched on compression. The message queue has already taken care of it.
+		qDebug() << "server stream compression enabled";
+	} else {
+		emit messageReceived(msg);
+		if(_catchup>0) {
+			_catchup -= msg->length();
+			if(_catchup<=0)
+				emit catchupFinished();
+		}
 	}
 }
 
@@ -98,6 +158,26 @@ void TcpServer::handleBadData(int len, int type)
 
 void TcpServer::handleDisconnect()
 {
+	// Process whatever was received before the connection was lost
+	while(_msgqueue->isPending())
+		processMessage(_msgqueue->getPending());
+
+	if(_backlog>0) {
+		_backlog = 0;
+		emit messageBacklog(0);
+	}
+
+	if(_catchup>0) {
+		_catchup = 0;
+		emit catchupFinished();
+	}
+
+	if(_msgqueue->isCompressing()) {
+		const protocol::CompressionStats cs = _msgqueue->compressionStats();
+		qDebug() << "compression: sent" << cs.rawSent << "->" << cs.compressedSent << "bytes in" << cs.deflateNsecs / 1000000.0 << "ms,"
+			<< "received" << cs.rawReceived << "->" << cs.compressedReceived << "bytes in" << cs.inflateNsecs / 1000000.0 << "ms";
+	}
+
 	emit serverDisconnected(_error);
 	deleteLater();
 }
@@ -128,4 +208,14 @@ void TcpServer::loginSuccess()
 	_loginstate = 0;
 }
 
+void TcpServer::setProtocolVersion(int minor)
+{
+	_msgqueue->setCompactPenMove(minor >= protocol::PenMove::COMPACT_MINOR_VERSION);
+}
+
+void TcpServer::startCompression()
+{
+	_msgqueue->startCompression();
+}
+
 }
@@ -45,7 +45,8 @@ public:
 	void logout();
 
 	void sendMessage(protocol::MessagePtr msg);
-	void sendSnapshotMessages(QList<protocol::MessagePtr> msgs);
+	void sendSnapshotMessages(QList<protocol::MessagePtr> msgs, bool complete);
+	void abortSnapshot();
 
 	bool isLoggedIn() const { return _loginstate == 0; }
 
@@ -61,21 +62,38 @@ signals:
 	void bytesSent(int);
 	void messageReceived(protocol::MessagePtr message);
 
+	//! Number of received messages still waiting to be processed
+	void messageBacklog(int count);
+
+	//! Catch-up replay of the session history begins
+	void catchupStarted();
+
+	//! All the messages announced by the stream position message have been received
+	void catchupFinished();
+
 protected:
 	void loginFailure(const QString &message) override;
 	void loginSuccess() override;
+	void setProtocolVersion(int minor) override;
+	void startCompression() override;
 
 private slots:
 	void handleMessage();
+	void handleScheduledMessages();
 	void handleBadData(int len, int type);
 	void handleDisconnect();
 	void handleSocketError();
 
 private:
+	void processMessage(protocol::MessagePtr msg);
+
 	QTcpSocket *_socket;
 	protocol::MessageQueue *_msgqueue;
 	LoginHandler *_loginstate;
 	QString _error;
+	int _catchup;
+	int _backlog;
+	bool _processingScheduled;
 };
 
 }
@@ -30,7 +30,7 @@
 
 #include "../shared/net/layer.h"
 #include "../shared/net/annotation.h"
-#include "net/utils.h"
+#include "core/netutils.h"
 
 using protocol::MessagePtr;
 
@@ -169,7 +169,7 @@ bool Reader::loadLayers(ZipReader &zip, const QDomElement& stack, QPoint offset)
 			// Create layer
 			QString name = e.attribute("name", QApplication::tr("Unnamed layer"));
 			_commands.append(MessagePtr(new protocol::LayerCreate(
-				1,
+				0,
 				++_layerid,
 				0,
 				name
@@ -179,7 +179,7 @@ bool Reader::loadLayers(ZipReader &zip, const QDomElement& stack, QPoint offset)
 				e.attribute("x", "0").toInt(),
 				e.attribute("y", "0").toInt()
 				);
-			_commands.append(net::putQImage(_layerid, layerPos.x(), layerPos.y(), content, false));
+			_commands.append(net::putQImage(0, _layerid, layerPos.x(), layerPos.y(), content, false));
 
 			QString compositeOp = e.attribute("composite-op", "src-over");
 			int blendmode = dpcore::blendModeSvg(compositeOp);
@@ -189,6 +189,7 @@ bool Reader::loadLayers(ZipReader &zip, const QDomElement& stack, QPoint offset)
 			}
 
 			_commands.append(MessagePtr(new protocol::LayerAttributes(
+				0,
 				_layerid,
 				qRound(255 * e.attribute("opacity", "1.0").toDouble()),
 				blendmode
@@ -19,12 +19,13 @@
 
 */
 #include <QDebug>
+#include <QImage>
 
 #include "statetracker.h"
 #include "canvasscene.h" // needed for annotations
 #include "annotationitem.h"
-#include "loader.h"
-
+#include "core/checkpoint.h"
+#include "core/snapshotgenerator.h"
 #include "core/layerstack.h"
 #include "core/layer.h"
 
@@ -32,8 +33,6 @@
 #include "net/layerlist.h"
 
 #include "../shared/net/pen.h"
-#include "../shared/net/layer.h"
-#include "../shared/net/image.h"
 #include "../shared/net/annotation.h"
 
 namespace drawingboard {
@@ -44,69 +43,111 @@ StateTracker::StateTracker(CanvasScene *scene, net::Client *client, QObject *par
 	  _image(scene->layers()),
 	  _layerlist(client->layerlist()),
 	  _myid(client->myId()),
-	  _hassnapshot(true),
-	  _msgstream_sizelimit(1024 * 1024 * 10)
+	  _msgstream_sizelimit(1024 * 1024 * 10),
+	  _catchup(false),
+	  _state(_image)
 {
 	connect(client, SIGNAL(layerVisibilityChange(int,bool)), _image, SLOT(setLayerHidden(int,bool)));
+	connect(this, SIGNAL(myImageDeltaHandled(int,QRect,quint32,bool)), client, SLOT(handleImageDelta(int,QRect,quint32,bool)));
+
+	connect(&_state, SIGNAL(canvasResized(QPoint)), this, SLOT(canvasResized(QPoint)));
+	connect(&_state, SIGNAL(layerCreated(int,int,QString)), this, SLOT(layerCreated(int,int,QString)));
+	connect(&_state, SIGNAL(layerAttributesChanged(int,int,int)), this, SLOT(layerAttributesChanged(int,int,int)));
+	connect(&_state, SIGNAL(layerRetitled(int,QString)), this, SLOT(layerRetitled(int,QString)));
+	connect(&_state, SIGNAL(layersReordered(QList<uint8_t>)), this, SLOT(layersReordered(QList<uint8_t>)));
+	connect(&_state, SIGNAL(layerDeleted(int)), this, SLOT(layerDeleted(int)));
+	connect(&_state, SIGNAL(layersRestored()), this, SLOT(layersRestored()));
+	connect(&_state, SIGNAL(penMoved(int,int)), this, SLOT(penMoved(int,int)));
+	connect(&_state, SIGNAL(imageDeltaHandled(int,int,QRect,quint32,bool)), this, SLOT(imageDeltaHandled(int,int,QRect,quint32,bool)));
 }
 
 void StateTracker::receiveCommand(protocol::MessagePtr msg)
 {
-	switch(msg->type()) {
-		using namespace protocol;
-		case MSG_CANVAS_RESIZE:
-			handleCanvasResize(msg.cast<CanvasResize>());
-			break;
-		case MSG_LAYER_CREATE:
-			handleLayerCreate(msg.cast<LayerCreate>());
-			break;
-		case MSG_LAYER_ATTR:
-			handleLayerAttributes(msg.cast<LayerAttributes>());
-			break;
-		case MSG_LAYER_RETITLE:
-			handleLayerTitle(msg.cast<LayerRetitle>());
-			break;
-		case MSG_LAYER_ORDER:
-			handleLayerOrder(msg.cast<LayerOrder>());
-			break;
-		case MSG_LAYER_DELETE:
-			handleLayerDelete(msg.cast<LayerDelete>());
-			break;
-		case MSG_TOOLCHANGE:
-			handleToolChange(msg.cast<ToolChange>());
-			break;
-		case MSG_PEN_MOVE:
-			handlePenMove(msg.cast<PenMove>());
-			break;
-		case MSG_PEN_UP:
-			handlePenUp(msg.cast<PenUp>());
-			break;
-		case MSG_PUTIMAGE:
-			handlePutImage(msg.cast<PutImage>());
-			break;
-		case MSG_ANNOTATION_CREATE:
-			handleAnnotationCreate(msg.cast<AnnotationCreate>());
-			break;
-		case MSG_ANNOTATION_RESHAPE:
-			handleAnnotationReshape(msg.cast<AnnotationReshape>());
-			break;
-		case MSG_ANNOTATION_EDIT:
-			handleAnnotationEdit(msg.cast<AnnotationEdit>());
-			break;
-		case MSG_ANNOTATION_DELETE:
-			handleAnnotationDelete(msg.cast<AnnotationDelete>());
-			break;
-		default:
-			qWarning() << "Unhandled drawing command" << msg->type();
-			return;
+	if(!_state.receiveCommand(msg)) {
+		// Annotations are not part of the canvas state
+		switch(msg->type()) {
+			using namespace protocol;
+			case MSG_ANNOTATION_CREATE:
+				handleAnnotationCreate(msg.cast<AnnotationCreate>());
+				break;
+			case MSG_ANNOTATION_RESHAPE:
+				handleAnnotationReshape(msg.cast<AnnotationReshape>());
+				break;
+			case MSG_ANNOTATION_EDIT:
+				handleAnnotationEdit(msg.cast<AnnotationEdit>());
+				break;
+			case MSG_ANNOTATION_DELETE:
+				handleAnnotationDelete(msg.cast<AnnotationDelete>());
+				break;
+			default:
+				qWarning() << "Unhandled drawing command" << msg->type();
+				return;
+		}
 	}
 
 	_msgstream.append(msg);
-	if(_msgstream_sizelimit>0 && _msgstream.lengthInBytes() > _msgstream_sizelimit) {
-		qDebug() << "Message stream history size limit reached at" << _msgstream.lengthInBytes() / float(1024*1024) << "Mb. Clearing..";
-		_msgstream.clear();
-		_hassnapshot = false;
+
+	// A checkpoint can only be made between strokes, since the strokes
+	// in progress would not continue correctly from it.
+	if(_msgstream_sizelimit>0 && _msgstream.lengthInBytes() > _msgstream_sizelimit && _state.isIdle()) {
+		qDebug() << "Message stream history size limit reached at" << _msgstream.lengthInBytes() / float(1024*1024) << "Mb. Making a checkpoint..";
+		makeCheckpoint();
+	}
+}
+
+CanvasCheckpoint *StateTracker::createCheckpoint() const
+{
+	QList<CanvasCheckpoint::Annotation> annotations;
+	foreach(const AnnotationItem *a, _scene->getAnnotations()) {
+		CanvasCheckpoint::Annotation ann;
+		ann.id = a->id();
+		ann.geometry = a->geometry();
+		ann.color = a->backgroundColor().rgba();
+		ann.text = a->text();
+		annotations.append(ann);
 	}
+
+	return new CanvasCheckpoint(&_state, _scene->title(), annotations);
+}
+
+/**
+ * Save the current state of the canvas and discard the history before it.
+ * No pixel data is copied, so this is cheap to do.
+ */
+void StateTracker::makeCheckpoint()
+{
+	_checkpoint = QSharedPointer<CanvasCheckpoint>(createCheckpoint());
+	_msgstream.clear();
+}
+
+void StateTracker::setCatchupMode(bool catchup)
+{
+	if(catchup == _catchup)
+		return;
+
+	_catchup = catchup;
+	_image->suspendUpdates(catchup);
+	if(!catchup)
+		refreshLayerList();
+}
+
+/**
+ * @brief Rebuild the layer list from the layer stack
+ */
+void StateTracker::refreshLayerList()
+{
+	QVector<net::LayerListItem> items;
+	items.reserve(_image->layers());
+
+	// Layer list is shown topmost first
+	for(int i=_image->layers()-1;i>=0;--i) {
+		const dpcore::Layer *layer = _image->getLayerByIndex(i);
+		net::LayerListItem item(layer->id(), layer->title(), layer->opacity() / 255.0, layer->hidden());
+		item.blend = layer->blendmode();
+		items.append(item);
+	}
+
+	_layerlist->setLayers(items);
 }
 
 /**
@@ -114,7 +155,7 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
  */
 void StateTracker::endRemoteContexts()
 {
-	QHashIterator<int, DrawingContext> iter(_contexts);
+	QHashIterator<int, DrawingContext> iter(_state.drawingContexts());
 	while(iter.hasNext()) {
 		iter.next();
 		if(iter.key() != _myid) {
@@ -125,164 +166,74 @@ void StateTracker::endRemoteContexts()
 	}
 }
 
-QList<protocol::MessagePtr> StateTracker::generateSnapshot(bool forcenew)
+SnapshotGenerator *StateTracker::generateSnapshot(bool forcenew)
 {
-	if(!_hassnapshot || forcenew) {
-		// Generate snapshot
-		QList<protocol::MessagePtr> snapshot = SnapshotLoader(_scene).loadInitCommands();
+	if(forcenew)
+		makeCheckpoint();
 
-		// Replace old message stream with snapshot since it didn't contain one
-		_msgstream.clear();
-		foreach(protocol::MessagePtr ptr, snapshot)
-			_msgstream.append(ptr);
-
-		// Update size limit
-		if(_msgstream_sizelimit>0 && _msgstream.lengthInBytes() > _msgstream_sizelimit)
-			_msgstream_sizelimit = 2 * _msgstream.lengthInBytes();
-
-		_hassnapshot = true;
-
-		return snapshot;
-	} else {
-		// Message stream contains (starts with) a snapshot: return it
-		return _msgstream.toList();
-	}
+	return new SnapshotGenerator(_checkpoint, _msgstream.toList());
 }
 
-void StateTracker::handleCanvasResize(const protocol::CanvasResize &cmd)
+void StateTracker::canvasResized(const QPoint &offset)
 {
-	if(_image->width()>0) {
-		// TODO support actual resizing
-		qWarning() << "canvas resize is currently supported on session initialization only.";
-	} else {
-		_image->init(QSize(cmd.width(), cmd.height()));
+	// Move annotations along with the image content
+	if(!offset.isNull()) {
+		foreach(AnnotationItem *item, _scene->getAnnotations())
+			item->setGeometry(item->geometry().translated(offset));
 	}
 }
 
-void StateTracker::handleLayerCreate(const protocol::LayerCreate &cmd)
-{
-	_image->addLayer(cmd.id(), cmd.title(), QColor::fromRgba(cmd.fill()));
-	_layerlist->createLayer(cmd.id(), cmd.title());
-	if(cmd.contextId() == _myid)
-		emit myLayerCreated(cmd.id());
-}
-
-void StateTracker::handleLayerAttributes(const protocol::LayerAttributes &cmd)
+void StateTracker::layerCreated(int ctx, int id, const QString &title)
 {
-	dpcore::Layer *layer = _image->getLayer(cmd.id());
-	if(!layer) {
-		qWarning() << "received layer attributes for non-existent layer" << cmd.id();
+	if(_catchup)
 		return;
-	}
-	
-	layer->setOpacity(cmd.opacity());
-	layer->setBlend(cmd.blend());
-	_layerlist->changeLayer(cmd.id(), cmd.opacity() / 255.0, cmd.blend());
+
+	_layerlist->createLayer(id, title);
+	if(ctx == _myid)
+		emit myLayerCreated(id);
 }
 
-void StateTracker::handleLayerTitle(const protocol::LayerRetitle &cmd)
+void StateTracker::layerAttributesChanged(int id, int opacity, int blend)
 {
-	dpcore::Layer *layer = _image->getLayer(cmd.id());
-	if(!layer) {
-		qWarning() << "received layer title for non-existent layer" << cmd.id();
-		return;
-	}
-
-	layer->setTitle(cmd.title());
-	_layerlist->retitleLayer(cmd.id(), cmd.title());
+	if(!_catchup)
+		_layerlist->changeLayer(id, opacity / 255.0, blend);
 }
 
-void StateTracker::handleLayerOrder(const protocol::LayerOrder &cmd)
+void StateTracker::layerRetitled(int id, const QString &title)
 {
-	_image->reorderLayers(cmd.order());
-	_layerlist->reorderLayers(cmd.order());
+	if(!_catchup)
+		_layerlist->retitleLayer(id, title);
 }
 
-void StateTracker::handleLayerDelete(const protocol::LayerDelete &cmd)
+void StateTracker::layersReordered(const QList<uint8_t> &order)
 {
-	if(cmd.merge())
-		_image->mergeLayerDown(cmd.id());
-	_image->deleteLayer(cmd.id());
-	_layerlist->deleteLayer(cmd.id());
+	if(!_catchup)
+		_layerlist->reorderLayers(order);
 }
 
-void StateTracker::handleToolChange(const protocol::ToolChange &cmd)
+void StateTracker::layerDeleted(int id)
 {
-	DrawingContext &ctx = _contexts[cmd.contextId()];
-	dpcore::Brush &b = ctx.tool.brush;
-	ctx.tool.layer_id = cmd.layer();
-	b.setBlendingMode(cmd.blend());
-	b.setSubpixel(cmd.mode() & protocol::TOOL_MODE_SUBPIXEL);
-	b.setIncremental(cmd.mode() & protocol::TOOL_MODE_INCREMENTAL);
-	b.setSpacing(cmd.spacing());
-	b.setRadius(cmd.size_h());
-	b.setRadius2(cmd.size_l());
-	b.setHardness(cmd.hard_h() / 255.0);
-	b.setHardness2(cmd.hard_l() / 255.0);
-	b.setOpacity(cmd.opacity_h() / 255.0);
-	b.setOpacity2(cmd.opacity_l() / 255.0);
-	b.setColor(cmd.color_h());
-	b.setColor2(cmd.color_l());
+	if(!_catchup)
+		_layerlist->deleteLayer(id);
 }
 
-void StateTracker::handlePenMove(const protocol::PenMove &cmd)
+void StateTracker::layersRestored()
 {
-	DrawingContext &ctx = _contexts[cmd.contextId()];
-	dpcore::Layer *layer = _image->getLayer(ctx.tool.layer_id);
-	if(!layer) {
-		qWarning() << "penMove by user" << cmd.contextId() << "on non-existent layer" << ctx.tool.layer_id;
-		return;
-	}
-	
-	dpcore::Point p;
-	foreach(const protocol::PenPoint pp, cmd.points()) {
-		// The coordinate encoding code is in net/client.cpp
-		p = dpcore::Point(
-			(pp.x >> 2) - 128,
-			(pp.y >> 2) - 128,
-			(pp.x & 3) / 4.0,
-			(pp.y & 3) / 4.0,
-			pp.p/255.0
-		);
-
-		if(ctx.pendown) {
-			layer->drawLine(cmd.contextId(), ctx.tool.brush, ctx.lastpoint, p, ctx.distance_accumulator);
-		} else {
-			ctx.pendown = true;
-			ctx.distance_accumulator = 0;
-			layer->dab(cmd.contextId(), ctx.tool.brush, p);
-		}
-		ctx.lastpoint = p;
-	}
-	if(cmd.contextId() == _myid)
-		_scene->takePreview(cmd.points().size());
+	if(!_catchup)
+		refreshLayerList();
 }
 
-void StateTracker::handlePenUp(const protocol::PenUp &cmd)
+void StateTracker::penMoved(int ctx, int points)
 {
-	DrawingContext &ctx = _contexts[cmd.contextId()];
-	dpcore::Layer *layer = _image->getLayer(ctx.tool.layer_id);
-	if(!layer) {
-		qWarning() << "penUp by user" << cmd.contextId() << "on non-existent layer" << ctx.tool.layer_id;
-		return;
-	}
-
-	// This ends an indirect stroke. In incremental mode, this does nothing.
-	layer->mergeSublayer(cmd.contextId());
-
-	ctx.pendown = false;
+	if(ctx == _myid && !_catchup)
+		_scene->takePreview(points);
 }
 
-void StateTracker::handlePutImage(const protocol::PutImage &cmd)
+void StateTracker::imageDeltaHandled(int ctx, int layer, const QRect &rect, quint32 checksum, bool applied)
 {
-	dpcore::Layer *layer = _image->getLayer(cmd.layer());
-	if(!layer) {
-		qWarning() << "putImage on non-existent layer" << cmd.layer();
-		return;
-	}
-	QByteArray data = qUncompress(cmd.image());
-	QImage img(reinterpret_cast<const uchar*>(data.constData()), cmd.width(), cmd.height(), QImage::Format_ARGB32);
-	layer->putImage(cmd.x(), cmd.y(), img, (cmd.flags() & protocol::PutImage::MODE_BLEND));
+	// Let the client know if its delta image has to be resent in full
+	if(ctx == _myid && !_catchup)
+		emit myImageDeltaHandled(layer, rect, checksum, applied);
 }
 
 void StateTracker::handleAnnotationCreate(const protocol::AnnotationCreate &cmd)
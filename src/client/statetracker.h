@@ -23,33 +23,19 @@
 
 #include <QObject>
 #include <QHash>
+#include <QSharedPointer>
 
-#include "core/brush.h"
-#include "core/point.h"
+#include "core/canvasstate.h"
 #include "../shared/net/message.h"
 #include "../shared/net/messagestream.h"
 
 namespace protocol {
-	class CanvasResize;
-	class LayerCreate;
-	class LayerAttributes;
-	class LayerRetitle;
-	class LayerOrder;
-	class LayerDelete;
-	class ToolChange;
-	class PenMove;
-	class PenUp;
-	class PutImage;
 	class AnnotationCreate;
 	class AnnotationReshape;
 	class AnnotationEdit;
 	class AnnotationDelete;
 }
 
-namespace dpcore {
-	class LayerStack;
-}
-
 namespace net {
 	class Client;
 	class LayerListModel;
@@ -59,38 +45,15 @@ namespace drawingboard {
 
 class CanvasScene;
 class AnnotationItem;
-
-struct ToolContext {
-	int layer_id;
-	dpcore::Brush brush;
-};
-
-/**
- * \brief User state
- * 
- * The drawing context captures the state needed by a single user for drawing.
- */
-struct DrawingContext {
-	DrawingContext() : pendown(false), distance_accumulator(0) {}
-	
-	//! Currently selected tool
-	ToolContext tool;
-	
-	//! Last pen-move point
-	dpcore::Point lastpoint;
-	
-	//! Is the stroke currently in progress?
-	bool pendown;
-	
-	//! Stroke length (used for dab spacing)
-	qreal distance_accumulator;
-};
+class CanvasCheckpoint;
+class SnapshotGenerator;
 
 /**
  * \brief Drawing context state tracker
  * 
- * The state tracker object keeps track of each drawing context and performs
- * the drawing using the paint engine.
+ * The state tracker object feeds the received commands to the canvas state,
+ * which does the drawing, and keeps the user interface in sync with it.
+ * It also keeps the history needed for making snapshots.
  */
 class StateTracker : public QObject {
 	Q_OBJECT
@@ -101,52 +64,94 @@ public:
 
 	void endRemoteContexts();
 
-	QList<protocol::MessagePtr> generateSnapshot(bool forcenew);
+	/**
+	 * @brief Prepare to generate the commands that recreate the current canvas
+	 *
+	 * The snapshot consists of the latest checkpoint followed by the
+	 * commands received after it. Encoding the checkpoint is slow, so it
+	 * is done by the returned generator thread, which must be started
+	 * by the caller.
+	 * @param forcenew make a new checkpoint of the current state first
+	 * @return snapshot generator
+	 */
+	SnapshotGenerator *generateSnapshot(bool forcenew);
 
-	const QHash<int, DrawingContext> &drawingContexts() const { return _contexts; }
+	/**
+	 * @brief Save the current state of the canvas
+	 *
+	 * No pixel data is copied, so this is cheap to do.
+	 * @return new checkpoint
+	 */
+	CanvasCheckpoint *createCheckpoint() const;
+
+	const QHash<int, DrawingContext> &drawingContexts() const { return _state.drawingContexts(); }
 
 	/**
 	 * @brief Set the maximum length of the stored history.
+	 *
+	 * When the history grows longer than this, a checkpoint of the
+	 * canvas is made and the history before it is discarded.
 	 * @param length
 	 */
 	void setMaxHistorySize(uint limit) { _msgstream_sizelimit = limit; }
 
+	/**
+	 * @brief Enable or disable catch-up mode
+	 *
+	 * In catch-up mode, commands are applied to the canvas without updating
+	 * the user interface. When catch-up mode ends, the canvas and the layer
+	 * list are refreshed in one go.
+	 * @param catchup
+	 */
+	void setCatchupMode(bool catchup);
+
+	//! Is catch-up mode on?
+	bool isCatchupMode() const { return _catchup; }
+
 signals:
 	void myAnnotationCreated(AnnotationItem *item);
 	void myLayerCreated(int);
 
+	//! A delta coded image sent by the local user was applied or rejected
+	void myImageDeltaHandled(int layer, const QRect &rect, quint32 checksum, bool applied);
+
+private slots:
+	void canvasResized(const QPoint &offset);
+	void layerCreated(int ctx, int id, const QString &title);
+	void layerAttributesChanged(int id, int opacity, int blend);
+	void layerRetitled(int id, const QString &title);
+	void layersReordered(const QList<uint8_t> &order);
+	void layerDeleted(int id);
+	void layersRestored();
+	void penMoved(int ctx, int points);
+	void imageDeltaHandled(int ctx, int layer, const QRect &rect, quint32 checksum, bool applied);
+
 private:
-	// Layer related commands
-	void handleCanvasResize(const protocol::CanvasResize &cmd);
-	void handleLayerCreate(const protocol::LayerCreate &cmd);
-	void handleLayerAttributes(const protocol::LayerAttributes &cmd);
-	void handleLayerTitle(const protocol::LayerRetitle &cmd);
-	void handleLayerOrder(const protocol::LayerOrder &cmd);
-	void handleLayerDelete(const protocol::LayerDelete &cmd);
-	
-	// Drawing related commands
-	void handleToolChange(const protocol::ToolChange &cmd);
-	void handlePenMove(const protocol::PenMove &cmd);
-	void handlePenUp(const protocol::PenUp &cmd);
-	void handlePutImage(const protocol::PutImage &cmd);
-	
 	// Annotation related commands
 	void handleAnnotationCreate(const protocol::AnnotationCreate &cmd);
 	void handleAnnotationReshape(const protocol::AnnotationReshape &cmd);
 	void handleAnnotationEdit(const protocol::AnnotationEdit &cmd);
 	void handleAnnotationDelete(const protocol::AnnotationDelete &cmd);
 
-	QHash<int, DrawingContext> _contexts;
-	
+	void refreshLayerList();
+	void makeCheckpoint();
+
 	CanvasScene *_scene;
 	dpcore::LayerStack *_image;
 	net::LayerListModel *_layerlist;
 
 	int _myid;
 
+	//! Commands received since the latest checkpoint
 	protocol::MessageStream _msgstream;
-	bool _hassnapshot;
 	uint _msgstream_sizelimit;
+
+	//! The latest checkpoint (null if the history starts from the beginning)
+	QSharedPointer<CanvasCheckpoint> _checkpoint;
+
+	bool _catchup;
+
+	CanvasState _state;
 };
 
 }
@@ -29,13 +29,14 @@
 
 #include "textloader.h"
 #include "core/rasterop.h"
-#include "net/utils.h"
+#include "core/netutils.h"
 
 #include "../shared/net/annotation.h"
 #include "../shared/net/image.h"
 #include "../shared/net/layer.h"
 #include "../shared/net/meta.h"
 #include "../shared/net/pen.h"
+#include "../shared/net/undo.h"
 
 
 using protocol::MessagePtr;
@@ -117,12 +118,14 @@ Params extractParams(const QString &string)
 void TextCommandLoader::handleResize(const QString &args)
 {
 	QStringList wh = args.split(' ');
-	if(wh.count() != 2)
-		throw SyntaxError("Expected width and height");
+	if(wh.count() != 2 && wh.count() != 4)
+		throw SyntaxError("Expected width and height and optional x and y offset");
 
 	_messages.append(MessagePtr(new protocol::CanvasResize(
 		str2int(wh[0]),
-		str2int(wh[1])
+		str2int(wh[1]),
+		wh.count()==4 ? str2int(wh[2]) : 0,
+		wh.count()==4 ? str2int(wh[3]) : 0
 	)));
 }
 
@@ -144,6 +147,30 @@ void TextCommandLoader::handleNewLayer(const QString &args)
 	)));
 }
 
+void TextCommandLoader::handleDuplicateLayer(const QString &args)
+{
+	QRegularExpression re("(\\d+) (\\d+) (\\d+) (.*)");
+	QRegularExpressionMatch m = re.match(args);
+	if(!m.hasMatch())
+		throw SyntaxError("Expected context id, layer id, source layer id and title");
+
+	const int source = str2int(m.captured(3));
+	if(!_layer.contains(source))
+		throw SyntaxError(QString("Layer %1 does not exist").arg(source));
+
+	net::LayerListItem layer = _layer[source];
+	layer.id = str2int(m.captured(2));
+	layer.title = m.captured(4);
+	_layer[layer.id] = layer;
+
+	_messages.append(MessagePtr(new protocol::LayerDuplicate(
+		str2int(m.captured(1)),
+		layer.id,
+		source,
+		layer.title
+	)));
+}
+
 void TextCommandLoader::handleLayerAttr(const QString &args)
 {
 	// extract ID
@@ -172,7 +199,7 @@ void TextCommandLoader::handleLayerAttr(const QString &args)
 		++i;
 	}
 
-	_messages.append(MessagePtr(new protocol::LayerAttributes(id, layer.opacity*255, layer.blend)));
+	_messages.append(MessagePtr(new protocol::LayerAttributes(0, id, layer.opacity*255, layer.blend)));
 }
 
 void TextCommandLoader::handleRetitleLayer(const QString &args)
@@ -186,6 +213,7 @@ void TextCommandLoader::handleRetitleLayer(const QString &args)
 	layer.title = m.captured(2);
 
 	_messages.append(MessagePtr(new protocol::LayerRetitle(
+		0,
 		layer.id,
 		layer.title
 	)));
@@ -197,7 +225,7 @@ void TextCommandLoader::handleDeleteLayer(const QString &args)
 	QRegularExpressionMatch m = re.match(args);
 	if(!m.hasMatch())
 		throw SyntaxError("Expected id and title");
-	_messages.append(MessagePtr(new protocol::LayerDelete(str2int(m.captured(1)), m.captured(2).isEmpty() ? false : true)));
+	_messages.append(MessagePtr(new protocol::LayerDelete(0, str2int(m.captured(1)), m.captured(2).isEmpty() ? false : true)));
 }
 
 void TextCommandLoader::handleReorderLayers(const QString &args)
@@ -207,7 +235,7 @@ void TextCommandLoader::handleReorderLayers(const QString &args)
 	foreach(const QString &token, tokens) {
 		ids << str2int(token);
 	}
-	_messages.append(MessagePtr(new protocol::LayerOrder(ids)));
+	_messages.append(MessagePtr(new protocol::LayerOrder(0, ids)));
 }
 
 
@@ -288,7 +316,9 @@ void TextCommandLoader::handlePenMove(const QString &args)
 		));
 	}
 
-	_messages.append(MessagePtr(new protocol::PenMove(id, net::pointsToProtocol(points))));
+	const protocol::PenPointVector ppvec = net::pointsToProtocol(points);
+	for(int i=0;i<ppvec.size();i+=protocol::PenMove::MAX_POINTS)
+		_messages.append(MessagePtr(new protocol::PenMove(id, ppvec.mid(i, protocol::PenMove::MAX_POINTS))));
 }
 
 void TextCommandLoader::handlePenUp(const QString &args)
@@ -297,6 +327,18 @@ void TextCommandLoader::handlePenUp(const QString &args)
 	_messages.append(MessagePtr(new protocol::PenUp(id)));
 }
 
+void TextCommandLoader::handleUndo(const QString &args)
+{
+	int id = str2ctxid(args);
+	_messages.append(MessagePtr(new protocol::Undo(id)));
+}
+
+void TextCommandLoader::handleRedo(const QString &args)
+{
+	int id = str2ctxid(args);
+	_messages.append(MessagePtr(new protocol::Redo(id)));
+}
+
 void TextCommandLoader::handlePutImage(const QString &args)
 {
 	QRegularExpression re("(\\d+) (\\d+) (\\d+)(?: (blend))? ([\\w.]+)");
@@ -312,7 +354,7 @@ void TextCommandLoader::handlePutImage(const QString &args)
 
 	QImage image(filename.absoluteFilePath());
 
-	_messages.append(net::putQImage(layer, x, y, image, blend));
+	_messages.append(net::putQImage(0, layer, x, y, image, blend));
 }
 
 void TextCommandLoader::handleAddAnnotation(const QString &args)
@@ -411,6 +453,8 @@ bool TextCommandLoader::load()
 				handleResize(args);
 			else if(cmd=="newlayer")
 				handleNewLayer(args);
+			else if(cmd=="duplicatelayer")
+				handleDuplicateLayer(args);
 			else if(cmd=="layerattr")
 				handleLayerAttr(args);
 			else if(cmd=="retitlelayer")
@@ -427,6 +471,10 @@ bool TextCommandLoader::load()
 				handlePenUp(args);
 			else if(cmd=="putimage")
 				handlePutImage(args);
+			else if(cmd=="undo")
+				handleUndo(args);
+			else if(cmd=="redo")
+				handleRedo(args);
 			else if(cmd=="addannotation")
 				handleAddAnnotation(args);
 			else if(cmd=="reshapeannotation")
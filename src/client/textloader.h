@@ -43,6 +43,7 @@ private:
 
 	void handleResize(const QString &args);
 	void handleNewLayer(const QString &args);
+	void handleDuplicateLayer(const QString &args);
 	void handleLayerAttr(const QString &args);
 	void handleRetitleLayer(const QString &args);
 	void handleDeleteLayer(const QString &args);
@@ -53,6 +54,9 @@ private:
 	void handlePenUp(const QString &args);
 	void handlePutImage(const QString &args);
 
+	void handleUndo(const QString &args);
+	void handleRedo(const QString &args);
+
 	void handleAddAnnotation(const QString &args);
 	void handleReshapeAnnotation(const QString &args);
 	void handlEditAnnotation(const QString &args);
@@ -26,12 +26,14 @@
 #include "tools.h"
 #include "toolsettings.h"
 #include "core/brush.h"
+#include "core/layerstack.h"
+#include "core/layer.h"
 #include "canvasscene.h"
 #include "annotationitem.h"
 #include "selectionitem.h"
 
 #include "net/client.h"
-#include "net/utils.h"
+#include "core/netutils.h"
 #include "docks/toolsettingswidget.h"
 #include "statetracker.h"
 
@@ -311,7 +313,9 @@ void Selection::begin(const dpcore::Point &point, bool right)
 			if(image.size() != rect.size())
 				image = image.scaled(rect.size(), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
 
-			client().sendImage(layer(), rect.x(), rect.y(), image, true);
+			// Send the current content too, so the image can be delta coded against it
+			const dpcore::Layer *l = scene().layers()->getLayer(layer());
+			client().sendImage(layer(), rect.x(), rect.y(), image, true, l ? l->copyImage(rect) : QImage());
 			scene().setSelectionItem(0);
 		} else {
 			drawingboard::SelectionItem *sel = new drawingboard::SelectionItem();
@@ -49,6 +49,12 @@ NetStatus::NetStatus(QWidget *parent)
 	_progress->hide();
 	layout->addWidget(_progress);
 
+	// Number of received messages not yet processed (not always shown)
+	_backlog = new QLabel(this);
+	_backlog->setToolTip(tr("Received messages waiting to be processed"));
+	_backlog->hide();
+	layout->addWidget(_backlog);
+
 	// Host address label
 	_label = new QLabel(tr("not connected"), this);
 	_label->setTextInteractionFlags(
@@ -147,6 +153,15 @@ void NetStatus::expectBytes(int count)
 	_progress->show();
 }
 
+/**
+ * The expected byte count is the length of the messages in the classic
+ * encoding, so with a compact encoding fewer bytes than expected are received.
+ */
+void NetStatus::expectedBytesReceived()
+{
+	_progress->hide();
+}
+
 void NetStatus::bytesReceived(int count)
 {
 	// TODO show statistics
@@ -165,6 +180,20 @@ void NetStatus::bytesReceived(int count)
 	_timer->start(500);
 }
 
+/**
+ * @brief Show the number of received messages still waiting to be processed
+ * @param count backlog depth (the label is hidden when zero)
+ */
+void NetStatus::messageBacklog(int count)
+{
+	if(count>0) {
+		_backlog->setText(tr("%1 queued").arg(count));
+		_backlog->show();
+	} else {
+		_backlog->hide();
+	}
+}
+
 void NetStatus::bytesSent(int count)
 {
 	// TODO show statistics
@@ -48,9 +48,10 @@ public slots:
 	void hostDisconnected();
 
 	void expectBytes(int count);
+	void expectedBytesReceived();
 	void bytesReceived(int count);
 	void bytesSent(int count);
-
+	void messageBacklog(int count);
 
 	void join(const QString& user);
 	void leave(const QString& user);
@@ -75,7 +76,7 @@ private:
 	QString fullAddress() const;
 
 	QProgressBar *_progress;
-	QLabel *_label, *_icon;
+	QLabel *_label, *_icon, *_backlog;
 	PopupMessage *_popup;
 	QString _address;
 	int _port;
@@ -0,0 +1,417 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+#include <QDebug>
+#include <QImage>
+
+#include "canvasstate.h"
+#include "layerstack.h"
+#include "layer.h"
+#include "tile.h"
+#include "netutils.h"
+
+#include "../shared/net/pen.h"
+#include "../shared/net/layer.h"
+#include "../shared/net/image.h"
+#include "../shared/net/undo.h"
+
+namespace drawingboard {
+
+CanvasState::CanvasState(dpcore::LayerStack *image, QObject *parent)
+	: QObject(parent), _image(image), _undo(image), _pendown(0), _previews(true)
+{
+}
+
+bool CanvasState::receiveCommand(const protocol::MessagePtr &msg)
+{
+	_undo.tick();
+
+	switch(msg->type()) {
+		using namespace protocol;
+		case MSG_CANVAS_RESIZE:
+			handleCanvasResize(msg.cast<CanvasResize>());
+			break;
+		case MSG_LAYER_CREATE:
+			handleLayerCreate(msg.cast<LayerCreate>());
+			break;
+		case MSG_LAYER_DUPLICATE:
+			handleLayerDuplicate(msg.cast<LayerDuplicate>());
+			break;
+		case MSG_LAYER_ATTR:
+			handleLayerAttributes(msg.cast<LayerAttributes>());
+			break;
+		case MSG_LAYER_RETITLE:
+			handleLayerTitle(msg.cast<LayerRetitle>());
+			break;
+		case MSG_LAYER_ORDER:
+			handleLayerOrder(msg.cast<LayerOrder>());
+			break;
+		case MSG_LAYER_DELETE:
+			handleLayerDelete(msg.cast<LayerDelete>());
+			break;
+		case MSG_TOOLCHANGE:
+			handleToolChange(msg.cast<ToolChange>());
+			break;
+		case MSG_PEN_MOVE:
+			handlePenMove(msg.cast<PenMove>());
+			break;
+		case MSG_PEN_UP:
+			handlePenUp(msg.cast<PenUp>());
+			break;
+		case MSG_PUTIMAGE:
+			handlePutImage(msg.cast<PutImage>());
+			break;
+		case MSG_PUTTILE:
+			handlePutTile(msg.cast<PutTile>());
+			break;
+		case MSG_UNDO:
+			handleUndo(msg.cast<Undo>());
+			break;
+		case MSG_REDO:
+			handleRedo(msg.cast<Redo>());
+			break;
+		case MSG_UNDO_HORIZON:
+			// Users who joined here have no history from before this point
+			_undo.clear();
+			_undo.setLimit(msg.cast<UndoHorizon>().undoLimit());
+			break;
+		default:
+			return false;
+	}
+	return true;
+}
+
+void CanvasState::handleCanvasResize(const protocol::CanvasResize &cmd)
+{
+	if(cmd.width()==0 || cmd.height()==0) {
+		qWarning() << "invalid canvas size" << cmd.width() << "x" << cmd.height();
+		return;
+	}
+
+	if(_image->width()>0) {
+		const QPoint offset(cmd.xOffset(), cmd.yOffset());
+		_image->resize(QSize(cmd.width(), cmd.height()), offset);
+
+		// Saved tile positions are no longer valid
+		_undo.clear();
+
+		// Strokes in progress move along with the image content
+		QMutableHashIterator<int, DrawingContext> ctx(_contexts);
+		while(ctx.hasNext()) {
+			ctx.next();
+			ctx.value().lastpoint += offset;
+		}
+		emit canvasResized(offset);
+	} else {
+		_image->init(QSize(cmd.width(), cmd.height()));
+	}
+}
+
+void CanvasState::handleLayerCreate(const protocol::LayerCreate &cmd)
+{
+	_image->addLayer(cmd.id(), cmd.title(), QColor::fromRgba(cmd.fill()));
+	_undo.addBarrier(-1);
+	emit layerCreated(cmd.contextId(), cmd.id(), cmd.title());
+}
+
+void CanvasState::handleLayerDuplicate(const protocol::LayerDuplicate &cmd)
+{
+	const dpcore::Layer *layer = _image->duplicateLayer(cmd.source(), cmd.id(), cmd.title());
+	if(!layer) {
+		qWarning() << "received layer duplicate of non-existent layer" << cmd.source();
+		return;
+	}
+	_undo.addBarrier(-1);
+	emit layerCreated(cmd.contextId(), cmd.id(), cmd.title());
+	emit layerAttributesChanged(cmd.id(), layer->opacity(), layer->blendmode());
+}
+
+void CanvasState::handleLayerAttributes(const protocol::LayerAttributes &cmd)
+{
+	dpcore::Layer *layer = _image->getLayer(cmd.id());
+	if(!layer) {
+		qWarning() << "received layer attributes for non-existent layer" << cmd.id();
+		return;
+	}
+
+	if(cmd.contextId() != 0) {
+		UndoPoint *undo = _undo.begin(cmd.contextId(), cmd.type());
+		_undo.addAction(undo, new LayerAttributeUndo(cmd.id(), layer->opacity(), layer->blendmode()), cmd.id());
+		_undo.finish(cmd.contextId());
+	}
+
+	layer->setOpacity(cmd.opacity());
+	layer->setBlend(cmd.blend());
+	emit layerAttributesChanged(cmd.id(), cmd.opacity(), cmd.blend());
+}
+
+void CanvasState::handleLayerTitle(const protocol::LayerRetitle &cmd)
+{
+	dpcore::Layer *layer = _image->getLayer(cmd.id());
+	if(!layer) {
+		qWarning() << "received layer title for non-existent layer" << cmd.id();
+		return;
+	}
+
+	if(cmd.contextId() != 0) {
+		UndoPoint *undo = _undo.begin(cmd.contextId(), cmd.type());
+		_undo.addAction(undo, new LayerTitleUndo(cmd.id(), layer->title()), cmd.id());
+		_undo.finish(cmd.contextId());
+	}
+
+	layer->setTitle(cmd.title());
+	emit layerRetitled(cmd.id(), cmd.title());
+}
+
+void CanvasState::handleLayerOrder(const protocol::LayerOrder &cmd)
+{
+	if(cmd.contextId() != 0) {
+		UndoPoint *undo = _undo.begin(cmd.contextId(), cmd.type());
+		_undo.addAction(undo, new LayerOrderUndo(_image->layerOrder()), -1);
+		_undo.finish(cmd.contextId());
+	}
+
+	_image->reorderLayers(cmd.order());
+	emit layersReordered(cmd.order());
+}
+
+void CanvasState::handleLayerDelete(const protocol::LayerDelete &cmd)
+{
+	// Layer IDs are assigned by the server, so deletion cannot be undone.
+	// Earlier changes to the affected layers can't be undone either.
+	if(cmd.merge()) {
+		const int index = _image->indexOf(cmd.id());
+		if(index > 0)
+			_undo.addBarrier(_image->getLayerByIndex(index-1)->id());
+		_image->mergeLayerDown(cmd.id());
+	}
+	_undo.addBarrier(cmd.id());
+	_undo.addBarrier(-1);
+	_image->deleteLayer(cmd.id());
+	emit layerDeleted(cmd.id());
+}
+
+void CanvasState::handleToolChange(const protocol::ToolChange &cmd)
+{
+	DrawingContext &ctx = _contexts[cmd.contextId()];
+	dpcore::Brush &b = ctx.tool.brush;
+	ctx.tool.layer_id = cmd.layer();
+	b.setBlendingMode(cmd.blend());
+	b.setSubpixel(cmd.mode() & protocol::TOOL_MODE_SUBPIXEL);
+	b.setIncremental(cmd.mode() & protocol::TOOL_MODE_INCREMENTAL);
+	b.setSpacing(cmd.spacing());
+	b.setRadius(cmd.size_h());
+	b.setRadius2(cmd.size_l());
+	b.setHardness(cmd.hard_h() / 255.0);
+	b.setHardness2(cmd.hard_l() / 255.0);
+	b.setOpacity(cmd.opacity_h() / 255.0);
+	b.setOpacity2(cmd.opacity_l() / 255.0);
+	b.setColor(cmd.color_h());
+	b.setColor2(cmd.color_l());
+}
+
+void CanvasState::handlePenMove(const protocol::PenMove &cmd)
+{
+	DrawingContext &ctx = _contexts[cmd.contextId()];
+	dpcore::Layer *layer = _image->getLayer(ctx.tool.layer_id);
+	if(!layer) {
+		qWarning() << "penMove by user" << cmd.contextId() << "on non-existent layer" << ctx.tool.layer_id;
+		return;
+	}
+
+	if(cmd.contextId() != 0) {
+		// A stroke is a single undo group. If the history was cleared
+		// in the middle of the stroke, the rest of it starts a new group.
+		UndoPoint *undo = ctx.pendown ? _undo.openPoint(cmd.contextId()) : 0;
+		if(!undo)
+			undo = _undo.begin(cmd.contextId(), cmd.type());
+
+		// Save the tiles under each line segment before drawing.
+		// This way the saved tiles don't depend on how the stroke was split into messages.
+		const dpcore::Brush &b = ctx.tool.brush;
+		const int r = qMax(b.radius(0), b.radius(1)) + 2;
+		QPoint prev = ctx.lastpoint;
+		bool first = !ctx.pendown;
+		foreach(const protocol::PenPoint pp, cmd.points()) {
+			const QPoint p((pp.x >> 2) - 128, (pp.y >> 2) - 128);
+			const QRect segment = first ? QRect(p, p) : QRect(prev, p).normalized();
+			_undo.saveTiles(undo, layer, segment.adjusted(-r, -r, r, r));
+			prev = p;
+			first = false;
+		}
+	}
+
+	dpcore::Point p;
+	foreach(const protocol::PenPoint pp, cmd.points()) {
+		// The coordinate encoding code is in net/client.cpp
+		p = dpcore::Point(
+			(pp.x >> 2) - 128,
+			(pp.y >> 2) - 128,
+			(pp.x & 3) / 4.0,
+			(pp.y & 3) / 4.0,
+			pp.p/255.0
+		);
+
+		if(ctx.pendown) {
+			layer->drawLine(cmd.contextId(), ctx.tool.brush, ctx.lastpoint, p, ctx.distance_accumulator);
+		} else {
+			ctx.pendown = true;
+			++_pendown;
+			ctx.distance_accumulator = 0;
+			layer->dab(cmd.contextId(), ctx.tool.brush, p);
+		}
+		ctx.lastpoint = p;
+	}
+	emit penMoved(cmd.contextId(), cmd.points().size());
+}
+
+void CanvasState::handlePenUp(const protocol::PenUp &cmd)
+{
+	_undo.finish(cmd.contextId());
+
+	DrawingContext &ctx = _contexts[cmd.contextId()];
+	if(ctx.pendown) {
+		ctx.pendown = false;
+		--_pendown;
+	}
+
+	dpcore::Layer *layer = _image->getLayer(ctx.tool.layer_id);
+	if(!layer) {
+		qWarning() << "penUp by user" << cmd.contextId() << "on non-existent layer" << ctx.tool.layer_id;
+		return;
+	}
+
+	// This ends an indirect stroke. In incremental mode, this does nothing.
+	layer->mergeSublayer(cmd.contextId());
+}
+
+void CanvasState::handlePutImage(const protocol::PutImage &cmd)
+{
+	const bool isDelta = cmd.flags() & protocol::PutImage::MODE_DELTA;
+	const QRect rect(cmd.x(), cmd.y(), cmd.width(), cmd.height());
+
+	dpcore::Layer *layer = _image->getLayer(cmd.layer());
+	if(!layer) {
+		qWarning() << "putImage on non-existent layer" << cmd.layer();
+		if(isDelta)
+			emit imageDeltaHandled(cmd.contextId(), cmd.layer(), rect, net::deltaChecksum(cmd), false);
+		return;
+	}
+
+	// Layer previews fill in the tiles that haven't arrived yet.
+	// They are part of snapshots only.
+	if(cmd.flags() & protocol::PutImage::MODE_PREVIEW) {
+		if(cmd.contextId() != 0) {
+			qWarning() << "putImage: layer preview from user" << cmd.contextId();
+			return;
+		}
+		if(_previews) {
+			foreach(dpcore::Tile *t, net::tilesFromPreview(cmd, layer))
+				layer->putTile(t, false);
+		}
+		return;
+	}
+
+	const QImage img = net::imageFromMessage(cmd, layer);
+
+	// A delta that doesn't match the layer content is ignored by everyone,
+	// so the sender must resend the image in full
+	if(isDelta)
+		emit imageDeltaHandled(cmd.contextId(), cmd.layer(), rect, net::deltaChecksum(cmd), !img.isNull());
+
+	if(img.isNull()) {
+		if(isDelta)
+			qDebug() << "putImage: delta from user" << cmd.contextId() << "does not match the layer content";
+		else
+			qWarning() << "putImage: invalid image data from user" << cmd.contextId();
+		return;
+	}
+
+	if(cmd.contextId() != 0)
+		_undo.saveTiles(pastePoint(cmd.contextId()), layer, rect);
+
+	layer->putImage(cmd.x(), cmd.y(), img, (cmd.flags() & protocol::PutImage::MODE_BLEND));
+
+	if(cmd.flags() & protocol::PutImage::MODE_END)
+		_undo.finish(cmd.contextId());
+}
+
+void CanvasState::handlePutTile(const protocol::PutTile &cmd)
+{
+	dpcore::Layer *layer = _image->getLayer(cmd.layer());
+	if(!layer) {
+		qWarning() << "putTile on non-existent layer" << cmd.layer();
+		return;
+	}
+
+	dpcore::Tile *tile = net::tileFromMessage(cmd);
+	if(!tile) {
+		qWarning() << "putTile: invalid tile data from user" << cmd.contextId();
+		return;
+	}
+
+	if(cmd.contextId() != 0)
+		_undo.saveTiles(pastePoint(cmd.contextId()), layer, QRect(cmd.column() * dpcore::Tile::SIZE, cmd.row() * dpcore::Tile::SIZE, dpcore::Tile::SIZE, dpcore::Tile::SIZE));
+
+	layer->putTile(tile, (cmd.flags() & protocol::PutTile::MODE_BLEND));
+
+	if(cmd.flags() & protocol::PutTile::MODE_END)
+		_undo.finish(cmd.contextId());
+}
+
+/**
+ * The pieces of a pasted image form a single undo group, which is ended
+ * by the piece with the end flag.
+ * @param ctx user ID
+ * @return the open paste group of the user or a new one
+ */
+UndoPoint *CanvasState::pastePoint(int ctx)
+{
+	UndoPoint *undo = _undo.openPoint(ctx);
+	if(!undo || undo->type != protocol::MSG_PUTIMAGE)
+		undo = _undo.begin(ctx, protocol::MSG_PUTIMAGE);
+	return undo;
+}
+
+void CanvasState::handleUndo(const protocol::Undo &cmd)
+{
+	if(isPenDown(cmd.contextId())) {
+		qWarning() << "undo by user" << cmd.contextId() << "while pen is down";
+		return;
+	}
+
+	const UndoPoint *undo = _undo.undo(cmd.contextId());
+	if(undo && undo->hasLayerChanges())
+		emit layersRestored();
+}
+
+void CanvasState::handleRedo(const protocol::Redo &cmd)
+{
+	if(isPenDown(cmd.contextId())) {
+		qWarning() << "redo by user" << cmd.contextId() << "while pen is down";
+		return;
+	}
+
+	const UndoPoint *redo = _undo.redo(cmd.contextId());
+	if(redo && redo->hasLayerChanges())
+		emit layersRestored();
+}
+
+}
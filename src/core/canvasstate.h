@@ -0,0 +1,200 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+#ifndef DP_CORE_CANVASSTATE_H
+#define DP_CORE_CANVASSTATE_H
+
+#include <QObject>
+#include <QHash>
+#include <QPoint>
+#include <QRect>
+
+#include "brush.h"
+#include "point.h"
+#include "undohistory.h"
+#include "../shared/net/message.h"
+
+namespace protocol {
+	class CanvasResize;
+	class LayerCreate;
+	class LayerDuplicate;
+	class LayerAttributes;
+	class LayerRetitle;
+	class LayerOrder;
+	class LayerDelete;
+	class ToolChange;
+	class PenMove;
+	class PenUp;
+	class PutImage;
+	class PutTile;
+	class Undo;
+	class Redo;
+}
+
+namespace dpcore {
+	class LayerStack;
+}
+
+namespace drawingboard {
+
+struct ToolContext {
+	int layer_id;
+	dpcore::Brush brush;
+};
+
+/**
+ * \brief User state
+ *
+ * The drawing context captures the state needed by a single user for drawing.
+ */
+struct DrawingContext {
+	DrawingContext() : pendown(false), distance_accumulator(0) { tool.layer_id = 0; }
+
+	//! Currently selected tool
+	ToolContext tool;
+
+	//! Last pen-move point
+	dpcore::Point lastpoint;
+
+	//! Is the stroke currently in progress?
+	bool pendown;
+
+	//! Stroke length (used for dab spacing)
+	qreal distance_accumulator;
+};
+
+/**
+ * \brief Drawing command interpreter
+ *
+ * The canvas state applies drawing commands to a layer stack, keeping track
+ * of each user's drawing context and the undo history along the way.
+ * The client and the server's own canvas both use this, so they are
+ * guaranteed to interpret the command stream the same way.
+ *
+ * Annotations are not part of the layer stack, so they are left to the
+ * owner of the canvas. The signals let the owner keep its user interface
+ * in sync with the canvas.
+ */
+class CanvasState : public QObject {
+	Q_OBJECT
+public:
+	/**
+	 * @brief Construct a canvas state
+	 * @param image the layer stack to draw on (not owned)
+	 * @param parent
+	 */
+	explicit CanvasState(dpcore::LayerStack *image, QObject *parent=0);
+
+	/**
+	 * @brief Apply a drawing command to the canvas
+	 *
+	 * Every command must be passed here, including the ones the canvas state
+	 * doesn't handle itself, since the undo history counts them all.
+	 * @param msg the command
+	 * @return false if the command is not applied by the canvas state
+	 */
+	bool receiveCommand(const protocol::MessagePtr &msg);
+
+	//! Get the layer stack
+	dpcore::LayerStack *image() const { return _image; }
+
+	//! Get the drawing contexts of all users
+	const QHash<int, DrawingContext> &drawingContexts() const { return _contexts; }
+
+	//! Is the user's pen down?
+	bool isPenDown(int ctx) const { return _contexts.value(ctx).pendown; }
+
+	/**
+	 * @brief Can a checkpoint or a snapshot be made right now?
+	 *
+	 * Strokes in progress would not continue correctly from a snapshot,
+	 * so those should only be made when no-one's pen is down.
+	 * @return true if no one is in the middle of a stroke
+	 */
+	bool isIdle() const { return _pendown == 0; }
+
+	/**
+	 * @brief Enable or disable layer previews
+	 *
+	 * Layer previews are only for show, since the full resolution tiles
+	 * follow them. A canvas that is never shown can skip them.
+	 * @param enable
+	 */
+	void setPreviewsEnabled(bool enable) { _previews = enable; }
+
+signals:
+	//! An initialized canvas was resized and its content moved by the given offset
+	void canvasResized(const QPoint &offset);
+
+	void layerCreated(int ctx, int id, const QString &title);
+	void layerAttributesChanged(int id, int opacity, int blend);
+	void layerRetitled(int id, const QString &title);
+	void layersReordered(const QList<uint8_t> &order);
+	void layerDeleted(int id);
+
+	//! An undo or redo changed layer attributes or the layer order
+	void layersRestored();
+
+	//! A pen move of the given number of points was drawn
+	void penMoved(int ctx, int points);
+
+	/**
+	 * @brief A delta coded image was applied or rejected
+	 *
+	 * The layer, area and checksum identify the image.
+	 */
+	void imageDeltaHandled(int ctx, int layer, const QRect &rect, quint32 checksum, bool applied);
+
+private:
+	// Layer related commands
+	void handleCanvasResize(const protocol::CanvasResize &cmd);
+	void handleLayerCreate(const protocol::LayerCreate &cmd);
+	void handleLayerDuplicate(const protocol::LayerDuplicate &cmd);
+	void handleLayerAttributes(const protocol::LayerAttributes &cmd);
+	void handleLayerTitle(const protocol::LayerRetitle &cmd);
+	void handleLayerOrder(const protocol::LayerOrder &cmd);
+	void handleLayerDelete(const protocol::LayerDelete &cmd);
+
+	// Drawing related commands
+	void handleToolChange(const protocol::ToolChange &cmd);
+	void handlePenMove(const protocol::PenMove &cmd);
+	void handlePenUp(const protocol::PenUp &cmd);
+	void handlePutImage(const protocol::PutImage &cmd);
+	void handlePutTile(const protocol::PutTile &cmd);
+	UndoPoint *pastePoint(int ctx);
+
+	// Undo related commands
+	void handleUndo(const protocol::Undo &cmd);
+	void handleRedo(const protocol::Redo &cmd);
+
+	dpcore::LayerStack *_image;
+	UndoHistory _undo;
+
+	QHash<int, DrawingContext> _contexts;
+
+	//! Number of strokes in progress
+	int _pendown;
+
+	bool _previews;
+};
+
+}
+
+#endif
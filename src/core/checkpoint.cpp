@@ -0,0 +1,167 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+#include "checkpoint.h"
+#include "canvasstate.h"
+#include "layerstack.h"
+#include "layer.h"
+#include "tile.h"
+#include "netutils.h"
+
+#include "../shared/net/layer.h"
+#include "../shared/net/annotation.h"
+#include "../shared/net/meta.h"
+#include "../shared/net/image.h"
+
+namespace drawingboard {
+
+CanvasCheckpoint::CanvasCheckpoint(const CanvasState *state, const QString &title, const QList<Annotation> &annotations, bool previews)
+	: _title(title), _annotations(annotations), _previews(previews)
+{
+	const dpcore::LayerStack *image = state->image();
+	_size = QSize(image->width(), image->height());
+
+	for(int i=0;i<image->layers();++i) {
+		const dpcore::Layer *l = image->getLayerByIndex(i);
+		Layer layer;
+		layer.id = l->id();
+		layer.title = l->title();
+		layer.opacity = l->opacity();
+		layer.blend = l->blendmode();
+
+		// Blank tiles are not stored at all
+		const int tiles = l->xtiles() * l->ytiles();
+		for(int t=0;t<tiles;++t) {
+			if(l->tile(t))
+				layer.tiles.append(new dpcore::Tile(l->tile(t)));
+		}
+		_layers.append(layer);
+	}
+	_layerCache.resize(_layers.size());
+	_tileCache.resize(_layers.size());
+
+	QHashIterator<int, DrawingContext> iter(state->drawingContexts());
+	while(iter.hasNext()) {
+		iter.next();
+		Tool tool;
+		tool.layer = iter.value().tool.layer_id;
+		tool.brush = iter.value().tool.brush;
+		_tools[iter.key()] = tool;
+	}
+}
+
+CanvasCheckpoint::~CanvasCheckpoint()
+{
+	foreach(const Layer &l, _layers)
+		qDeleteAll(l.tiles);
+}
+
+QList<protocol::MessagePtr> CanvasCheckpoint::toMessages() const
+{
+	QList<protocol::MessagePtr> msgs = headerMessages();
+	for(int i=0;i<_layers.size();++i)
+		msgs.append(layerMessages(i));
+	for(int i=0;i<_layers.size();++i)
+		msgs.append(tileMessages(i));
+	msgs.append(trailerMessages());
+	return msgs;
+}
+
+QList<protocol::MessagePtr> CanvasCheckpoint::headerMessages() const
+{
+	using protocol::MessagePtr;
+	QList<MessagePtr> msgs;
+
+	// Most important bit first: canvas initialization
+	msgs.append(MessagePtr(new protocol::CanvasResize(_size.width(), _size.height())));
+
+	// Less important, but it's nice to see it straight away
+	if(!_title.isEmpty())
+		msgs.append(MessagePtr(new protocol::SessionTitle(_title)));
+
+	return msgs;
+}
+
+QList<protocol::MessagePtr> CanvasCheckpoint::layerMessages(int index) const
+{
+	using protocol::MessagePtr;
+	QMutexLocker lock(&_cacheMutex);
+
+	if(_layerCache.at(index).isEmpty()) {
+		const Layer &l = _layers.at(index);
+		QList<MessagePtr> msgs;
+		msgs.append(MessagePtr(new protocol::LayerCreate(0, l.id, 0, l.title)));
+		msgs.append(MessagePtr(new protocol::LayerAttributes(0, l.id, l.opacity, l.blend)));
+
+		if(_previews) {
+			QList<const dpcore::Tile*> tiles;
+			foreach(const dpcore::Tile *t, l.tiles)
+				tiles.append(t);
+			msgs.append(net::putLayerPreview(l.id, dpcore::Tile::roundUp(_size.width()) / dpcore::Tile::SIZE, dpcore::Tile::roundUp(_size.height()) / dpcore::Tile::SIZE, tiles));
+		}
+
+		_layerCache[index] = msgs;
+	}
+
+	return _layerCache.at(index);
+}
+
+QList<protocol::MessagePtr> CanvasCheckpoint::tileMessages(int index) const
+{
+	QMutexLocker lock(&_cacheMutex);
+
+	if(_tileCache.at(index).isEmpty()) {
+		const Layer &l = _layers.at(index);
+		QList<protocol::MessagePtr> msgs;
+
+		// The layer was just created, so blank tiles need not be sent
+		foreach(const dpcore::Tile *t, l.tiles) {
+			if(!t->isBlank())
+				msgs.append(net::putTile(0, l.id, t, false));
+		}
+
+		_tileCache[index] = msgs;
+	}
+
+	return _tileCache.at(index);
+}
+
+QList<protocol::MessagePtr> CanvasCheckpoint::trailerMessages() const
+{
+	using protocol::MessagePtr;
+	QList<MessagePtr> msgs;
+
+	// Create annotations
+	foreach(const Annotation &a, _annotations) {
+		msgs.append(MessagePtr(new protocol::AnnotationCreate(0, a.id, a.geometry.x(), a.geometry.y(), a.geometry.width(), a.geometry.height())));
+		msgs.append(MessagePtr(new protocol::AnnotationEdit(a.id, a.color, a.text)));
+	}
+
+	// User tool changes
+	QHashIterator<int, Tool> iter(_tools);
+	while(iter.hasNext()) {
+		iter.next();
+		msgs.append(net::brushToToolChange(iter.key(), iter.value().layer, iter.value().brush));
+	}
+
+	return msgs;
+}
+
+}
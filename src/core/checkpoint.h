@@ -0,0 +1,149 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+#ifndef DP_CHECKPOINT_H
+#define DP_CHECKPOINT_H
+
+#include <QList>
+#include <QVector>
+#include <QHash>
+#include <QMutex>
+#include <QSize>
+#include <QRect>
+#include <QString>
+
+#include "brush.h"
+#include "../shared/net/message.h"
+
+namespace dpcore {
+	class Tile;
+}
+
+namespace drawingboard {
+
+class CanvasState;
+
+/**
+ * \brief A copy of the canvas state at some point in the command stream
+ *
+ * Tile pixel data is implicitly shared, so making a checkpoint copies
+ * no pixels. The canvas and the checkpoint share the tiles until the
+ * canvas is drawn on. A checkpoint can be turned into the commands that
+ * recreate the canvas as it was when the checkpoint was made.
+ *
+ * A checkpoint is never modified after it has been made, so it can be
+ * encoded in another thread while the canvas is being drawn on.
+ */
+class CanvasCheckpoint {
+public:
+	struct Annotation {
+		int id;
+		QRect geometry;
+		quint32 color;
+		QString text;
+	};
+
+	/**
+	 * @brief Save the current state of the canvas
+	 * @param state the canvas
+	 * @param title session title
+	 * @param annotations the annotations on the canvas
+	 * @param previews include low resolution layer previews in the snapshot
+	 */
+	CanvasCheckpoint(const CanvasState *state, const QString &title, const QList<Annotation> &annotations, bool previews=true);
+	~CanvasCheckpoint();
+
+	CanvasCheckpoint(const CanvasCheckpoint&) = delete;
+	CanvasCheckpoint &operator=(const CanvasCheckpoint&) = delete;
+
+	/**
+	 * @brief Generate the commands that recreate the saved canvas state
+	 * @return snapshot commands
+	 */
+	QList<protocol::MessagePtr> toMessages() const;
+
+	//! Get the number of saved layers
+	int layerCount() const { return _layers.size(); }
+
+	/**
+	 * @brief Get the canvas initialization commands
+	 *
+	 * These come first in the snapshot.
+	 * @return canvas resize and session title commands
+	 */
+	QList<protocol::MessagePtr> headerMessages() const;
+
+	/**
+	 * @brief Get the commands that create a layer
+	 *
+	 * The layer content is first sent as a low resolution preview (if
+	 * enabled), so the layers of the snapshot should all be created before
+	 * their tiles are sent. The result is cached. This function is thread safe.
+	 * @param index layer index
+	 * @return layer creation, attribute and preview commands
+	 */
+	QList<protocol::MessagePtr> layerMessages(int index) const;
+
+	/**
+	 * @brief Get the full resolution content of a layer
+	 *
+	 * Encoding the layer content is the slow part of generating a snapshot.
+	 * The result is cached, so each layer is encoded only once.
+	 * This function is thread safe.
+	 * @param index layer index
+	 * @return tile commands
+	 */
+	QList<protocol::MessagePtr> tileMessages(int index) const;
+
+	/**
+	 * @brief Get the commands that come after the layers
+	 * @return annotation and tool commands
+	 */
+	QList<protocol::MessagePtr> trailerMessages() const;
+
+private:
+	struct Layer {
+		int id;
+		QString title;
+		int opacity;
+		int blend;
+		QList<dpcore::Tile*> tiles;
+	};
+
+	struct Tool {
+		int layer;
+		dpcore::Brush brush;
+	};
+
+	QSize _size;
+	QString _title;
+	QList<Layer> _layers;
+	QList<Annotation> _annotations;
+	QHash<int, Tool> _tools;
+	bool _previews;
+
+	mutable QMutex _cacheMutex;
+	mutable QVector<QList<protocol::MessagePtr> > _layerCache;
+	mutable QVector<QList<protocol::MessagePtr> > _tileCache;
+};
+
+}
+
+#endif
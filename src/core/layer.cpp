@@ -57,6 +57,23 @@ Layer::Layer(LayerStack *owner, int id, const QString& title, const QColor& colo
 	}
 }
 
+/**
+ * The new layer shares the pixel data of the source layer's tiles, so
+ * copying is cheap. Sublayers (strokes in progress) are not copied.
+ * @param src the layer to copy
+ * @param id layer ID
+ * @param title layer title
+ */
+Layer::Layer(const Layer *src, int id, const QString& title)
+	: owner_(src->owner_), id_(id), _title(title), width_(src->width_), height_(src->height_),
+	_xtiles(src->_xtiles), _ytiles(src->_ytiles),
+	_opacity(src->_opacity), _blend(src->_blend), _hidden(false)
+{
+	_tiles = new Tile*[_xtiles * _ytiles];
+	for(int i=0;i<_xtiles*_ytiles;++i)
+		_tiles[i] = src->_tiles[i] ? new Tile(src->_tiles[i]) : 0;
+}
+
 Layer::Layer(LayerStack *owner, int id, const QSize &size)
 	: Layer(owner, id, "", Qt::transparent, size)
 {
@@ -74,6 +91,101 @@ void Layer::setTitle(const QString& title)
 	_title = title;
 }
 
+/**
+ * The existing content is moved by the offset. If the offset is aligned
+ * to the tile grid, the tiles are simply moved to their new place in the grid.
+ * Otherwise the pixels must be shifted.
+ *
+ * @param newsize the new size of the layer
+ * @param offset position of the old content in the resized layer
+ */
+void Layer::resize(const QSize& newsize, const QPoint &offset)
+{
+	Q_ASSERT(!newsize.isEmpty());
+
+	// Pixels outside the old boundaries must not become visible
+	cropEdgeTiles();
+
+	const int xtiles = (newsize.width()+Tile::SIZE-1) / Tile::SIZE;
+	const int ytiles = (newsize.height()+Tile::SIZE-1) / Tile::SIZE;
+	Tile **tiles = new Tile*[xtiles * ytiles];
+	for(int i=0;i<xtiles*ytiles;++i)
+		tiles[i] = 0;
+
+	if(offset.x() % Tile::SIZE == 0 && offset.y() % Tile::SIZE == 0) {
+		const int dx = offset.x() / Tile::SIZE;
+		const int dy = offset.y() / Tile::SIZE;
+		for(int y=0;y<_ytiles;++y) {
+			for(int x=0;x<_xtiles;++x) {
+				Tile *t = _tiles[y*_xtiles+x];
+				if(!t)
+					continue;
+				const int nx = x + dx;
+				const int ny = y + dy;
+				if(nx>=0 && nx<xtiles && ny>=0 && ny<ytiles) {
+					t->setPosition(nx, ny);
+					tiles[ny*xtiles+nx] = t;
+				} else {
+					delete t;
+				}
+			}
+		}
+	} else {
+		const QImage old = toImage();
+		const QRect dest = QRect(offset, old.size()).intersected(QRect(QPoint(), newsize));
+		if(!dest.isEmpty()) {
+			for(int y=dest.top()/Tile::SIZE;y<=dest.bottom()/Tile::SIZE;++y) {
+				for(int x=dest.left()/Tile::SIZE;x<=dest.right()/Tile::SIZE;++x) {
+					Tile *t = new Tile(old, x, y, offset.x(), offset.y());
+					if(t->isBlank())
+						delete t;
+					else
+						tiles[y*xtiles+x] = t;
+				}
+			}
+		}
+		for(int i=0;i<_xtiles*_ytiles;++i)
+			delete _tiles[i];
+	}
+
+	delete [] _tiles;
+	_tiles = tiles;
+	_xtiles = xtiles;
+	_ytiles = ytiles;
+	width_ = newsize.width();
+	height_ = newsize.height();
+
+	// Clear content that was moved past the new boundaries
+	cropEdgeTiles();
+
+	foreach(Layer *sl, _sublayers)
+		sl->resize(newsize, offset);
+}
+
+/**
+ * Clear the part of the rightmost and bottommost tiles that lies outside
+ * the layer.
+ */
+void Layer::cropEdgeTiles()
+{
+	const int w = width_ % Tile::SIZE;
+	const int h = height_ % Tile::SIZE;
+	if(w) {
+		for(int y=0;y<_ytiles;++y) {
+			Tile *t = _tiles[y*_xtiles + _xtiles-1];
+			if(t)
+				t->crop(w, Tile::SIZE);
+		}
+	}
+	if(h) {
+		for(int x=0;x<_xtiles;++x) {
+			Tile *t = _tiles[(_ytiles-1)*_xtiles + x];
+			if(t)
+				t->crop(Tile::SIZE, h);
+		}
+	}
+}
+
 QImage Layer::toImage() const {
 	QImage image(width_, height_, QImage::Format_ARGB32);
 	image.fill(0);
@@ -84,6 +196,34 @@ QImage Layer::toImage() const {
 	return image;
 }
 
+/**
+ * Pixels outside the layer are transparent.
+ * @param rect the area to copy
+ * @return image the size of rect
+ */
+QImage Layer::copyImage(const QRect &rect) const
+{
+	const int x0 = Tile::roundDown(rect.x());
+	const int y0 = Tile::roundDown(rect.y());
+	const int x1 = Tile::roundUp(rect.x() + rect.width());
+	const int y1 = Tile::roundUp(rect.y() + rect.height());
+
+	QImage image(x1-x0, y1-y0, QImage::Format_ARGB32);
+	image.fill(0);
+
+	const int tx1 = qMin(x1 / Tile::SIZE, _xtiles);
+	const int ty1 = qMin(y1 / Tile::SIZE, _ytiles);
+	for(int ty=y0/Tile::SIZE;ty<ty1;++ty) {
+		for(int tx=x0/Tile::SIZE;tx<tx1;++tx) {
+			const Tile *t = _tiles[ty*_xtiles+tx];
+			if(t)
+				t->copyToImage(image, tx*Tile::SIZE - x0, ty*Tile::SIZE - y0);
+		}
+	}
+
+	return image.copy(rect.x()-x0, rect.y()-y0, rect.width(), rect.height());
+}
+
 /**
  * @param x
  * @param y
@@ -219,6 +359,42 @@ void Layer::putImage(int x, int y, QImage image, bool blend)
 		owner_->markDirty(QRect(x, y, image.width(), image.height()));
 }
 
+/**
+ * The tile's own position tells where it goes. Blank tiles are not
+ * stored, so replacing with a blank tile frees the old one.
+ * @param tile the tile to put (layer takes ownership)
+ * @param blend alpha blend the tile with the existing content
+ */
+void Layer::putTile(Tile *tile, bool blend)
+{
+	if(tile->x() < 0 || tile->x() >= _xtiles || tile->y() < 0 || tile->y() >= _ytiles) {
+		qWarning() << "putTile: tile" << tile->x() << tile->y() << "out of bounds";
+		delete tile;
+		return;
+	}
+
+	const int i = tile->y() * _xtiles + tile->x();
+	if(blend) {
+		if(!tile->isBlank()) {
+			if(!_tiles[i])
+				_tiles[i] = new Tile(tile->x(), tile->y());
+			_tiles[i]->merge(tile, 255, 1);
+		}
+		delete tile;
+	} else {
+		delete _tiles[i];
+		if(tile->isBlank()) {
+			delete tile;
+			_tiles[i] = 0;
+		} else {
+			_tiles[i] = tile;
+		}
+	}
+
+	if(owner_ && visible())
+		owner_->markDirty(i % _xtiles, i / _xtiles);
+}
+
 void Layer::dab(int contextId, const Brush &brush, const Point &point)
 {
 	if(!brush.incremental()) {
@@ -469,6 +645,23 @@ void Layer::fillColor(const QColor& color)
 		owner_->markDirty();
 }
 
+/**
+ * The layer takes ownership of the new tile and the caller takes
+ * ownership of the returned one.
+ * @param index tile index
+ * @param tile the new tile (may be null for a blank tile)
+ * @return the old tile (may be null)
+ */
+Tile *Layer::swapTile(int index, Tile *tile)
+{
+	Q_ASSERT(index>=0 && index<_xtiles*_ytiles);
+	Tile *old = _tiles[index];
+	_tiles[index] = tile;
+	if(owner_ && visible())
+		owner_->markDirty(index % _xtiles, index / _xtiles);
+	return old;
+}
+
 /**
  * Free all tiles that are completely transparent
  */
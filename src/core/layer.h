@@ -24,6 +24,8 @@
 
 class QImage;
 class QSize;
+class QPoint;
+class QRect;
 
 namespace dpcore {
 
@@ -44,6 +46,9 @@ class Layer {
 		//! Construct a layer filled with solid color
 		Layer(LayerStack *owner, int id, const QString& title, const QColor& color, const QSize& size);
 
+		//! Construct a copy of a layer
+		Layer(const Layer *src, int id, const QString& title);
+
 		~Layer();
 
 		//! Get the layer width in pixels
@@ -64,8 +69,11 @@ class Layer {
 		//! Get the layer as an image
 		QImage toImage() const;
 
+		//! Get a part of the layer as an image
+		QImage copyImage(const QRect &rect) const;
+
 		//! Resize this layer
-		//void resize(const QSize& newsize);
+		void resize(const QSize& newsize, const QPoint &offset);
 
 		//! Get the color at the specified coordinate
 		QColor colorAt(int x, int y) const;
@@ -100,6 +108,9 @@ class Layer {
 		//! Draw an image onto the layer
 		void putImage(int x, int y, QImage image, bool blend);
 
+		//! Replace or blend a whole tile
+		void putTile(Tile *tile, bool blend);
+
 		//! Dab the layer with a brush
 		void dab(int contextId, const Brush& brush, const Point& point);
 
@@ -131,6 +142,15 @@ class Layer {
 		//! Get a tile
 		const Tile *tile(int index) const { Q_ASSERT(index>=0 && index<_xtiles*_ytiles); return _tiles[index]; }
 
+		//! Get the number of tiles per row
+		int xtiles() const { return _xtiles; }
+
+		//! Get the number of tile rows
+		int ytiles() const { return _ytiles; }
+
+		//! Replace a tile, returning the old one
+		Tile *swapTile(int index, Tile *tile);
+
 		//! Get the sublayers
 		const QList<Layer*> &sublayers() const { return _sublayers; }
 
@@ -146,6 +166,8 @@ class Layer {
 		//! Construct a sublayer
 		Layer(LayerStack *owner, int id, const QSize& size);
 
+		void cropEdgeTiles();
+
 		QImage padImageToTileBoundary(int leftpad, int toppad, const QImage &original, bool alpha) const;
 
 		//! Get a sublayer
@@ -31,7 +31,7 @@
 namespace dpcore {
 
 LayerStack::LayerStack(QObject *parent)
-	: QObject(parent), _width(-1), _height(-1)
+	: QObject(parent), _width(-1), _height(-1), _cache(0), _suspended(false)
 {
 }
 
@@ -39,6 +39,7 @@ LayerStack::~LayerStack()
 {
 	foreach(Layer *l, _layers)
 		delete l;
+	delete _cache;
 }
 
 /**
@@ -53,11 +54,67 @@ void LayerStack::init(const QSize& size)
 	_height = size.height();
 	_xtiles = _width / Tile::SIZE + ((_width % Tile::SIZE)>0);
 	_ytiles = _height / Tile::SIZE + ((_height % Tile::SIZE)>0);
-	_cache = QPixmap(size);
+	delete _cache;
+	_cache = 0;
 	_dirtytiles = QBitArray(_xtiles*_ytiles, true);
 	emit resized();
 }
 
+/**
+ * All layers are resized. When the offset is aligned to the tile grid,
+ * the cached image of the old content is reused.
+ * @param newsize the new size of the image
+ * @param offset position of the old content in the resized image
+ */
+void LayerStack::resize(const QSize& newsize, const QPoint &offset)
+{
+	Q_ASSERT(!newsize.isEmpty());
+
+	foreach(Layer *l, _layers)
+		l->resize(newsize, offset);
+
+	const int xtiles = newsize.width() / Tile::SIZE + ((newsize.width() % Tile::SIZE)>0);
+	const int ytiles = newsize.height() / Tile::SIZE + ((newsize.height() % Tile::SIZE)>0);
+
+	QPixmap *cache = 0;
+	QBitArray dirty(xtiles*ytiles, true);
+
+	if(_cache && offset.x() % Tile::SIZE == 0 && offset.y() % Tile::SIZE == 0) {
+		const int dx = offset.x() / Tile::SIZE;
+		const int dy = offset.y() / Tile::SIZE;
+
+		cache = new QPixmap(newsize);
+		QPainter painter(cache);
+		painter.setCompositionMode(QPainter::CompositionMode_Source);
+		painter.drawPixmap(offset, *_cache);
+
+		// Moved tiles stay clean, except for the ones on the old and new
+		// edges, which may have been cropped.
+		for(int y=0;y<_ytiles;++y) {
+			const int ny = y + dy;
+			if(ny<0 || ny>=ytiles-1 || y==_ytiles-1)
+				continue;
+			for(int x=0;x<_xtiles-1;++x) {
+				const int nx = x + dx;
+				if(nx>=0 && nx<xtiles-1)
+					dirty.setBit(ny*xtiles+nx, _dirtytiles.testBit(y*_xtiles+x));
+			}
+		}
+	}
+
+	_width = newsize.width();
+	_height = newsize.height();
+	_xtiles = xtiles;
+	_ytiles = ytiles;
+	delete _cache;
+	_cache = cache;
+	_dirtytiles = dirty;
+
+	emit resized();
+	if(!_suspended)
+		emit areaChanged(QRect(0, 0, _width, _height));
+}
+
 /**
  * @param id layer ID
  * @param name name of the new layer
@@ -74,6 +131,26 @@ Layer *LayerStack::addLayer(int id, const QString& name, const QColor& color)
 	return nl;
 }
 
+/**
+ * The copy shares the tile data of the source layer.
+ * @param source ID of the layer to copy
+ * @param id ID of the new layer
+ * @param name name of the new layer
+ * @return the new layer or 0 if source layer was not found
+ */
+Layer *LayerStack::duplicateLayer(int source, int id, const QString& name)
+{
+	const Layer *src = getLayer(source);
+	if(!src)
+		return 0;
+
+	Layer *nl = new Layer(src, id, name);
+	_layers.append(nl);
+	if(nl->visible())
+		markDirty();
+	return nl;
+}
+
 /**
  * @param id layer ID
  * @return true if layer was found and deleted
@@ -91,6 +168,15 @@ bool LayerStack::deleteLayer(int id)
 	return false;
 }
 
+QList<uint8_t> LayerStack::layerOrder() const
+{
+	QList<uint8_t> order;
+	order.reserve(_layers.size());
+	foreach(const Layer *l, _layers)
+		order.append(l->id());
+	return order;
+}
+
 /**
  * @param neworder list of layer IDs in the new order
  */
@@ -185,6 +271,13 @@ void LayerStack::setLayerHidden(int layerid, bool hide)
  */
 void LayerStack::paint(const QRectF& rect, QPainter *painter)
 {
+	// The cache is created on first use, so a layer stack that is
+	// never painted (e.g. the server's canvas) needs no pixmap support.
+	if(!_cache) {
+		_cache = new QPixmap(_width, _height);
+		_dirtytiles.fill(true);
+	}
+
 	// Refresh cache
 	const int tx0 = qBound(0, int(rect.left()) / Tile::SIZE, _xtiles-1);
 	const int tx1 = qBound(tx0, int(rect.right()) / Tile::SIZE, _xtiles-1);
@@ -203,7 +296,7 @@ void LayerStack::paint(const QRectF& rect, QPainter *painter)
 	}
 
 	// Paint the cached pixmap
-	painter->drawPixmap(rect, _cache, rect);
+	painter->drawPixmap(rect, *_cache, rect);
 }
 
 QColor LayerStack::colorAt(int x, int y) const
@@ -279,7 +372,7 @@ void LayerStack::updateCache(int xindex, int yindex)
 
 	quint32 data[Tile::SIZE*Tile::SIZE];
 	flattenTile(data, xindex, yindex);
-	QPainter painter(&_cache);
+	QPainter painter(_cache);
 	painter.setCompositionMode(QPainter::CompositionMode_Source);
 	painter.drawImage(
 		xindex*Tile::SIZE,
@@ -293,7 +386,7 @@ void LayerStack::updateCache(int xindex, int yindex)
 
 void LayerStack::markDirty(const QRect &area)
 {
-	if(_layers.isEmpty())
+	if(_layers.isEmpty() || _suspended)
 		return;
 	int tx0 = qBound(0, area.left() / Tile::SIZE, _xtiles-1);
 	int tx1 = qBound(tx0, area.right() / Tile::SIZE, _xtiles-1);
@@ -310,7 +403,7 @@ void LayerStack::markDirty(const QRect &area)
 
 void LayerStack::markDirty()
 {
-	if(_layers.isEmpty())
+	if(_layers.isEmpty() || _suspended)
 		return;
 	_dirtytiles.fill(true);
 	emit areaChanged(QRect(0, 0, _width, _height));
@@ -320,9 +413,27 @@ void LayerStack::markDirty(int x, int y)
 {
 	Q_ASSERT(x>=0 && x < _xtiles);
 	Q_ASSERT(y>=0 && y < _ytiles);
+	if(_suspended)
+		return;
 
 	_dirtytiles.setBit(y*_xtiles + x);
 	emit areaChanged(QRect(x*Tile::SIZE, y*Tile::SIZE, Tile::SIZE, Tile::SIZE));
 }
 
+/**
+ * While updates are suspended, no tiles are marked dirty and
+ * areaChanged is not emitted. This is used when a large number of
+ * commands are replayed in one go: when updates are resumed, the whole
+ * image is refreshed at once.
+ * @param suspend
+ */
+void LayerStack::suspendUpdates(bool suspend)
+{
+	if(suspend == _suspended)
+		return;
+	_suspended = suspend;
+	if(!suspend)
+		markDirty();
+}
+
 }
@@ -44,9 +44,15 @@ class LayerStack : public QObject {
 		//! Initialize the image
 		void init(const QSize& size);
 
+		//! Resize the image
+		void resize(const QSize& newsize, const QPoint &offset);
+
 		//! Add a new layer of solid color to the top of the stack
 		Layer *addLayer(int id, const QString& name, const QColor& color);
 
+		//! Add a copy of an existing layer to the top of the stack
+		Layer *duplicateLayer(int source, int id, const QString& name);
+
 		//! Delete a layer
 		bool deleteLayer(int id);
 
@@ -56,6 +62,9 @@ class LayerStack : public QObject {
 		//! Re-order the layer stack
 		void reorderLayers(const QList<uint8_t> &neworder);
 
+		//! Get the IDs of the layers, from bottom to top
+		QList<uint8_t> layerOrder() const;
+
 		//! Get the number of layers in the stack
 		int layers() const { return _layers.count(); }
 
@@ -98,6 +107,12 @@ class LayerStack : public QObject {
 		//! Mark the tile at the given index as dirty
 		void markDirty(int x, int y);
 
+		//! Suspend dirty tracking. The whole image is marked dirty when resumed
+		void suspendUpdates(bool suspend);
+
+		//! Is dirty tracking suspended?
+		bool isUpdatesSuspended() const { return _suspended; }
+
 	public slots:
 		//! Set or clear the "hidden" flag of a layer
 		void setLayerHidden(int layerid, bool hide);
@@ -117,8 +132,9 @@ class LayerStack : public QObject {
 		int _xtiles, _ytiles;
 		QList<Layer*> _layers;
 
-		QPixmap _cache;
+		QPixmap *_cache;
 		QBitArray _dirtytiles;
+		bool _suspended;
 };
 
 }
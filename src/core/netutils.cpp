@@ -0,0 +1,509 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#include <QImage>
+#include <QColor>
+#include <QRect>
+#include <QtEndian>
+
+#include "netutils.h"
+#include "../shared/net/image.h"
+#include "../shared/net/pen.h"
+#include "brush.h"
+#include "tile.h"
+#include "layer.h"
+
+namespace {
+/**
+ * FNV-1a hash of the image pixels. Used to check that a delta coded
+ * image is applied to the same content it was made against.
+ */
+quint32 imageChecksum(const QImage &image)
+{
+	quint32 hash = 2166136261u;
+	for(int y=0;y<image.height();++y) {
+		const uchar *ptr = image.constScanLine(y);
+		const uchar *end = ptr + image.width() * 4;
+		while(ptr<end) {
+			hash ^= *(ptr++);
+			hash *= 16777619u;
+		}
+	}
+	return hash;
+}
+
+//! XOR the pixels of the delta image with the base image
+void xorImage(QImage &delta, const QImage &base)
+{
+	Q_ASSERT(delta.size() == base.size());
+	for(int y=0;y<delta.height();++y) {
+		quint32 *ptr = reinterpret_cast<quint32*>(delta.scanLine(y));
+		const quint32 *bptr = reinterpret_cast<const quint32*>(base.constScanLine(y));
+		for(int x=0;x<delta.width();++x)
+			*(ptr++) ^= *(bptr++);
+	}
+}
+
+/**
+ * Draw a box filtered copy of the tile onto the preview image.
+ * The tile becomes a block x block pixel square at the tile's position.
+ */
+void downscaleTile(const dpcore::Tile *tile, QImage &preview, int block)
+{
+	using dpcore::Tile;
+	const int scale = Tile::SIZE / block;
+	const int area = scale * scale;
+
+	for(int by=0;by<block;++by) {
+		quint32 *dest = reinterpret_cast<quint32*>(preview.scanLine(tile->y() * block + by)) + tile->x() * block;
+		for(int bx=0;bx<block;++bx) {
+			// Average the colors weighted by alpha
+			uint a=0, r=0, g=0, b=0;
+			for(int y=by*scale;y<(by+1)*scale;++y) {
+				for(int x=bx*scale;x<(bx+1)*scale;++x) {
+					const quint32 p = tile->pixel(x, y);
+					const uint pa = qAlpha(p);
+					a += pa;
+					r += qRed(p) * pa;
+					g += qGreen(p) * pa;
+					b += qBlue(p) * pa;
+				}
+			}
+			if(a>0)
+				*dest = qRgba(r / a, g / a, b / a, a / area);
+			++dest;
+		}
+	}
+}
+
+/**
+ * Set the end flag of the last piece of an image, so the sender's undo group
+ * is ended after it.
+ */
+void markEnd(protocol::MessagePtr &msg)
+{
+	if(msg->type() == protocol::MSG_PUTTILE) {
+		protocol::PutTile &pt = msg.cast<protocol::PutTile>();
+		pt.setFlags(pt.flags() | protocol::PutTile::MODE_END);
+	} else {
+		protocol::PutImage &pi = msg.cast<protocol::PutImage>();
+		pi.setFlags(pi.flags() | protocol::PutImage::MODE_END);
+	}
+}
+
+void splitImage(int ctxid, int layer, int x, int y, const QImage &image, bool blend, QList<protocol::MessagePtr> &list)
+{
+	Q_ASSERT(image.format() == QImage::Format_ARGB32);
+
+	// Compress pixel data and see if it fits in a single message
+	QByteArray data(reinterpret_cast<const char*>(image.bits()), image.byteCount());
+	QByteArray compressed = qCompress(data);
+
+	if(compressed.length() > protocol::PutImage::MAX_LEN) {
+		// Too big! Recursively divide the image and try sending those
+		compressed = QByteArray(); // release data
+		QImage i1, i2;
+		int px, py;
+		if(image.width() > image.height()) {
+			px = image.width() / 2;
+			py = 0;
+			i1 = image.copy(0, 0, px, image.height());
+			i2 = image.copy(px, 0, image.width()-px, image.height());
+		} else {
+			px = 0;
+			py = image.height() / 2;
+			i1 = image.copy(0, 0, image.width(), py);
+			i2 = image.copy(0, py, image.width(), image.height()-py);
+		}
+		splitImage(ctxid, layer, x, y, i1, blend, list);
+		splitImage(ctxid, layer, x+px, y+py, i2, blend, list);
+
+	} else {
+		// It fits! Send data!
+		list.append(protocol::MessagePtr(new protocol::PutImage(
+			ctxid,
+			layer,
+			blend ? protocol::PutImage::MODE_BLEND : 0,
+			x,
+			y,
+			image.width(),
+			image.height(),
+			compressed
+		)));
+	}
+}
+}
+
+namespace net {
+
+/**
+ * Multiple messages are generated if the image is too large to fit in just one.
+ * The tile aligned part of the image is sent as PutTile commands and the
+ * edges around it as PutImages, which are recursively split into smaller
+ * parts if needed.
+ * The last command has the end flag set, so the pieces form a single undo group.
+ * @param ctxid user ID
+ * @param layer target layer ID
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @param image the image to put
+ * @param blend alpha blend instead of overwrite
+ * @return
+ */
+QList<protocol::MessagePtr> putQImage(int ctxid, int layer, int x, int y, const QImage &image, bool blend)
+{
+	using dpcore::Tile;
+	QList<protocol::MessagePtr> list;
+	const QImage img = image.convertToFormat(QImage::Format_ARGB32);
+
+	// The whole tiles covered by the image
+	const int ax0 = Tile::roundUp(x);
+	const int ay0 = Tile::roundUp(y);
+	const int ax1 = Tile::roundDown(x + img.width());
+	const int ay1 = Tile::roundDown(y + img.height());
+
+	if(ax1 <= ax0 || ay1 <= ay0) {
+		splitImage(ctxid, layer, x, y, img, blend, list);
+
+	} else {
+		for(int ty=ay0;ty<ay1;ty+=Tile::SIZE) {
+			for(int tx=ax0;tx<ax1;tx+=Tile::SIZE) {
+				const Tile tile(img, tx / Tile::SIZE, ty / Tile::SIZE, x, y);
+				// Blending a blank tile changes nothing
+				if(blend && tile.isBlank())
+					continue;
+				list.append(putTile(ctxid, layer, &tile, blend));
+			}
+		}
+
+		// Top and bottom edges span the whole width, left and right the rest
+		if(ay0 > y)
+			splitImage(ctxid, layer, x, y, img.copy(0, 0, img.width(), ay0-y), blend, list);
+		if(y + img.height() > ay1)
+			splitImage(ctxid, layer, x, ay1, img.copy(0, ay1-y, img.width(), y+img.height()-ay1), blend, list);
+		if(ax0 > x)
+			splitImage(ctxid, layer, x, ay0, img.copy(0, ay0-y, ax0-x, ay1-ay0), blend, list);
+		if(x + img.width() > ax1)
+			splitImage(ctxid, layer, ax1, ay0, img.copy(ax1-x, ay0-y, x+img.width()-ax1, ay1-ay0), blend, list);
+	}
+
+	if(!list.isEmpty())
+		markEnd(list.last());
+
+	return list;
+}
+
+/**
+ * The image replaces the layer content in its area. Typically this is the
+ * result of compositing a pasted image onto the current content.
+ * Delta images are not split, so nothing is generated if the compressed
+ * delta is too big to fit in a single message.
+ * @param ctxid user ID
+ * @param layer target layer ID
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @param image the new content of the area
+ * @param base the current content of the area
+ * @return a PutImage command or an empty list
+ */
+QList<protocol::MessagePtr> putQImageDelta(int ctxid, int layer, int x, int y, const QImage &image, const QImage &base)
+{
+	Q_ASSERT(image.size() == base.size());
+	QList<protocol::MessagePtr> list;
+
+	const QImage b = base.convertToFormat(QImage::Format_ARGB32);
+	QImage delta = image.convertToFormat(QImage::Format_ARGB32);
+	xorImage(delta, b);
+
+	QByteArray data(4, 0);
+	qToBigEndian(imageChecksum(b), reinterpret_cast<uchar*>(data.data()));
+	data.append(qCompress(delta.constBits(), delta.byteCount()));
+
+	if(data.length() <= protocol::PutImage::MAX_LEN) {
+		list.append(protocol::MessagePtr(new protocol::PutImage(
+			ctxid,
+			layer,
+			protocol::PutImage::MODE_DELTA | protocol::PutImage::MODE_END,
+			x,
+			y,
+			image.width(),
+			image.height(),
+			data
+		)));
+	}
+	return list;
+}
+
+/**
+ * The checksum together with the target area identifies a delta coded image,
+ * so the sender can tell which of its images the server echoed back.
+ * @param cmd a delta coded PutImage command
+ * @return the checksum or 0 if the data is invalid
+ */
+quint32 deltaChecksum(const protocol::PutImage &cmd)
+{
+	if(cmd.image().length() < 4)
+		return 0;
+	return qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(cmd.image().constData()));
+}
+
+/**
+ * A delta coded image is decoded against the current content of the layer.
+ * @param cmd the command to decode
+ * @param layer the target layer
+ * @return the image or a null image if the data is invalid or the delta doesn't match the layer
+ */
+QImage imageFromMessage(const protocol::PutImage &cmd, const dpcore::Layer *layer)
+{
+	const bool isDelta = cmd.flags() & protocol::PutImage::MODE_DELTA;
+	const int prefix = isDelta ? 4 : 0;
+
+	if(cmd.image().length() < prefix)
+		return QImage();
+
+	const QByteArray data = qUncompress(cmd.image().mid(prefix));
+	if(data.length() != cmd.width() * cmd.height() * 4)
+		return QImage();
+
+	QImage image(cmd.width(), cmd.height(), QImage::Format_ARGB32);
+	for(int y=0;y<image.height();++y)
+		memcpy(image.scanLine(y), data.constData() + y * cmd.width() * 4, cmd.width() * 4);
+
+	if(isDelta) {
+		const QImage base = layer->copyImage(QRect(cmd.x(), cmd.y(), cmd.width(), cmd.height()));
+		if(imageChecksum(base) != deltaChecksum(cmd))
+			return QImage();
+		xorImage(image, base);
+	}
+
+	return image;
+}
+
+/**
+ * The preview is made as detailed as will fit in a single message.
+ * Each tile is scaled down on its own, so a blank tile is blank in the
+ * preview too and vice versa. Blank tiles are not sent in snapshots, so this
+ * guarantees every tile of the preview is eventually replaced by a real one.
+ * @param layer target layer ID
+ * @param xtiles number of tile columns in the layer
+ * @param ytiles number of tile rows in the layer
+ * @param tiles the non-empty tiles of the layer
+ * @return a preview PutImage command or an empty list if the layer is blank or too big
+ */
+QList<protocol::MessagePtr> putLayerPreview(int layer, int xtiles, int ytiles, const QList<const dpcore::Tile*> &tiles)
+{
+	QList<protocol::MessagePtr> list;
+
+	QList<const dpcore::Tile*> content;
+	foreach(const dpcore::Tile *t, tiles)
+		if(!t->isBlank())
+			content.append(t);
+
+	if(content.isEmpty())
+		return list;
+
+	// Try 8x8, 4x4, 2x2 and finally 1 pixel per tile. Don't bother compressing
+	// images that are hopelessly too big.
+	for(int block=8;block>0;block/=2) {
+		const int w = xtiles * block;
+		const int h = ytiles * block;
+		if(w > 0xffff || h > 0xffff || qint64(w) * h * 4 > protocol::PutImage::MAX_LEN * 8)
+			continue;
+
+		QImage preview(w, h, QImage::Format_ARGB32);
+		preview.fill(0);
+		foreach(const dpcore::Tile *t, content)
+			downscaleTile(t, preview, block);
+
+		const QByteArray compressed = qCompress(preview.constBits(), preview.byteCount());
+		if(compressed.length() <= protocol::PutImage::MAX_LEN) {
+			list.append(protocol::MessagePtr(new protocol::PutImage(
+				0,
+				layer,
+				protocol::PutImage::MODE_PREVIEW,
+				0,
+				0,
+				w,
+				h,
+				compressed
+			)));
+			break;
+		}
+	}
+
+	return list;
+}
+
+/**
+ * Preview blocks are scaled up to full tiles. Tiles the layer already has
+ * and blank blocks are skipped.
+ * @param cmd the preview command to decode
+ * @param layer the target layer
+ * @return new tiles (empty if the preview is invalid)
+ */
+QList<dpcore::Tile*> tilesFromPreview(const protocol::PutImage &cmd, const dpcore::Layer *layer)
+{
+	using dpcore::Tile;
+	QList<Tile*> tiles;
+
+	if(layer->xtiles() == 0 || layer->ytiles() == 0)
+		return tiles;
+
+	const int block = cmd.width() / layer->xtiles();
+	if(block < 1 || Tile::SIZE % block || cmd.width() != layer->xtiles() * block || cmd.height() != layer->ytiles() * block)
+		return tiles;
+
+	const QImage preview = imageFromMessage(cmd, layer);
+	if(preview.isNull())
+		return tiles;
+
+	for(int ty=0;ty<layer->ytiles();++ty) {
+		for(int tx=0;tx<layer->xtiles();++tx) {
+			if(layer->tile(tx, ty))
+				continue;
+
+			const QImage b = preview.copy(tx * block, ty * block, block, block);
+			bool blank = true;
+			for(int y=0;y<block && blank;++y) {
+				const quint32 *ptr = reinterpret_cast<const quint32*>(b.constScanLine(y));
+				for(int x=0;x<block;++x) {
+					if(qAlpha(ptr[x])) {
+						blank = false;
+						break;
+					}
+				}
+			}
+			if(blank)
+				continue;
+
+			const QImage scaled = b.convertToFormat(QImage::Format_ARGB32_Premultiplied)
+				.scaled(Tile::SIZE, Tile::SIZE, Qt::IgnoreAspectRatio, Qt::SmoothTransformation)
+				.convertToFormat(QImage::Format_ARGB32);
+
+			Tile *t = new Tile(scaled, tx, ty, tx * Tile::SIZE, ty * Tile::SIZE);
+			t->crop(qMin(int(Tile::SIZE), layer->width() - tx * Tile::SIZE), qMin(int(Tile::SIZE), layer->height() - ty * Tile::SIZE));
+			tiles.append(t);
+		}
+	}
+
+	return tiles;
+}
+
+/**
+ * Solid color tiles (including blank ones) are sent as just the color.
+ * @param ctxid user ID
+ * @param layer target layer ID
+ * @param tile the tile to put. The tile's position is used
+ * @param blend alpha blend instead of overwrite
+ * @return PutTile command
+ */
+protocol::MessagePtr putTile(int ctxid, int layer, const dpcore::Tile *tile, bool blend)
+{
+	const uint8_t flags = blend ? protocol::PutTile::MODE_BLEND : 0;
+
+	if(tile->isSolid())
+		return protocol::MessagePtr(new protocol::PutTile(ctxid, layer, flags, tile->x(), tile->y(), tile->pixel(0, 0)));
+
+	return protocol::MessagePtr(new protocol::PutTile(
+		ctxid,
+		layer,
+		flags,
+		tile->x(),
+		tile->y(),
+		qCompress(reinterpret_cast<const uchar*>(tile->data()), dpcore::Tile::BYTES)
+	));
+}
+
+/**
+ * @param cmd the command to decode
+ * @return new tile or 0 if the pixel data is invalid
+ */
+dpcore::Tile *tileFromMessage(const protocol::PutTile &cmd)
+{
+	using dpcore::Tile;
+
+	if(cmd.isSolid())
+		return new Tile(QColor::fromRgba(cmd.color()), cmd.column(), cmd.row());
+
+	const QByteArray data = qUncompress(cmd.image());
+	if(data.length() != Tile::BYTES)
+		return 0;
+
+	return new Tile(reinterpret_cast<const uchar*>(data.constData()), cmd.column(), cmd.row());
+}
+
+protocol::MessagePtr brushToToolChange(int userid, int layer, const dpcore::Brush &brush)
+{
+	uint8_t mode = brush.subpixel() ? protocol::TOOL_MODE_SUBPIXEL : 0;
+	mode |= brush.incremental() ? protocol::TOOL_MODE_INCREMENTAL : 0;
+
+	return protocol::MessagePtr(new protocol::ToolChange(
+		userid,
+		layer,
+		brush.blendingMode(),
+		mode,
+		brush.spacing(),
+		brush.color(1.0).rgba(),
+		brush.color(0.0).rgba(),
+		brush.hardness(1.0) * 255,
+		brush.hardness(0.0) * 255,
+		brush.radius(1.0),
+		brush.radius(0.0),
+		brush.opacity(1.0) * 255,
+		brush.opacity(0.0) * 255
+	));
+}
+
+
+/**
+ * Convert a dpcore::Point to network format. The
+ * reverse operation for this is in statetracker.cpp
+ * @param p
+ * @return
+ */
+protocol::PenPoint pointToProtocol(const dpcore::Point &p)
+{
+	// The two least significant bits of the coordinate
+	// are the fractional part.
+	// The rest is the integer part with a bias of 128
+	uint16_t x = (qMax(0, p.x() + 128) << 2) | (uint16_t(p.xFrac()*4) & 3);
+	uint16_t y = (qMax(0, p.y() + 128) << 2) | (uint16_t(p.yFrac()*4) & 3);
+
+	return protocol::PenPoint(x, y, p.pressure() * 255);
+}
+
+/**
+ * Convert a dpcore::Point to network format. The
+ * reverse operation for this is in statetracker.cpp
+ * @param p
+ * @return
+ */
+protocol::PenPointVector pointsToProtocol(const dpcore::PointVector &points)
+{
+	protocol::PenPointVector ppvec;
+	foreach(const dpcore::Point &p, points)
+		ppvec.append(pointToProtocol(p));
+
+	return ppvec;
+}
+
+
+}
@@ -0,0 +1,74 @@
+#ifndef DP_CORE_NETUTILS_H
+#define DP_CORE_NETUTILS_H
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#include "../shared/net/message.h"
+#include "../shared/net/pen.h"
+#include "point.h"
+
+namespace dpcore {
+	class Brush;
+	class Tile;
+	class Layer;
+}
+
+namespace protocol {
+	class PutImage;
+	class PutTile;
+}
+
+namespace net {
+
+//! Generate a list of PutImage and PutTile commands from a QImage
+QList<protocol::MessagePtr> putQImage(int ctxid, int layer, int x, int y, const QImage &image, bool blend);
+
+//! Generate a delta coded PutImage command, if the delta fits in one
+QList<protocol::MessagePtr> putQImageDelta(int ctxid, int layer, int x, int y, const QImage &image, const QImage &base);
+
+//! Get the checksum of the layer content a delta coded image was made against
+quint32 deltaChecksum(const protocol::PutImage &cmd);
+
+//! Decode the image of a PutImage command
+QImage imageFromMessage(const protocol::PutImage &cmd, const dpcore::Layer *layer);
+
+//! Generate a downscaled preview of a layer for a snapshot
+QList<protocol::MessagePtr> putLayerPreview(int layer, int xtiles, int ytiles, const QList<const dpcore::Tile*> &tiles);
+
+//! Decode the missing tiles of a layer from a preview
+QList<dpcore::Tile*> tilesFromPreview(const protocol::PutImage &cmd, const dpcore::Layer *layer);
+
+//! Generate a PutTile command from a tile
+protocol::MessagePtr putTile(int ctxid, int layer, const dpcore::Tile *tile, bool blend);
+
+//! Decode the tile of a PutTile command
+dpcore::Tile *tileFromMessage(const protocol::PutTile &cmd);
+
+//! Generate a tool change message
+protocol::MessagePtr brushToToolChange(int userid, int layer, const dpcore::Brush &brush);
+
+
+protocol::PenPoint pointToProtocol(const dpcore::Point &p);
+protocol::PenPointVector pointsToProtocol(const dpcore::PointVector &points);
+
+}
+
+#endif
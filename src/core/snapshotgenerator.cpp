@@ -0,0 +1,99 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+#include "snapshotgenerator.h"
+#include "checkpoint.h"
+
+namespace drawingboard {
+
+SnapshotGenerator::SnapshotGenerator(QSharedPointer<const CanvasCheckpoint> checkpoint, const QList<protocol::MessagePtr> &history, QObject *parent)
+	: QThread(parent), _checkpoint(checkpoint), _history(history), _done(false), _cancel(0)
+{
+}
+
+SnapshotGenerator::~SnapshotGenerator()
+{
+	_cancel.storeRelease(1);
+	wait();
+}
+
+void SnapshotGenerator::run()
+{
+	if(_checkpoint) {
+		addPart(_checkpoint->headerMessages());
+
+		// Layers and their previews first, so the joining users can
+		// see the whole picture before the full resolution tiles arrive
+		QList<protocol::MessagePtr> layers;
+		for(int i=0;i<_checkpoint->layerCount();++i) {
+			if(_cancel.loadAcquire())
+				return;
+			layers.append(_checkpoint->layerMessages(i));
+		}
+		addPart(layers);
+
+		for(int i=0;i<_checkpoint->layerCount();++i) {
+			if(_cancel.loadAcquire())
+				return;
+			addPart(_checkpoint->tileMessages(i));
+		}
+
+		addPart(_checkpoint->trailerMessages());
+	}
+
+	addPart(_history, true);
+}
+
+/**
+ * Parts are handed over to the generator's own thread, where
+ * they are delivered in order.
+ */
+void SnapshotGenerator::addPart(const QList<protocol::MessagePtr> &messages, bool last)
+{
+	{
+		QMutexLocker lock(&_mutex);
+		_parts.append(messages);
+		_done = last;
+	}
+	QMetaObject::invokeMethod(this, "deliverParts", Qt::QueuedConnection);
+}
+
+void SnapshotGenerator::deliverParts()
+{
+	QList<QList<protocol::MessagePtr> > parts;
+	bool done;
+	{
+		QMutexLocker lock(&_mutex);
+		parts = _parts;
+		_parts.clear();
+		done = _done;
+	}
+
+	if(parts.isEmpty())
+		return;
+
+	for(int i=0;i<parts.size();++i)
+		emit snapshotPart(parts.at(i), done && i == parts.size()-1);
+
+	if(done)
+		deleteLater();
+}
+
+}
@@ -0,0 +1,88 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+#ifndef DP_SNAPSHOTGENERATOR_H
+#define DP_SNAPSHOTGENERATOR_H
+
+#include <QThread>
+#include <QMutex>
+#include <QList>
+#include <QSharedPointer>
+#include <QAtomicInt>
+
+#include "../shared/net/message.h"
+
+namespace drawingboard {
+
+class CanvasCheckpoint;
+
+/**
+ * \brief Snapshot generation thread
+ *
+ * Encodes a checkpoint (followed by the commands received after it) into
+ * snapshot commands without blocking the user interface, or in the server's
+ * case, the session. The snapshot
+ * is delivered in parts, one layer at a time, so uploading can start
+ * while the rest of the layers are still being encoded.
+ *
+ * The generator deletes itself after the last part has been delivered.
+ */
+class SnapshotGenerator : public QThread {
+	Q_OBJECT
+public:
+	/**
+	 * @param checkpoint the checkpoint to encode (may be null)
+	 * @param history commands received after the checkpoint
+	 * @param parent
+	 */
+	SnapshotGenerator(QSharedPointer<const CanvasCheckpoint> checkpoint, const QList<protocol::MessagePtr> &history, QObject *parent=0);
+	~SnapshotGenerator();
+
+signals:
+	/**
+	 * @brief A part of the snapshot is ready
+	 *
+	 * This is emitted in the thread the generator object lives in.
+	 * @param messages snapshot commands
+	 * @param complete is this the last part
+	 */
+	void snapshotPart(const QList<protocol::MessagePtr> &messages, bool complete);
+
+protected:
+	void run();
+
+private slots:
+	void deliverParts();
+
+private:
+	void addPart(const QList<protocol::MessagePtr> &messages, bool last=false);
+
+	QSharedPointer<const CanvasCheckpoint> _checkpoint;
+	QList<protocol::MessagePtr> _history;
+
+	QMutex _mutex;
+	QList<QList<protocol::MessagePtr> > _parts;
+	bool _done;
+	QAtomicInt _cancel;
+};
+
+}
+
+#endif
@@ -28,24 +28,38 @@
 namespace dpcore {
 
 Tile::Tile(const QColor& color, int x, int y)
-	: x_(x), y_(y)
+	: x_(x), y_(y), d_(new Data)
 {
-	quint32 *ptr = data_;
+	quint32 *ptr = d_->pixels;
 	quint32 col = color.rgba();
 	for(int i=0;i<SIZE*SIZE;++i)
 		*(ptr++) = col;
 }
 
 Tile::Tile(int x, int y)
-	: x_(x), y_(y)
+	: x_(x), y_(y), d_(new Data)
 {
-	memset(data_, 0, BYTES);
+	memset(d_->pixels, 0, BYTES);
 }
 
+/**
+ * @param pixels pixel data. Must be BYTES long
+ * @param x tile X index
+ * @param y tile Y index
+ */
+Tile::Tile(const uchar *pixels, int x, int y)
+	: x_(x), y_(y), d_(new Data)
+{
+	memcpy(d_->pixels, pixels, BYTES);
+}
+
+/**
+ * The pixel data is shared until either tile is modified.
+ * @param src the tile to copy
+ */
 Tile::Tile(const Tile *src)
-	: x_(src->x_), y_(src->y_)
+	: x_(src->x_), y_(src->y_), d_(src->d_)
 {
-	memcpy(data_, src->data_, BYTES);
 }
 
 /**
@@ -58,7 +72,7 @@ Tile::Tile(const Tile *src)
  * @param yoff source image offset
  */
 Tile::Tile(const QImage& image, int xi, int yi, int xoff, int yoff)
-	: x_(xi), y_(yi)
+	: x_(xi), y_(yi), d_(new Data)
 {
 	// Tile top-left coordinates relative to layer origin
 	const int x = xi * SIZE;
@@ -72,10 +86,10 @@ Tile::Tile(const QImage& image, int xi, int yi, int xoff, int yoff)
 
 	// If we are not writing the whole tile, initialize memory first
 	if(top || left || bottom<SIZE || right<SIZE) 
-		memset(data_, 0, BYTES);
+		memset(d_->pixels, 0, BYTES);
 
 	// Copy pixels from source area
-	uchar *dest = reinterpret_cast<uchar*>(data_) + (SIZE * 4 * top) + (4 * left);
+	uchar *dest = reinterpret_cast<uchar*>(d_->pixels) + (SIZE * 4 * top) + (4 * left);
 	for(int yy=top;yy<bottom;++yy) {
 		const uchar *pixels = image.scanLine(y + yy - yoff) + (x+left-xoff)*4;
 		memcpy(dest, pixels, (right-left)*4);
@@ -102,22 +116,38 @@ void Tile::fillChecker(quint32 *data, const QColor& dark, const QColor& light)
 
 void Tile::fillChecker(const QColor& dark, const QColor& light)
 {
-	fillChecker(data_, dark, light);
+	fillChecker(d_->pixels, dark, light);
 }
 
 void Tile::fillColor(const QColor& color)
 {
 	const quint32 c = color.rgba();
-	quint32 *ptr = data_;
+	quint32 *ptr = d_->pixels;
 	for(int i=0;i<SIZE*SIZE;++i)
 		*(ptr++) = c;
 }
 
+/**
+ * @param w width of the area to keep
+ * @param h height of the area to keep
+ */
+void Tile::crop(int w, int h)
+{
+	Q_ASSERT(w>=0 && w<=SIZE);
+	Q_ASSERT(h>=0 && h<=SIZE);
+	if(w<SIZE) {
+		for(int y=0;y<h;++y)
+			memset(d_->pixels + y*SIZE + w, 0, (SIZE-w) * sizeof(quint32));
+	}
+	if(h<SIZE)
+		memset(d_->pixels + h*SIZE, 0, (SIZE-h) * SIZE * sizeof(quint32));
+}
+
 void Tile::copyToImage(QImage& image) const {
 #if 0
 	int w = 4*(image.width()-x_*SIZE<SIZE?image.width()-x_*SIZE:SIZE);
 	int h = image.height()-y_*SIZE<SIZE?image.height()-y_*SIZE:SIZE;
-	const quint32 *ptr = data_;
+	const quint32 *ptr = d_->pixels;
 	uchar *targ = image.bits() + (y_ * SIZE) * image.bytesPerLine() + (x_ * SIZE) * 4;
 	for(int y=0;y<h;++y) {
 		memcpy(targ, ptr, w);
@@ -132,7 +162,7 @@ void Tile::copyToImage(QImage& image) const {
 void Tile::copyToImage(QImage& image, int x, int y) const {
 	int w = 4*(image.width()-x<SIZE ? image.width()-x : SIZE);
 	int h = image.height()-y<SIZE ? image.height()-y : SIZE;
-	const quint32 *ptr = data_;
+	const quint32 *ptr = d_->pixels;
 	uchar *targ = image.bits() + y * image.bytesPerLine() + x * 4;
 	for(int y=0;y<h;++y) {
 		memcpy(targ, ptr, w);
@@ -154,7 +184,7 @@ void Tile::composite(int mode, const uchar *values, const QColor& color, int x,
 {
 	Q_ASSERT(x>=0 && x<SIZE && y>=0 && y<SIZE);
 	Q_ASSERT((x+w)<=SIZE && (y+h)<=SIZE);
-	compositeMask(mode, data_ + y * SIZE + x,
+	compositeMask(mode, d_->pixels + y * SIZE + x,
 			color.rgba(), values, w, h, skip, SIZE-w);
 }
 
@@ -166,7 +196,7 @@ void Tile::composite(int mode, const uchar *values, const QColor& color, int x,
 void Tile::merge(const Tile *tile, uchar opacity, int blend)
 {
 	if(tile!=0)
-		compositePixels(blend, data_, tile->data_, SIZE*SIZE, opacity);
+		compositePixels(blend, d_->pixels, tile->d_->pixels, SIZE*SIZE, opacity);
 }
 
 /**
@@ -174,8 +204,8 @@ void Tile::merge(const Tile *tile, uchar opacity, int blend)
  */
 bool Tile::isBlank() const
 {
-	const quint32 *pixel = data_;
-	const quint32 *end = data_ + SIZE*SIZE;
+	const quint32 *pixel = d_->pixels;
+	const quint32 *end = d_->pixels + SIZE*SIZE;
 	while(pixel<end) {
 		if((*pixel & 0xff000000))
 			return false;
@@ -184,5 +214,21 @@ bool Tile::isBlank() const
 	return true;
 }
 
+/**
+ * @return true if every pixel of this tile is the same as the first one
+ */
+bool Tile::isSolid() const
+{
+	const quint32 first = d_->pixels[0];
+	const quint32 *pixel = d_->pixels + 1;
+	const quint32 *end = d_->pixels + SIZE*SIZE;
+	while(pixel<end) {
+		if(*pixel != first)
+			return false;
+		++pixel;
+	}
+	return true;
+}
+
 }
 
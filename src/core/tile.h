@@ -21,6 +21,7 @@
 #define TILE_H
 
 #include <QPixmap>
+#include <QSharedData>
 
 class QColor;
 class QImage;
@@ -32,6 +33,8 @@ namespace dpcore {
  * @brief A piece of an image
  * Each tile is a square of size SIZE*SIZE. The pixel format is 32-bit ARGB.
  *
+ * The pixel data is implicitly shared: copying a tile is cheap and the
+ * data is copied only when one of the copies is modified.
  */
 class Tile {
 	public:
@@ -64,23 +67,29 @@ class Tile {
 		//! Construct a tile from an image
 		Tile(const QImage& image, int x, int y, int xoff=0, int yoff=0);
 
-		//! Construct a copy of the given tile
+		//! Construct a (shallow) copy of the given tile
 		Tile(const Tile *src);
 
 		//! Construct an empty tile
 		Tile(int x, int y);
 
+		//! Construct a tile from raw pixel data (BYTES long)
+		Tile(const uchar *pixels, int x, int y);
+
 		//! Get tile X index
 		int x() const { return x_; }
 
 		//! Get tile Y index
 		int y() const { return y_; }
 
+		//! Set the tile position (used when the tile grid is resized)
+		void setPosition(int x, int y) { x_ = x; y_ = y; }
+
 		//! Get a pixel value from this tile
 		quint32 pixel(int x, int y) const {
 			Q_ASSERT(x>=0 && x<SIZE);
 			Q_ASSERT(y>=0 && y<SIZE);
-			return *(data_ + y * SIZE + x);
+			return d_->pixels[y * SIZE + x];
 		}
 
 		//! Composite values multiplied by color onto this tile
@@ -101,18 +110,28 @@ class Tile {
 		//! Fill this tile with a solid color
 		void fillColor(const QColor& color);
 
+		//! Clear all pixels outside the given area at the top-left corner
+		void crop(int w, int h);
+
 		//! Get read access to the raw pixel data
-		const quint32 *data() const { return data_; }
+		const quint32 *data() const { return d_->pixels; }
 
 		//! Check if this tile is completely transparent
 		bool isBlank() const;
 
+		//! Check if every pixel of this tile has the same color
+		bool isSolid() const;
+
 		//! Fill a tile sized memory buffer with a checker pattenr
 		static void fillChecker(quint32 *data, const QColor& dark, const QColor& light);
 
 	private:
+		struct Data : public QSharedData {
+			quint32 pixels[SIZE*SIZE];
+		};
+
 		int x_, y_;
-		quint32 data_[SIZE*SIZE];
+		QSharedDataPointer<Data> d_;
 };
 
 }
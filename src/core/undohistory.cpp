@@ -0,0 +1,422 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+#include <QDebug>
+
+#include "undohistory.h"
+
+#include "layerstack.h"
+#include "layer.h"
+#include "tile.h"
+
+namespace drawingboard {
+
+TileUndo::~TileUndo()
+{
+	foreach(dpcore::Tile *t, _tiles)
+		delete t;
+}
+
+/**
+ * @param layer the layer whose tile to save
+ * @param index tile index
+ * @return true if the tile was not saved before
+ */
+bool TileUndo::save(const dpcore::Layer *layer, int index)
+{
+	if(_tiles.contains(index))
+		return false;
+
+	const dpcore::Tile *t = layer->tile(index);
+	if(t) {
+		_tiles[index] = new dpcore::Tile(t);
+		_memory += dpcore::Tile::BYTES;
+	} else {
+		_tiles[index] = 0;
+	}
+	return true;
+}
+
+void TileUndo::swap(dpcore::LayerStack *image)
+{
+	dpcore::Layer *layer = image->getLayer(_layer);
+	if(!layer) {
+		qWarning() << "undo: tiles of non-existent layer" << _layer;
+		return;
+	}
+
+	_memory = 0;
+	QMutableHashIterator<int, dpcore::Tile*> i(_tiles);
+	while(i.hasNext()) {
+		i.next();
+		i.setValue(layer->swapTile(i.key(), i.value()));
+		if(i.value())
+			_memory += dpcore::Tile::BYTES;
+	}
+}
+
+void LayerAttributeUndo::swap(dpcore::LayerStack *image)
+{
+	dpcore::Layer *layer = image->getLayer(_layer);
+	if(!layer) {
+		qWarning() << "undo: attributes of non-existent layer" << _layer;
+		return;
+	}
+
+	const int opacity = layer->opacity();
+	const int blend = layer->blendmode();
+	layer->setOpacity(_opacity);
+	layer->setBlend(_blend);
+	_opacity = opacity;
+	_blend = blend;
+}
+
+void LayerTitleUndo::swap(dpcore::LayerStack *image)
+{
+	dpcore::Layer *layer = image->getLayer(_layer);
+	if(!layer) {
+		qWarning() << "undo: title of non-existent layer" << _layer;
+		return;
+	}
+
+	const QString title = layer->title();
+	layer->setTitle(_title);
+	_title = title;
+}
+
+void LayerOrderUndo::swap(dpcore::LayerStack *image)
+{
+	const QList<uint8_t> order = image->layerOrder();
+	if(order.size() != _order.size()) {
+		qWarning() << "undo: layer count has changed, cannot restore layer order";
+		return;
+	}
+	image->reorderLayers(_order);
+	_order = order;
+}
+
+UndoPoint::~UndoPoint()
+{
+	qDeleteAll(actions);
+}
+
+bool UndoPoint::overlaps(const UndoPoint *other) const
+{
+	// Changes to the same layer attributes
+	foreach(int l, wholelayers)
+		if(other->wholelayers.contains(l))
+			return true;
+
+	// Barriers conflict with any change to the layer
+	if(isBarrier() || other->isBarrier()) {
+		foreach(int l, layers)
+			if(other->layers.contains(l))
+				return true;
+	}
+
+	// Changes to the same tiles. Iterate through the smaller set
+	const QSet<qint64> &a = tiles.size() < other->tiles.size() ? tiles : other->tiles;
+	const QSet<qint64> &b = tiles.size() < other->tiles.size() ? other->tiles : tiles;
+	foreach(qint64 t, a)
+		if(b.contains(t))
+			return true;
+
+	return false;
+}
+
+UndoHistory::UndoHistory(dpcore::LayerStack *image)
+	: _image(image), _seq(1), _horizon(0), _memory(0), _limit(DEFAULT_LIMIT)
+{
+}
+
+UndoHistory::~UndoHistory()
+{
+	qDeleteAll(_history);
+}
+
+UndoPoint *UndoHistory::begin(int context, int type)
+{
+	finish(context);
+
+	// A new action invalidates the redo history
+	QList<UndoPoint*> redo;
+	foreach(UndoPoint *p, _history)
+		if(p->context == context && p->undone)
+			redo.append(p);
+	foreach(UndoPoint *p, redo)
+		remove(p);
+
+	UndoPoint *point = new UndoPoint(context, type, _seq);
+	_history.append(point);
+	_open[context] = point;
+	trim(context);
+	return point;
+}
+
+void UndoHistory::saveTiles(UndoPoint *point, const dpcore::Layer *layer, const QRect &area)
+{
+	point->end = _seq;
+
+	const QRect r = area.intersected(QRect(0, 0, layer->width(), layer->height()));
+	if(r.isEmpty())
+		return;
+
+	TileUndo *tu = point->tileundo.value(layer->id());
+	if(!tu) {
+		tu = new TileUndo(layer->id());
+		point->tileundo[layer->id()] = tu;
+		point->actions.append(tu);
+		point->layers.insert(layer->id());
+	}
+
+	const uint before = tu->memoryUsage();
+	const qint64 key = qint64(layer->id()) << 32;
+
+	const int tx0 = r.left() / dpcore::Tile::SIZE;
+	const int tx1 = r.right() / dpcore::Tile::SIZE;
+	const int ty0 = r.top() / dpcore::Tile::SIZE;
+	const int ty1 = r.bottom() / dpcore::Tile::SIZE;
+	for(int ty=ty0;ty<=ty1;++ty) {
+		for(int tx=tx0;tx<=tx1;++tx) {
+			const int i = ty * layer->xtiles() + tx;
+			if(tu->save(layer, i))
+				point->tiles.insert(key | i);
+		}
+	}
+
+	const uint added = tu->memoryUsage() - before;
+	point->memory += added;
+	_memory += added;
+}
+
+void UndoHistory::addAction(UndoPoint *point, UndoAction *action, int layer)
+{
+	point->end = _seq;
+	point->actions.append(action);
+	point->layers.insert(layer);
+	point->wholelayers.insert(layer);
+
+	const uint mem = action->memoryUsage();
+	point->memory += mem;
+	_memory += mem;
+}
+
+void UndoHistory::finish(int context)
+{
+	UndoPoint *point = _open.take(context);
+	if(point)
+		point->done = true;
+}
+
+void UndoHistory::addBarrier(int layer)
+{
+	// Barriers belong to no user, so they conflict with everyone's changes
+	UndoPoint *point = new UndoPoint(0, 0, _seq);
+	point->layers.insert(layer);
+	point->wholelayers.insert(layer);
+	point->done = true;
+	_history.append(point);
+	removeObsolete();
+}
+
+const UndoPoint *UndoHistory::undo(int context)
+{
+	finish(context);
+
+	// Find the latest group of this user that hasn't been undone yet
+	UndoPoint *point = 0;
+	for(int i=_history.size()-1;i>=0;--i) {
+		if(_history.at(i)->context == context && !_history.at(i)->undone) {
+			point = _history.at(i);
+			break;
+		}
+	}
+
+	if(!point || point->dropped || point->begin < _horizon) {
+		qDebug() << "Nothing to undo for user" << context;
+		return 0;
+	}
+
+	if(!resolveConflicts(point, point->begin)) {
+		qDebug() << "Cannot undo: content changed by user" << context << "has since been changed by another user";
+		return 0;
+	}
+
+	for(int i=point->actions.size()-1;i>=0;--i)
+		point->actions.at(i)->swap(_image);
+
+	point->undone = _seq;
+	updateMemoryUsage(point);
+	return point;
+}
+
+const UndoPoint *UndoHistory::redo(int context)
+{
+	finish(context);
+
+	// Find the most recently undone group of this user
+	UndoPoint *point = 0;
+	foreach(UndoPoint *p, _history) {
+		if(p->context == context && p->undone && (!point || p->undone > point->undone))
+			point = p;
+	}
+
+	if(!point || point->undone < _horizon) {
+		qDebug() << "Nothing to redo for user" << context;
+		return 0;
+	}
+
+	if(!resolveConflicts(point, point->undone)) {
+		qDebug() << "Cannot redo: content undone by user" << context << "has since been changed by another user";
+		return 0;
+	}
+
+	foreach(UndoAction *a, point->actions)
+		a->swap(_image);
+
+	point->undone = 0;
+	updateMemoryUsage(point);
+	return point;
+}
+
+void UndoHistory::clear()
+{
+	qDeleteAll(_history);
+	_history.clear();
+	_open.clear();
+	_memory = 0;
+	_horizon = _seq;
+}
+
+/**
+ * Check that no other user has changed the content touched by the given group
+ * after the given sequence number. Undone groups of other users whose
+ * redo would overwrite the change lose their redo.
+ *
+ * @param point the group to undo or redo
+ * @param since sequence number after which changes by other users conflict
+ * @return true if the group can be undone or redone
+ */
+bool UndoHistory::resolveConflicts(const UndoPoint *point, uint since)
+{
+	QList<UndoPoint*> stale;
+	foreach(UndoPoint *p, _history) {
+		if(p == point || p->context == point->context || p->end < since)
+			continue;
+
+		if(point->overlaps(p)) {
+			if(p->undone)
+				stale.append(p);
+			else
+				return false;
+		}
+	}
+
+	foreach(UndoPoint *p, stale)
+		remove(p);
+
+	return true;
+}
+
+void UndoHistory::updateMemoryUsage(UndoPoint *point)
+{
+	uint mem = 0;
+	foreach(const UndoAction *a, point->actions)
+		mem += a->memoryUsage();
+	_memory = _memory - point->memory + mem;
+	point->memory = mem;
+}
+
+void UndoHistory::remove(UndoPoint *point)
+{
+	_history.removeOne(point);
+	if(_open.value(point->context) == point)
+		_open.remove(point->context);
+	_memory -= point->memory;
+	delete point;
+}
+
+/**
+ * Drop the saved state of the group. The group can no longer be undone,
+ * but what it touched is still known, so undoing other users' groups
+ * that it conflicts with is still refused.
+ */
+void UndoHistory::drop(UndoPoint *point)
+{
+	qDeleteAll(point->actions);
+	point->actions.clear();
+	point->tileundo.clear();
+	_memory -= point->memory;
+	point->memory = 0;
+	point->dropped = true;
+}
+
+/**
+ * Drop the groups of the user that don't fit in the history anymore.
+ * An undone group is removed outright, since its changes are not on the
+ * canvas and can't conflict with anything.
+ *
+ * This depends only on the command stream, so every client trims
+ * its history the same way.
+ * @param context the user whose history to trim
+ */
+void UndoHistory::trim(int context)
+{
+	int count = 0;
+	for(int i=_history.size()-1;i>=0;--i) {
+		UndoPoint *point = _history.at(i);
+		if(point->context != context || point->dropped)
+			continue;
+
+		if(++count > _limit) {
+			if(point->undone)
+				remove(point);
+			else
+				drop(point);
+		}
+	}
+
+	removeObsolete();
+}
+
+/**
+ * Barriers and dropped groups exist only to be checked against older groups,
+ * so they are removed once every group that can still be undone or redone
+ * began after them.
+ */
+void UndoHistory::removeObsolete()
+{
+	uint oldest = _seq + 1;
+	foreach(const UndoPoint *p, _history) {
+		if(p->isLive()) {
+			oldest = p->begin;
+			break;
+		}
+	}
+
+	QList<UndoPoint*> obsolete;
+	foreach(UndoPoint *p, _history)
+		if(!p->isLive() && p->end < oldest)
+			obsolete.append(p);
+	foreach(UndoPoint *p, obsolete)
+		remove(p);
+}
+
+}
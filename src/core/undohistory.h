@@ -0,0 +1,300 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+#ifndef DP_UNDOHISTORY_H
+#define DP_UNDOHISTORY_H
+
+#include <QHash>
+#include <QSet>
+#include <QList>
+#include <QString>
+#include <QRect>
+
+namespace dpcore {
+	class LayerStack;
+	class Layer;
+	class Tile;
+}
+
+namespace drawingboard {
+
+/**
+ * \brief A single reversible change
+ *
+ * An undo action holds the state that was replaced by a change. Undoing and
+ * redoing are the same operation: the saved state is swapped with the current
+ * state of the canvas.
+ */
+class UndoAction {
+public:
+	virtual ~UndoAction() {}
+
+	//! Swap the saved state with the current state of the canvas
+	virtual void swap(dpcore::LayerStack *image) = 0;
+
+	//! Get the (approximate) amount of memory used by the saved state
+	virtual uint memoryUsage() const = 0;
+};
+
+/**
+ * \brief Saved tile contents of a single layer
+ */
+class TileUndo : public UndoAction {
+public:
+	explicit TileUndo(int layer) : _layer(layer), _memory(0) {}
+	~TileUndo();
+
+	//! Save a copy of the tile, unless it has been saved already
+	bool save(const dpcore::Layer *layer, int index);
+
+	void swap(dpcore::LayerStack *image);
+	uint memoryUsage() const { return _memory; }
+
+private:
+	int _layer;
+	QHash<int, dpcore::Tile*> _tiles;
+	uint _memory;
+};
+
+/**
+ * \brief Saved layer opacity and blending mode
+ */
+class LayerAttributeUndo : public UndoAction {
+public:
+	LayerAttributeUndo(int layer, int opacity, int blend) : _layer(layer), _opacity(opacity), _blend(blend) {}
+
+	void swap(dpcore::LayerStack *image);
+	uint memoryUsage() const { return sizeof(*this); }
+
+private:
+	int _layer;
+	int _opacity;
+	int _blend;
+};
+
+/**
+ * \brief Saved layer title
+ */
+class LayerTitleUndo : public UndoAction {
+public:
+	LayerTitleUndo(int layer, const QString &title) : _layer(layer), _title(title) {}
+
+	void swap(dpcore::LayerStack *image);
+	uint memoryUsage() const { return sizeof(*this) + _title.length() * 2; }
+
+private:
+	int _layer;
+	QString _title;
+};
+
+/**
+ * \brief Saved layer stacking order
+ */
+class LayerOrderUndo : public UndoAction {
+public:
+	explicit LayerOrderUndo(const QList<uint8_t> &order) : _order(order) {}
+
+	void swap(dpcore::LayerStack *image);
+	uint memoryUsage() const { return sizeof(*this) + _order.size(); }
+
+private:
+	QList<uint8_t> _order;
+};
+
+/**
+ * \brief An undoable group of commands
+ *
+ * Undo points are created for pen strokes (from the first PenMove to PenUp),
+ * pasted images (from the first PutImage or PutTile to the one with the end flag)
+ * and layer attribute, title and order changes.
+ */
+struct UndoPoint {
+	UndoPoint(int ctx, int type_, uint seq) : context(ctx), type(type_), begin(seq), end(seq), undone(0), memory(0), done(false), dropped(false) {}
+	~UndoPoint();
+
+	//! The user who made the change
+	int context;
+
+	//! Type of the command that started the group
+	int type;
+
+	//! Sequence numbers of the first and latest change of this group
+	uint begin, end;
+
+	//! Sequence number of the undo operation (0 if not undone)
+	uint undone;
+
+	//! Memory used by saved state
+	uint memory;
+
+	//! Has the group been finished
+	bool done;
+
+	//! Has the saved state been dropped? The group is then kept only for conflict detection
+	bool dropped;
+
+	//! The actions in the order they were performed
+	QList<UndoAction*> actions;
+
+	//! The tiles saved by this group: (layer id << 32) | tile index
+	QSet<qint64> tiles;
+
+	//! The layers touched by this group
+	QSet<int> layers;
+
+	//! The layers whose attributes were changed (-1 is the layer stacking order)
+	QSet<int> wholelayers;
+
+	//! Tile undo actions by layer
+	QHash<int, TileUndo*> tileundo;
+
+	//! Check if this group touches any of the same canvas content as the other one
+	bool overlaps(const UndoPoint *other) const;
+
+	//! Has this group changed any layer attributes
+	bool hasLayerChanges() const { return !wholelayers.isEmpty(); }
+
+	//! Is this a non-undoable change made by no user in particular
+	bool isBarrier() const { return context == 0; }
+
+	//! Can this group still be undone or redone
+	bool isLive() const { return !isBarrier() && !dropped; }
+};
+
+/**
+ * \brief Tile delta based undo history
+ *
+ * Each undoable group of commands stores the pre-images of the tiles it
+ * touched (and any changed layer properties), so undoing restores just those
+ * tiles instead of replaying the history.
+ *
+ * Since restoring saved tiles would overwrite changes made by other users,
+ * an undo (or redo) is refused if another user has since changed the same
+ * tiles. This decision depends only on the command stream, so it is the same
+ * for every client, as long as they all have the same undo points in memory.
+ * This is why the history length is a number of groups per user set for the
+ * whole session (see setLimit()) rather than something each client could
+ * choose for itself.
+ *
+ * When a group falls off the end of its user's history, its saved state is
+ * dropped, but the record of what it touched is kept as long as an older
+ * group of some other user could still conflict with it.
+ */
+class UndoHistory {
+public:
+	//! Number of undoable groups kept per user until the session sets a limit
+	static const int DEFAULT_LIMIT = 30;
+
+	explicit UndoHistory(dpcore::LayerStack *image);
+	~UndoHistory();
+
+	//! Get the amount of memory currently used
+	uint memoryUsage() const { return _memory; }
+
+	/**
+	 * @brief Set the number of undoable groups kept per user
+	 *
+	 * Every client must change the limit at the same point in the command
+	 * stream. Histories that are now too long are trimmed as their users
+	 * start new groups.
+	 * @param limit the new limit (at least 1)
+	 */
+	void setLimit(int limit) { Q_ASSERT(limit>0); _limit = limit; }
+
+	//! Get the number of undoable groups kept per user
+	int limit() const { return _limit; }
+
+	//! Advance the command sequence counter. This is called for each command.
+	void tick() { ++_seq; }
+
+	/**
+	 * @brief Start a new undoable command group
+	 *
+	 * The currently open group of the user (if any) is finished and
+	 * the redo history of the user is cleared.
+	 * @param context user ID
+	 * @param type type of the command that starts the group
+	 * @return the new undo point (owned by the history)
+	 */
+	UndoPoint *begin(int context, int type);
+
+	//! Get the currently open group of the user (or 0 if none)
+	UndoPoint *openPoint(int context) const { return _open.value(context); }
+
+	//! Save the tiles under the given area before they are changed
+	void saveTiles(UndoPoint *point, const dpcore::Layer *layer, const QRect &area);
+
+	/**
+	 * @brief Add a layer level action to the group
+	 * @param point the group
+	 * @param action the action (history takes ownership)
+	 * @param layer the layer whose attributes changed (-1 for the layer stacking order)
+	 */
+	void addAction(UndoPoint *point, UndoAction *action, int layer);
+
+	//! Finish the currently open group of the user
+	void finish(int context);
+
+	/**
+	 * @brief Record a change that cannot be undone
+	 *
+	 * Changes made to the layer before this point can no longer be undone
+	 * by anyone.
+	 * @param layer the layer that was changed (-1 for the layer stacking order)
+	 */
+	void addBarrier(int layer);
+
+	/**
+	 * @brief Undo the latest group of the user
+	 * @param context user ID
+	 * @return the undone group or 0 if nothing could be undone
+	 */
+	const UndoPoint *undo(int context);
+
+	/**
+	 * @brief Redo the latest undone group of the user
+	 * @param context user ID
+	 * @return the redone group or 0 if nothing could be redone
+	 */
+	const UndoPoint *redo(int context);
+
+	//! Forget all undo history
+	void clear();
+
+private:
+	bool resolveConflicts(const UndoPoint *point, uint since);
+	void updateMemoryUsage(UndoPoint *point);
+	void remove(UndoPoint *point);
+	void drop(UndoPoint *point);
+	void trim(int context);
+	void removeObsolete();
+
+	dpcore::LayerStack *_image;
+	QList<UndoPoint*> _history;
+	QHash<int, UndoPoint*> _open;
+	uint _seq;
+	uint _horizon;
+	uint _memory;
+	int _limit;
+};
+
+}
+
+#endif
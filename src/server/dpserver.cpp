@@ -13,10 +13,17 @@ void printHelp() {
 	std::cout << "DrawPile standalone server. Usage:\n\n"
 		"drawpile-srv [options]\n\n"
 		"Options:\n"
-		"\t--port, -p <port>           Listening port (default: "
+		"\t--port, -p <port>             Listening port (default: "
 		<< DRAWPILE_PROTO_DEFAULT_PORT << ")\n"
-		"\t--listen, -l <address>      Listening address (default: all)\n"
-		"\t--verbose, -v               Verbose mode\n";
+		"\t--listen, -l <address>        Listening address (default: all)\n"
+		"\t--threads, -t <count>         Number of client I/O threads (default: 0, do I/O in the session's thread)\n"
+		"\t--session-threads, -s <count> Number of session threads (default: 0, run sessions in the main thread)\n"
+		"\t--memory-limit, -m <MiB>      Session history to keep in memory. The rest is spilled to disk (default: 0, unlimited)\n"
+		"\t--compact, -k                 Compact session history before new users download it\n"
+#ifdef SERVER_CANVAS
+		"\t--canvas, -c                  Keep a copy of the canvas and make snapshots on the server\n"
+#endif
+		"\t--verbose, -v                 Verbose mode\n";
 }
 
 int main(int argc, char *argv[]) {
@@ -25,6 +32,11 @@ int main(int argc, char *argv[]) {
 	int port = DRAWPILE_PROTO_DEFAULT_PORT;
 	QHostAddress address = QHostAddress::Any;
 	bool verbose = false;
+	int threads = 0;
+	int sessionthreads = 0;
+	bool canvas = false;
+	int memorylimit = 0;
+	bool compact = false;
 
 	// Parse command line arguments
 	// TODO
@@ -53,6 +65,45 @@ int main(int argc, char *argv[]) {
 				cerr << "Not a valid address: " << args[i].toUtf8().constData() << "\n";
 				return 1;
 			}
+		} else if(args[i]=="--threads" || args[i]=="-t") {
+			if(i+1>=args.size()) {
+				cerr << "Thread count not specified\n";
+				return 1;
+			}
+			bool ok;
+			threads = args[++i].toInt(&ok);
+			if(!ok || threads<0) {
+				cerr << args[i].toUtf8().constData() << " is not a valid thread count.\n";
+				return 1;
+			}
+		} else if(args[i]=="--session-threads" || args[i]=="-s") {
+			if(i+1>=args.size()) {
+				cerr << "Thread count not specified\n";
+				return 1;
+			}
+			bool ok;
+			sessionthreads = args[++i].toInt(&ok);
+			if(!ok || sessionthreads<0) {
+				cerr << args[i].toUtf8().constData() << " is not a valid thread count.\n";
+				return 1;
+			}
+		} else if(args[i]=="--memory-limit" || args[i]=="-m") {
+			if(i+1>=args.size()) {
+				cerr << "Memory limit not specified\n";
+				return 1;
+			}
+			bool ok;
+			memorylimit = args[++i].toInt(&ok);
+			if(!ok || memorylimit<0 || memorylimit>4095) {
+				cerr << args[i].toUtf8().constData() << " is not a valid memory limit.\n";
+				return 1;
+			}
+		} else if(args[i]=="--compact" || args[i]=="-k") {
+			compact = true;
+#ifdef SERVER_CANVAS
+		} else if(args[i]=="--canvas" || args[i]=="-c") {
+			canvas = true;
+#endif
 		} else if(args[i]=="--verbose" || args[i]=="-v") {
 			verbose = true;
 		} else {
@@ -70,6 +121,12 @@ int main(int argc, char *argv[]) {
 	if(verbose)
 		server->setDebugStream(new QTextStream(stdout));
 
+	server->setIoThreads(threads);
+	server->setSessionThreads(sessionthreads);
+	server->setServerCanvas(canvas);
+	server->setHistoryMemoryLimit(uint(memorylimit) * 1024 * 1024);
+	server->setHistoryCompaction(compact);
+
 	if(!server->start(port, false, address))
 		return 1;
 
@@ -0,0 +1,117 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#include <zlib.h>
+
+#include "deflate.h"
+
+namespace protocol {
+
+// Output buffer growth step
+static const int CHUNK = 1024 * 16;
+
+Deflater::Deflater()
+	: _strm(new z_stream), _unflushed(false)
+{
+	_strm->zalloc = Z_NULL;
+	_strm->zfree = Z_NULL;
+	_strm->opaque = Z_NULL;
+	deflateInit(_strm, Z_DEFAULT_COMPRESSION);
+}
+
+Deflater::~Deflater()
+{
+	deflateEnd(_strm);
+	delete _strm;
+}
+
+void Deflater::compress(const char *data, int len, QByteArray &out)
+{
+	_strm->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+	_strm->avail_in = len;
+	deflate(Z_NO_FLUSH, out);
+	_unflushed = true;
+}
+
+void Deflater::flush(QByteArray &out)
+{
+	_strm->next_in = Z_NULL;
+	_strm->avail_in = 0;
+	deflate(Z_SYNC_FLUSH, out);
+	_unflushed = false;
+}
+
+void Deflater::deflate(int flush, QByteArray &out)
+{
+	do {
+		const int oldsize = out.size();
+		out.resize(oldsize + CHUNK);
+		_strm->next_out = reinterpret_cast<Bytef*>(out.data() + oldsize);
+		_strm->avail_out = CHUNK;
+		::deflate(_strm, flush);
+		out.resize(oldsize + CHUNK - _strm->avail_out);
+	} while(_strm->avail_out == 0);
+}
+
+Inflater::Inflater()
+	: _strm(new z_stream), _inputpos(0)
+{
+	_strm->zalloc = Z_NULL;
+	_strm->zfree = Z_NULL;
+	_strm->opaque = Z_NULL;
+	_strm->next_in = Z_NULL;
+	_strm->avail_in = 0;
+	inflateInit(_strm);
+}
+
+Inflater::~Inflater()
+{
+	inflateEnd(_strm);
+	delete _strm;
+}
+
+void Inflater::feed(const char *data, int len)
+{
+	if(_inputpos == _input.length()) {
+		_input.clear();
+		_inputpos = 0;
+	}
+	_input.append(data, len);
+}
+
+int Inflater::decompress(char *out, int space)
+{
+	_strm->next_in = reinterpret_cast<Bytef*>(_input.data() + _inputpos);
+	_strm->avail_in = _input.length() - _inputpos;
+	_strm->next_out = reinterpret_cast<Bytef*>(out);
+	_strm->avail_out = space;
+
+	const int ret = ::inflate(_strm, Z_SYNC_FLUSH);
+
+	// Z_BUF_ERROR just means no progress was possible
+	if(ret != Z_OK && ret != Z_BUF_ERROR)
+		return -1;
+
+	_inputpos = _input.length() - _strm->avail_in;
+	return space - _strm->avail_out;
+}
+
+}
@@ -0,0 +1,104 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+#ifndef DP_NET_DEFLATE_H
+#define DP_NET_DEFLATE_H
+
+#include <QByteArray>
+
+struct z_stream_s;
+
+namespace protocol {
+
+/**
+ * \brief Streaming zlib compressor
+ *
+ * The compression state is kept between calls, so messages compress
+ * well against the ones sent before them.
+ */
+class Deflater {
+public:
+	Deflater();
+	~Deflater();
+	Deflater(const Deflater&) = delete;
+	Deflater &operator=(const Deflater&) = delete;
+
+	/**
+	 * @brief Compress data
+	 *
+	 * Some of the output may be held back until the next call or flush().
+	 * @param data data to compress
+	 * @param len length of the data
+	 * @param out compressed data is appended here
+	 */
+	void compress(const char *data, int len, QByteArray &out);
+
+	/**
+	 * @brief Output all the data compressed so far
+	 *
+	 * The receiver can decompress everything up to this point.
+	 * @param out compressed data is appended here
+	 */
+	void flush(QByteArray &out);
+
+	//! Is there data that hasn't been flushed yet
+	bool hasUnflushed() const { return _unflushed; }
+
+private:
+	void deflate(int flush, QByteArray &out);
+
+	z_stream_s *_strm;
+	bool _unflushed;
+};
+
+/**
+ * \brief Streaming zlib decompressor
+ */
+class Inflater {
+public:
+	Inflater();
+	~Inflater();
+	Inflater(const Inflater&) = delete;
+	Inflater &operator=(const Inflater&) = delete;
+
+	/**
+	 * @brief Add compressed data to the input buffer
+	 * @param data compressed data
+	 * @param len length of the data
+	 */
+	void feed(const char *data, int len);
+
+	/**
+	 * @brief Decompress as much of the input as fits in the output buffer
+	 * @param out output buffer
+	 * @param space length of the output buffer
+	 * @return number of bytes decompressed or -1 if the input is invalid
+	 */
+	int decompress(char *out, int space);
+
+private:
+	z_stream_s *_strm;
+	QByteArray _input;
+	int _inputpos;
+};
+
+}
+
+#endif
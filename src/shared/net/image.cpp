@@ -26,28 +26,30 @@ namespace protocol {
 
 PutImage *PutImage::deserialize(const uchar *data, uint len)
 {
-	if(len < 11)
+	if(len < 12)
 		return 0;
 
 	return new PutImage(
 		*data,
 		*(data+1),
-		qFromBigEndian<quint16>(data+2),
-		qFromBigEndian<quint16>(data+4),
-		qFromBigEndian<quint16>(data+6),
-		qFromBigEndian<quint16>(data+8),
-		QByteArray((const char*)data+10, len-10)
+		*(data+2),
+		qFromBigEndian<quint16>(data+3),
+		qFromBigEndian<quint16>(data+5),
+		qFromBigEndian<quint16>(data+7),
+		qFromBigEndian<quint16>(data+9),
+		QByteArray((const char*)data+11, len-11)
 	);
 }
 
 int PutImage::payloadLength() const
 {
-	return 1 + 1 + 4*2 + _image.size();
+	return 1 + 1 + 1 + 4*2 + _image.size();
 }
 
 int PutImage::serializePayload(uchar *data) const
 {
 	uchar *ptr = data;
+	*(ptr++) = _ctx;
 	*(ptr++) = _layer;
 	*(ptr++) = _flags;
 	qToBigEndian(_x, ptr); ptr += 2;
@@ -58,4 +60,43 @@ int PutImage::serializePayload(uchar *data) const
 	return ptr-data;
 }
 
+PutTile *PutTile::deserialize(const uchar *data, uint len)
+{
+	if(len < 11)
+		return 0;
+
+	const uint8_t ctx = *data;
+	const uint8_t layer = *(data+1);
+	const uint8_t flags = *(data+2);
+	const uint16_t col = qFromBigEndian<quint16>(data+3);
+	const uint16_t row = qFromBigEndian<quint16>(data+5);
+
+	if(len == 11)
+		return new PutTile(ctx, layer, flags, col, row, qFromBigEndian<quint32>(data+7));
+
+	return new PutTile(ctx, layer, flags, col, row, QByteArray((const char*)data+7, len-7));
+}
+
+int PutTile::payloadLength() const
+{
+	return 1 + 1 + 1 + 2*2 + (isSolid() ? 4 : _image.size());
+}
+
+int PutTile::serializePayload(uchar *data) const
+{
+	uchar *ptr = data;
+	*(ptr++) = _ctx;
+	*(ptr++) = _layer;
+	*(ptr++) = _flags;
+	qToBigEndian(_col, ptr); ptr += 2;
+	qToBigEndian(_row, ptr); ptr += 2;
+	if(isSolid()) {
+		qToBigEndian(_color, ptr); ptr += 4;
+	} else {
+		memcpy(ptr, _image.constData(), _image.length());
+		ptr += _image.length();
+	}
+	return ptr-data;
+}
+
 }
@@ -28,19 +28,50 @@
 
 namespace protocol {
 
+/**
+ * \brief Draw an image onto a layer
+ *
+ * The image is a compressed block of ARGB32 pixels. In delta mode, the
+ * pixels are XORed with the layer's current content in that area and the
+ * image data is prefixed with a 32 bit checksum of the content the delta
+ * was made against. Unchanged pixels become zero, so an image that mostly
+ * matches what is on the layer compresses to almost nothing. If the layer
+ * content doesn't match the checksum (someone drew there in the mean time),
+ * the command is ignored by everyone.
+ *
+ * In preview mode, the image is a downscaled version of the whole layer,
+ * sent in a snapshot before the full resolution tiles. Each tile of the
+ * layer is a (width/xtiles)^2 pixel block of the preview. The preview is only
+ * shown in place of tiles the layer doesn't have yet, so the full tiles that
+ * follow replace it.
+ *
+ * A large image is sent as several PutImage and PutTile commands. The last
+ * one has the end flag set, which ends the sender's undo group, so that
+ * all the pieces are undone together but consecutive images are not.
+ */
 class PutImage : public Message {
 public:
 	static const int MODE_BLEND = (1<<0);
-	static const int MAX_LEN = (1<<16) - 10;
+	static const int MODE_DELTA = (1<<1);
+	static const int MODE_PREVIEW = (1<<2);
+	static const int MODE_END = (1<<3);
+	static const int MAX_LEN = (1<<16) - 1 - 11;
 
-	PutImage(uint8_t layer, uint8_t flags, uint16_t x, uint16_t y, uint16_t w, uint16_t h, const QByteArray &image)
-	: Message(MSG_PUTIMAGE), _layer(layer), _flags(flags), _x(x), _y(y), _w(w), _h(h), _image(image)
+	//! Snapshots contain layer previews when the session's protocol minor version is at least this
+	static const int PREVIEW_MINOR_VERSION = 7;
+
+	PutImage(uint8_t ctx, uint8_t layer, uint8_t flags, uint16_t x, uint16_t y, uint16_t w, uint16_t h, const QByteArray &image)
+	: Message(MSG_PUTIMAGE), _ctx(ctx), _layer(layer), _flags(flags), _x(x), _y(y), _w(w), _h(h), _image(image)
 	{}
 
 	static PutImage *deserialize(const uchar *data, uint len);
 	
+	uint8_t contextId() const { return _ctx; }
+	void setOrigin(uint8_t userid) { _ctx = userid; }
+
 	uint8_t layer() const { return _layer; }
 	uint8_t flags() const { return _flags; }
+	void setFlags(uint8_t flags) { _flags = flags; }
 	uint16_t x() const { return _x; }
 	uint16_t y() const { return _y; }
 	uint16_t width() const { return _w; }
@@ -56,6 +87,7 @@ protected:
 	int serializePayload(uchar *data) const;
 	
 private:
+	uint8_t _ctx;
 	uint8_t _layer;
 	uint8_t _flags;
 	uint16_t _x;
@@ -65,6 +97,67 @@ private:
 	QByteArray _image;
 };
 
+/**
+ * \brief Replace or blend a single tile aligned 64x64 block of pixels
+ *
+ * The payload is either a 4 byte ARGB color, meaning the whole tile is filled
+ * with that color (zero is a blank tile), or the compressed pixel data of the tile.
+ * Tiles can be copied to and from the layer directly, without building
+ * an image first.
+ */
+class PutTile : public Message {
+public:
+	static const int MODE_BLEND = PutImage::MODE_BLEND;
+	static const int MODE_END = PutImage::MODE_END;
+
+	//! Construct a tile with compressed pixel data
+	PutTile(uint8_t ctx, uint8_t layer, uint8_t flags, uint16_t col, uint16_t row, const QByteArray &image)
+	: Message(MSG_PUTTILE), _ctx(ctx), _layer(layer), _flags(flags), _col(col), _row(row), _color(0), _image(image)
+	{ Q_ASSERT(image.length() > 4); }
+
+	//! Construct a solid color tile
+	PutTile(uint8_t ctx, uint8_t layer, uint8_t flags, uint16_t col, uint16_t row, uint32_t color)
+	: Message(MSG_PUTTILE), _ctx(ctx), _layer(layer), _flags(flags), _col(col), _row(row), _color(color)
+	{}
+
+	static PutTile *deserialize(const uchar *data, uint len);
+
+	uint8_t contextId() const { return _ctx; }
+	void setOrigin(uint8_t userid) { _ctx = userid; }
+
+	uint8_t layer() const { return _layer; }
+	uint8_t flags() const { return _flags; }
+	void setFlags(uint8_t flags) { _flags = flags; }
+
+	//! Get the tile column (X index)
+	uint16_t column() const { return _col; }
+
+	//! Get the tile row (Y index)
+	uint16_t row() const { return _row; }
+
+	//! Is this tile filled with a single color
+	bool isSolid() const { return _image.isEmpty(); }
+
+	//! Get the fill color of a solid tile
+	uint32_t color() const { return _color; }
+
+	//! Get the compressed pixel data
+	const QByteArray &image() const { return _image; }
+
+protected:
+	int payloadLength() const;
+	int serializePayload(uchar *data) const;
+
+private:
+	uint8_t _ctx;
+	uint8_t _layer;
+	uint8_t _flags;
+	uint16_t _col;
+	uint16_t _row;
+	uint32_t _color;
+	QByteArray _image;
+};
+
 }
 
 #endif
@@ -26,17 +26,19 @@ namespace protocol {
 
 CanvasResize *CanvasResize::deserialize(const uchar *data, uint len)
 {
-	if(len!=4)
+	if(len!=4 && len!=8)
 		return 0;
 	return new CanvasResize(
 		qFromBigEndian<quint16>(data),
-		qFromBigEndian<quint16>(data+2)
+		qFromBigEndian<quint16>(data+2),
+		len==8 ? qFromBigEndian<qint16>(data+4) : 0,
+		len==8 ? qFromBigEndian<qint16>(data+6) : 0
 	);
 }
 
 int CanvasResize::payloadLength() const
 {
-	return 4;
+	return (_xoffset || _yoffset) ? 8 : 4;
 }
 
 int CanvasResize::serializePayload(uchar *data) const
@@ -44,6 +46,10 @@ int CanvasResize::serializePayload(uchar *data) const
 	uchar *ptr = data;
 	qToBigEndian(_width, ptr); ptr += 2;
 	qToBigEndian(_height, ptr); ptr += 2;
+	if(_xoffset || _yoffset) {
+		qToBigEndian(_xoffset, ptr); ptr += 2;
+		qToBigEndian(_yoffset, ptr); ptr += 2;
+	}
 	return ptr - data;
 }
 
@@ -76,26 +82,57 @@ int LayerCreate::serializePayload(uchar *data) const
 	return ptr - data;
 }
 
+LayerDuplicate *LayerDuplicate::deserialize(const uchar *data, uint len)
+{
+	if(len<3)
+		return 0;
+
+	return new LayerDuplicate(
+		*data,
+		*(data+1),
+		*(data+2),
+		QString::fromUtf8((const char*)data+3, len-3)
+	);
+}
+
+int LayerDuplicate::payloadLength() const
+{
+	return 3 + _title.length();
+}
+
+int LayerDuplicate::serializePayload(uchar *data) const
+{
+	uchar *ptr = data;
+	*(ptr++) = _ctxid;
+	*(ptr++) = _id;
+	*(ptr++) = _source;
+	memcpy(ptr, _title.constData(), _title.length());
+	ptr += _title.length();
+	return ptr - data;
+}
+
 LayerAttributes *LayerAttributes::deserialize(const uchar *data, uint len)
 {
-	if(len!=3)
+	if(len!=4)
 		return 0;
 	return new LayerAttributes(
 		*data,
 		*(data+1),
-		*(data+2)
+		*(data+2),
+		*(data+3)
 	);
 }
 
 int LayerAttributes::payloadLength() const
 {
-	return 3;
+	return 4;
 }
 
 
 int LayerAttributes::serializePayload(uchar *data) const
 {
 	uchar *ptr=data;
+	*(ptr++) = _ctxid;
 	*(ptr++) = _id;
 	*(ptr++) = _opacity;
 	*(ptr++) = _blend;
@@ -103,49 +140,52 @@ int LayerAttributes::serializePayload(uchar *data) const
 }
 LayerRetitle *LayerRetitle::deserialize(const uchar *data, uint len)
 {
-	if(len<1)
+	if(len<2)
 		return 0;
 	return new LayerRetitle(
 		*data,
-		QByteArray((const char*)data+1,len-1)
+		*(data+1),
+		QByteArray((const char*)data+2,len-2)
 	);
 }
 
 int LayerRetitle::payloadLength() const
 {
-	return 1+_title.length();
+	return 2+_title.length();
 }
 
 
 int LayerRetitle::serializePayload(uchar *data) const
 {
-	*data = _id;
-	memcpy(data+1, _title.constData(), _title.length());
-	return 1+_title.length();
+	*data = _ctxid;
+	*(data+1) = _id;
+	memcpy(data+2, _title.constData(), _title.length());
+	return 2+_title.length();
 }
 
 LayerOrder *LayerOrder::deserialize(const uchar *data, uint len)
 {
-	if(len==0 || len>255)
+	if(len<2 || len>256)
 		return 0;
 
 	QList<uint8_t> order;
-	order.reserve(len);
-	for(uint i=0;i<len;++i)
+	order.reserve(len-1);
+	for(uint i=1;i<len;++i)
 		order.append(data[i]);
 
-	return new LayerOrder(order);
+	return new LayerOrder(data[0], order);
 }
 
 int LayerOrder::payloadLength() const
 {
-	return _order.size();
+	return 1 + _order.size();
 }
 
 int LayerOrder::serializePayload(uchar *data) const
 {
 	Q_ASSERT(_order.length()<256);
 	uchar *ptr = data;
+	*(ptr++) = _ctxid;
 	foreach(uint8_t l, _order)
 		*(ptr++) = l;
 	return ptr - data;
@@ -153,19 +193,20 @@ int LayerOrder::serializePayload(uchar *data) const
 
 LayerDelete *LayerDelete::deserialize(const uchar *data, uint len)
 {
-	if(len != 2)
+	if(len != 3)
 		return 0;
-	return new LayerDelete(data[0], data[1]);
+	return new LayerDelete(data[0], data[1], data[2]);
 }
 
 int LayerDelete::payloadLength() const
 {
-	return 2;
+	return 3;
 }
 
 int LayerDelete::serializePayload(uchar *data) const
 {
 	uchar *ptr = data;
+	*(ptr++) = _ctxid;
 	*(ptr++) = _id;
 	*(ptr++) = _merge;
 	return ptr - data;
@@ -36,15 +36,24 @@ namespace protocol {
  */
 class CanvasResize : public Message {
 public:
-	CanvasResize(uint16_t width, uint16_t height)
-		: Message(MSG_CANVAS_RESIZE), _width(width), _height(height)
+	CanvasResize(uint16_t width, uint16_t height, int16_t xoffset=0, int16_t yoffset=0)
+		: Message(MSG_CANVAS_RESIZE), _width(width), _height(height), _xoffset(xoffset), _yoffset(yoffset)
 		{}
 
 	static CanvasResize *deserialize(const uchar *data, uint len);
 
 	uint16_t width() const { return _width; }
 	uint16_t height() const { return _height; }
-		
+
+	/**
+	 * @brief Position of the old content in the resized canvas
+	 *
+	 * The offset is only included in the message when it is nonzero,
+	 * so a plain resize is compatible with older clients.
+	 */
+	int16_t xOffset() const { return _xoffset; }
+	int16_t yOffset() const { return _yoffset; }
+
 protected:
 	int payloadLength() const;
 	int serializePayload(uchar *data) const;
@@ -52,6 +61,8 @@ protected:
 private:
 	uint16_t _width;
 	uint16_t _height;
+	int16_t _xoffset;
+	int16_t _yoffset;
 };
 
 /**
@@ -120,18 +131,67 @@ private:
 	QByteArray _title;
 };
 
+/**
+ * \brief Layer duplication command
+ *
+ * Creates a copy of an existing layer on top of the stack. The copy
+ * is made locally by each client, so only the source layer ID travels
+ * over the network.
+ */
+class LayerDuplicate : public Message {
+public:
+	LayerDuplicate(uint8_t ctxid, uint8_t id, uint8_t source, const QString &title)
+		: Message(MSG_LAYER_DUPLICATE), _ctxid(ctxid), _id(id), _source(source), _title(title.toUtf8())
+		{}
+
+	static LayerDuplicate *deserialize(const uchar *data, uint len);
+
+	uint8_t contextId() const { return _ctxid; }
+	void setOrigin(uint8_t userid) { _ctxid = userid; }
+
+	/**
+	 * \brief ID of the new layer
+	 *
+	 * Like with LayerCreate, this should be zero when sent by the client.
+	 * The server assigns the ID.
+	 * @return layer ID number
+	 */
+	uint8_t id() const { return _id; }
+
+	void setId(uint8_t id) { _id = id; }
+
+	//! ID of the layer to copy
+	uint8_t source() const { return _source; }
+
+	//! Title of the new layer
+	QString title() const { return QString::fromUtf8(_title); }
+
+protected:
+	int payloadLength() const;
+	int serializePayload(uchar *data) const;
+
+private:
+	uint8_t _ctxid;
+	uint8_t _id;
+	uint8_t _source;
+	QByteArray _title;
+};
+
 /**
  * \brief Layer attribute change command
  */
 class LayerAttributes : public Message {
 public:
-	LayerAttributes(uint8_t id, uint8_t opacity, uint8_t blend)
-		: Message(MSG_LAYER_ATTR), _id(id),
+	LayerAttributes(uint8_t ctxid, uint8_t id, uint8_t opacity, uint8_t blend)
+		: Message(MSG_LAYER_ATTR), _ctxid(ctxid), _id(id),
 		_opacity(opacity), _blend(blend)
 		{}
 
 	static LayerAttributes *deserialize(const uchar *data, uint len);
 
+	uint8_t contextId() const { return _ctxid; }
+	void setOrigin(uint8_t userid) { _ctxid = userid; }
+
 	uint8_t id() const { return _id; }
 	uint8_t opacity() const { return _opacity; }
 	uint8_t blend() const { return _blend; }
@@ -141,6 +201,7 @@ protected:
 	int serializePayload(uchar *data) const;
 
 private:
+	uint8_t _ctxid;
 	uint8_t _id;
 	uint8_t _opacity;
 	uint8_t _blend;
@@ -151,15 +212,18 @@ private:
  */
 class LayerRetitle : public Message {
 public:
-	LayerRetitle(uint8_t id, const QByteArray &title)
-		: Message(MSG_LAYER_RETITLE), _id(id), _title(title)
+	LayerRetitle(uint8_t ctxid, uint8_t id, const QByteArray &title)
+		: Message(MSG_LAYER_RETITLE), _ctxid(ctxid), _id(id), _title(title)
 		{}
-	LayerRetitle(uint8_t id, const QString &title)
-		: LayerRetitle(id, title.toUtf8())
+	LayerRetitle(uint8_t ctxid, uint8_t id, const QString &title)
+		: LayerRetitle(ctxid, id, title.toUtf8())
 		{}
 
 	static LayerRetitle *deserialize(const uchar *data, uint len);
 
+	uint8_t contextId() const { return _ctxid; }
+	void setOrigin(uint8_t userid) { _ctxid = userid; }
+
 	uint8_t id() const { return _id; }
 	QString title() const { return QString::fromUtf8(_title); }
 
@@ -168,6 +232,7 @@ protected:
 	int serializePayload(uchar *data) const;
 
 private:
+	uint8_t _ctxid;
 	uint8_t _id;
 	QByteArray _title;
 };
@@ -177,13 +242,17 @@ private:
  */
 class LayerOrder : public Message {
 public:
-	LayerOrder(const QList<uint8_t> &order)
+	LayerOrder(uint8_t ctxid, const QList<uint8_t> &order)
 		: Message(MSG_LAYER_ORDER),
+		_ctxid(ctxid),
 		_order(order)
 		{}
 	
 	static LayerOrder *deserialize(const uchar *data, uint len);
 
+	uint8_t contextId() const { return _ctxid; }
+	void setOrigin(uint8_t userid) { _ctxid = userid; }
+
 	const QList<uint8_t> &order() const { return _order; }
 	void setOrder(const QList<uint8_t> order) { _order = order; }
 
@@ -192,6 +261,7 @@ protected:
 	int serializePayload(uchar *data) const;
 
 private:
+	uint8_t _ctxid;
 	QList<uint8_t> _order;
 };
 
@@ -200,8 +270,9 @@ private:
  */
 class LayerDelete : public Message {
 public:
-	LayerDelete(uint8_t id, uint8_t merge)
+	LayerDelete(uint8_t ctxid, uint8_t id, uint8_t merge)
 		: Message(MSG_LAYER_DELETE),
+		_ctxid(ctxid),
 		_id(id),
 		_merge(merge)
 		{}
@@ -210,6 +281,9 @@ public:
 	
 	bool isOpCommand() const { return true; }
 
+	uint8_t contextId() const { return _ctxid; }
+	void setOrigin(uint8_t userid) { _ctxid = userid; }
+
 	uint8_t id() const { return _id; }
 	uint8_t merge() const { return _merge; }
 	
@@ -218,6 +292,7 @@ protected:
 	int serializePayload(uchar *data) const;
 
 private:
+	uint8_t _ctxid;
 	uint8_t _id;
 	uint8_t _merge;
 };
@@ -23,6 +23,8 @@
 
 namespace protocol {
 
+const char *Login::COMPRESSION_MARKER = "DEFLATE";
+
 Login *Login::deserialize(const uchar *data, uint len)
 {
 	return new Login(QByteArray((const char*)data, len));
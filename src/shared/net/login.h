@@ -36,6 +36,17 @@ public:
 
 	QString message() const { return QString::fromUtf8(_msg); }
 
+	/**
+	 * @brief Is this the stream compression marker
+	 *
+	 * Everything sent after the marker is compressed.
+	 * See MessageQueue::startCompression()
+	 */
+	bool isCompressionMarker() const { return _msg == COMPRESSION_MARKER; }
+
+	//! The content of the compression marker message
+	static const char *COMPRESSION_MARKER;
+
 protected:
     int payloadLength() const;
 	int serializePayload(uchar *data) const;
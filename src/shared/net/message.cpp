@@ -10,6 +10,7 @@
 #include "meta.h"
 #include "pen.h"
 #include "snapshot.h"
+#include "undo.h"
 
 namespace protocol {
 
@@ -31,6 +32,63 @@ int Message::serialize(char *data) const
 	return 3+written;
 }
 
+Message::~Message()
+{
+	delete _wirecache[0].load();
+	delete _wirecache[1].load();
+}
+
+QByteArray Message::wireBytes(bool compactPenMove) const
+{
+	Q_ASSERT(_wireholders.load() != 0);
+	const bool compact = compactPenMove && _type == MSG_PEN_MOVE;
+
+	// The cache is being dropped: build the bytes without touching it
+	const bool dropping = _wireholders.loadAcquire() < 0;
+
+	if(!dropping) {
+		const QByteArray *cached = _wirecache[compact].loadAcquire();
+		if(cached)
+			return *cached;
+	}
+
+	QByteArray bytes;
+	if(compact) {
+		const PenMove *pm = static_cast<const PenMove*>(this);
+		bytes.resize(pm->compactLength());
+		pm->serializeCompact(bytes.data());
+	} else {
+		bytes.resize(length());
+		serialize(bytes.data());
+	}
+
+	// If another thread got there first, its copy is just as good
+	if(!dropping) {
+		QByteArray *cache = new QByteArray(bytes);
+		if(!_wirecache[compact].testAndSetOrdered(0, cache))
+			delete cache;
+	}
+	return bytes;
+}
+
+void Message::holdWireBytes() const
+{
+	// If the cache is being dropped right now, the count stays negative
+	// until it's done and wireBytes() builds the bytes without caching them.
+	_wireholders.ref();
+}
+
+void Message::releaseWireBytes() const
+{
+	// The cache can't be in use when no-one holds it. Holds taken while
+	// dropping it are added back to the count once it's gone.
+	if(!_wireholders.deref() && _wireholders.testAndSetOrdered(0, WIRECACHE_DROPPING)) {
+		delete _wirecache[0].fetchAndStoreOrdered(0);
+		delete _wirecache[1].fetchAndStoreOrdered(0);
+		_wireholders.fetchAndAddOrdered(-WIRECACHE_DROPPING);
+	}
+}
+
 Message *Message::deserialize(const uchar *data)
 {
 	quint16 len = qFromBigEndian<quint16>(data);
@@ -42,6 +100,7 @@ Message *Message::deserialize(const uchar *data)
 	case MSG_LOGIN: return Login::deserialize(data, len);
 	case MSG_CANVAS_RESIZE: return CanvasResize::deserialize(data, len);
 	case MSG_LAYER_CREATE: return LayerCreate::deserialize(data, len);
+	case MSG_LAYER_DUPLICATE: return LayerDuplicate::deserialize(data, len);
 	case MSG_LAYER_ATTR: return LayerAttributes::deserialize(data, len);
 	case MSG_LAYER_RETITLE: return LayerRetitle::deserialize(data, len);
 	case MSG_LAYER_ORDER: return LayerOrder::deserialize(data, len);
@@ -54,8 +113,9 @@ Message *Message::deserialize(const uchar *data)
 	case MSG_ANNOTATION_RESHAPE: return AnnotationReshape::deserialize(data, len);
 	case MSG_ANNOTATION_EDIT: return AnnotationEdit::deserialize(data, len);
 	case MSG_ANNOTATION_DELETE: return AnnotationDelete::deserialize(data, len);
-	case MSG_UNDO: return 0;
-	case MSG_REDO: return 0;
+	case MSG_UNDO: return Undo::deserialize(data, len);
+	case MSG_REDO: return Redo::deserialize(data, len);
+	case MSG_UNDO_HORIZON: return UndoHorizon::deserialize(data, len);
 	case MSG_USER_JOIN: return UserJoin::deserialize(data, len);
 	case MSG_USER_ATTR: return UserAttr::deserialize(data, len);
 	case MSG_USER_LEAVE: return UserLeave::deserialize(data, len);
@@ -65,6 +125,7 @@ Message *Message::deserialize(const uchar *data)
 	case MSG_SESSION_TITLE: return SessionTitle::deserialize(data, len);
 	case MSG_SESSION_CONFIG: return SessionConf::deserialize(data, len);
 	case MSG_STREAMPOS: return StreamPos::deserialize(data, len);
+	case MSG_PUTTILE: return PutTile::deserialize(data, len);
 	}
 	// Unknown message type!
 	return 0;
@@ -22,6 +22,9 @@
 #define DP_NET_MESSAGE_H
 
 #include <Qt>
+#include <QByteArray>
+#include <QAtomicInt>
+#include <QAtomicPointer>
 
 namespace protocol {
 
@@ -57,14 +60,18 @@ enum MessageType {
 	MSG_SNAPSHOT,
 	MSG_SESSION_TITLE,
 	MSG_SESSION_CONFIG,
-	MSG_STREAMPOS
+	MSG_STREAMPOS,
+	// Command stream (added after the original command range)
+	MSG_PUTTILE,
+	MSG_LAYER_DUPLICATE,
+	MSG_UNDO_HORIZON
 };
 
 class Message {
 	friend class MessagePtr;
 public:
-	Message(MessageType type): _type(type), _refcount(0) {}
-	virtual ~Message() = default;
+	Message(MessageType type): _type(type), _refcount(0), _wireholders(0) {}
+	virtual ~Message();
 	
 	/**
 	 * @brief Get the type of this message.
@@ -79,7 +86,7 @@ public:
 	 * The canvas can be reconstructed exactly using only command messages.
 	 * @return true if this is a drawing command
 	 */
-	bool isCommand() const { return _type >= MSG_CANVAS_RESIZE && _type <= MSG_REDO; }
+	bool isCommand() const { return (_type >= MSG_CANVAS_RESIZE && _type <= MSG_REDO) || _type >= MSG_PUTTILE; }
 
 	/**
 	 * @brief Get the message length, header included
@@ -111,6 +118,38 @@ public:
 	 */
 	int serialize(char *data) const;
 
+	/**
+	 * @brief Get the serialized form of this message
+	 *
+	 * The message is serialized the first time this is called and the
+	 * result is cached until the last hold is released, so a message sent
+	 * to many recipients at once is encoded only once per encoding.
+	 * The caller must hold the message (see holdWireBytes()) and the message
+	 * must not be modified after this has been called. This function is thread safe
+	 * and never blocks: if two threads race to build the cache, both build it and
+	 * one of the copies is discarded.
+	 *
+	 * @param compactPenMove use the compact encoding if this is a pen move
+	 * @return message bytes, header included
+	 */
+	QByteArray wireBytes(bool compactPenMove=false) const;
+
+	/**
+	 * @brief Keep the serialized form cached until released
+	 *
+	 * A message is held while it is queued for sending. This function is thread safe.
+	 */
+	void holdWireBytes() const;
+
+	/**
+	 * @brief Release a hold on the serialized form
+	 *
+	 * The cache is dropped when the last hold is released, so messages kept
+	 * in the session history don't keep a second copy of themselves.
+	 * This function is thread safe.
+	 */
+	void releaseWireBytes() const;
+
 	/**
 	 * @brief get the length of the message from the given data
 	 *
@@ -148,7 +187,16 @@ protected:
 private:
 	const MessageType _type;
 
-	int _refcount;
+	QAtomicInt _refcount;
+
+	// Holder count offset while the cache is being dropped
+	static const int WIRECACHE_DROPPING = -0x40000000;
+
+	// Cached serialized forms (classic and compact encodings)
+	mutable QAtomicPointer<QByteArray> _wirecache[2];
+
+	// Number of holds on the cache (negative while the cache is being dropped)
+	mutable QAtomicInt _wireholders;
 };
 
 /**
@@ -157,46 +205,57 @@ private:
 * This object is the length of a normal pointer so it can be used
 * efficiently with QList.
 *
-* @todo use QAtomicInt if thread safety is needed
+* The reference count is atomic, so messages can be shared between threads.
 */
 class MessagePtr {
 public:
+	//! Construct a null pointer
+	MessagePtr() : _ptr(0) { }
+
 	/**
 	 * @brief Take ownership of the given raw Message pointer.
 	 *
 	 * The message will be deleted when reference count falls to zero.
-	 * Null pointers are not allowed.
+	 * Null pointers are not allowed. Use the default constructor instead.
 	 * @param msg
 	 */
 	explicit MessagePtr(Message *msg)
 		: _ptr(msg)
 	{
 		Q_ASSERT(_ptr);
-		Q_ASSERT(_ptr->_refcount==0);
-		++_ptr->_refcount;
+		Q_ASSERT(_ptr->_refcount.load()==0);
+		_ptr->_refcount.ref();
 	}
 
-	MessagePtr(const MessagePtr &ptr) : _ptr(ptr._ptr) { ++_ptr->_refcount; }
+	MessagePtr(const MessagePtr &ptr) : _ptr(ptr._ptr) { if(_ptr) _ptr->_refcount.ref(); }
 
 	~MessagePtr()
 	{
-		Q_ASSERT(_ptr->_refcount>0);
-		if(--_ptr->_refcount == 0)
-			delete _ptr;
+		if(_ptr) {
+			Q_ASSERT(_ptr->_refcount.load()>0);
+			if(!_ptr->_refcount.deref())
+				delete _ptr;
+		}
 	}
 
 	MessagePtr &operator=(const MessagePtr &msg)
 	{
 		if(msg._ptr != _ptr) {
-			Q_ASSERT(_ptr->_refcount>0);
-			if(--_ptr->_refcount == 0)
-				delete _ptr;
+			if(msg._ptr)
+				msg._ptr->_refcount.ref();
+			if(_ptr) {
+				Q_ASSERT(_ptr->_refcount.load()>0);
+				if(!_ptr->_refcount.deref())
+					delete _ptr;
+			}
 			_ptr = msg._ptr;
-			++_ptr->_refcount;
 		}
 		return *this;
 	}
 
+	//! Is this a null pointer?
+	bool isNull() const { return _ptr == 0; }
+
 	Message &operator*() const { return *_ptr; }
 	Message *operator ->() const { return _ptr; }
 
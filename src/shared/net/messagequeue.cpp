@@ -21,11 +21,18 @@
 
 #include <QDebug>
 #include <QIODevice>
+#include <QAbstractSocket>
+#include <QThread>
+#include <QTimer>
+#include <QElapsedTimer>
 #include <cstring>
 
 #include "messagequeue.h"
+#include "deflate.h"
 #include "snapshot.h"
 #include "meta.h" /* for STREAMPOS */
+#include "pen.h"
+#include "login.h"
 
 namespace protocol {
 
@@ -33,71 +40,158 @@ namespace protocol {
 static const int MAX_BUF_LEN = 1024*64 + 3 + 4;
 
 MessageQueue::MessageQueue(QIODevice *socket, QObject *parent)
-	: QObject(parent), _socket(socket), _closeWhenReady(false), _expectingSnapshot(false)
+	: QObject(parent), _socket(socket), _mutex(QMutex::Recursive),
+	  _closeWhenReady(false), _expectingSnapshot(false), _compactPenMove(0), _writeScheduled(false),
+	  _deflater(0), _inflater(0)
 {
 	connect(socket, SIGNAL(readyRead()), this, SLOT(readData()));
-	connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(writeData()));
+	connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(deviceBytesWritten(qint64)));
+	if(qobject_cast<QAbstractSocket*>(socket))
+		connect(socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(handleSocketError()));
 
 	_recvbuffer = new char[MAX_BUF_LEN];
 	_sendbuffer = new char[MAX_BUF_LEN];
 	_recvcount = 0;
 	_sentcount = 0;
 	_sendbuflen = 0;
+	_sendqueuebytes = 0;
+	_devicebuffered = 0;
+
+	_flushTimer = new QTimer(this);
+	_flushTimer->setSingleShot(true);
+	_flushTimer->setInterval(COMPRESSION_FLUSH_INTERVAL);
+	connect(_flushTimer, SIGNAL(timeout()), this, SLOT(flushCompression()));
 }
 
 MessageQueue::~MessageQueue()
 {
+	foreach(const MessagePtr &msg, _sendqueue)
+		msg->releaseWireBytes();
+	foreach(const MessagePtr &msg, _snapshot_send)
+		msg->releaseWireBytes();
+
 	delete [] _recvbuffer;
 	delete [] _sendbuffer;
+	delete _deflater;
+	delete _inflater;
 }
 
 bool MessageQueue::isPending() const
 {
+	QMutexLocker lock(&_mutex);
 	return !_recvqueue.isEmpty();
 }
 
 MessagePtr MessageQueue::getPending()
 {
+	QMutexLocker lock(&_mutex);
 	return _recvqueue.dequeue();
 }
 
+int MessageQueue::pendingCount() const
+{
+	QMutexLocker lock(&_mutex);
+	return _recvqueue.size();
+}
+
 bool MessageQueue::isPendingSnapshot() const
 {
+	QMutexLocker lock(&_mutex);
 	return !_snapshot_recv.isEmpty();
 }
 
 MessagePtr MessageQueue::getPendingSnapshot()
 {
+	QMutexLocker lock(&_mutex);
 	return _snapshot_recv.dequeue();
 }
 
 void MessageQueue::send(MessagePtr packet)
 {
+	QMutexLocker lock(&_mutex);
 	if(!_closeWhenReady) {
+		packet->holdWireBytes();
 		_sendqueue.enqueue(packet);
-		if(_sentcount==0)
-			writeData();
+		_sendqueuebytes += messageLength(packet);
+		scheduleWrite();
 	}
 }
 
-void MessageQueue::sendSnapshot(const QList<MessagePtr> &snapshot)
+void MessageQueue::sendSnapshot(const QList<MessagePtr> &snapshot, bool complete)
 {
+	QMutexLocker lock(&_mutex);
 	if(!_closeWhenReady) {
-		_snapshot_send = snapshot;
-		_snapshot_send.append(MessagePtr(new SnapshotMode(SnapshotMode::END)));
+		foreach(const MessagePtr &msg, snapshot)
+			msg->holdWireBytes();
+		_snapshot_send.append(snapshot);
+		if(complete) {
+			const MessagePtr end(new SnapshotMode(SnapshotMode::END));
+			end->holdWireBytes();
+			_snapshot_send.append(end);
+		}
+		scheduleWrite();
+	}
+}
 
-		if(_sentcount==0)
-			writeData();
+void MessageQueue::abortSnapshot()
+{
+	QMutexLocker lock(&_mutex);
+	foreach(const MessagePtr &msg, _snapshot_send)
+		msg->releaseWireBytes();
+	_snapshot_send.clear();
+}
+
+/**
+ * Writing is deferred to the event loop (of the thread the queue lives in),
+ * so that all the messages enqueued in the meantime are written in a single batch.
+ */
+void MessageQueue::scheduleWrite()
+{
+	if(_sentcount==0 && !_writeScheduled) {
+		_writeScheduled = true;
+		QMetaObject::invokeMethod(this, "writeData", Qt::QueuedConnection);
 	}
 }
 
+void MessageQueue::setCompactPenMove(bool compact)
+{
+	_compactPenMove.storeRelease(compact);
+}
+
+WriteStats MessageQueue::writeStats() const
+{
+	QMutexLocker lock(&_mutex);
+	return _writestats;
+}
+
+/**
+ * The compressor is created when the marker is put in the send buffer,
+ * so the marker itself and the messages before it are not compressed.
+ */
+void MessageQueue::startCompression()
+{
+	send(MessagePtr(new Login(QByteArray(Login::COMPRESSION_MARKER))));
+}
+
+bool MessageQueue::isCompressing() const
+{
+	QMutexLocker lock(&_mutex);
+	return _deflater != 0;
+}
+
+CompressionStats MessageQueue::compressionStats() const
+{
+	QMutexLocker lock(&_mutex);
+	return _compressionstats;
+}
+
 int MessageQueue::uploadQueueBytes() const
 {
-	int total = _sendbuflen - _sentcount;
-	foreach(const MessagePtr msg, _sendqueue)
-		total += msg->length();
+	QMutexLocker lock(&_mutex);
+	const int buffered = _zsendbuffer.isEmpty() ? _sendbuflen : _zsendbuffer.length();
+	int total = buffered - _sentcount + _sendqueuebytes + _devicebuffered;
 	foreach(const MessagePtr msg, _snapshot_send)
-		total += msg->length();
+		total += messageLength(msg);
 	return total;
 }
 
@@ -106,28 +200,55 @@ void MessageQueue::readData() {
 	int read, totalread=0;
 	do {
 		// Read available data
-		read = _socket->read(_recvbuffer+_recvcount, MAX_BUF_LEN-_recvcount);
-		if(read<0) {
+		read = readSocket(_recvbuffer+_recvcount, MAX_BUF_LEN-_recvcount);
+		if(read == INVALID_COMPRESSED_DATA) {
+			// The socket itself is fine, so its error string would say nothing useful
+			emit socketError(QString("Invalid compressed data"));
+			return;
+		} else if(read<0) {
 			// Error!
 			emit socketError(_socket->errorString());
 			return;
 		}
 		_recvcount += read;
 
-		// Extract all complete messages
-		int len;
-		while(2 < _recvcount && (len=Message::sniffLength(_recvbuffer)) <= _recvcount) {
+		// Extract all complete messages. The messages are parsed in place
+		// and the remaining partial message (if any) is moved to the
+		// beginning of the buffer once all complete ones have been handled.
+		int pos = 0, len;
+		while(2 < _recvcount-pos && (len=Message::sniffLength(_recvbuffer+pos)) <= _recvcount-pos) {
 			// Whole message received!
-			Message *msg = Message::deserialize((const uchar*)_recvbuffer);
+			const char *msgdata = _recvbuffer + pos;
+			pos += len;
+
+			Message *msg;
+			if(_compactPenMove.loadAcquire() && msgdata[2] == MSG_PEN_MOVE)
+				msg = PenMove::deserializeCompact((const uchar*)msgdata+3, len-3);
+			else
+				msg = Message::deserialize((const uchar*)msgdata);
 			if(!msg) {
-				emit badData(len, _recvbuffer[2]);
+				emit badData(len, msgdata[2]);
 			} else {
+				if(!_inflater && msg->type() == MSG_LOGIN && static_cast<Login*>(msg)->isCompressionMarker()) {
+					// The rest of the stream is compressed. The marker itself
+					// is passed on, so the receiver knows compression was turned on.
+					_inflater = new Inflater;
+					_inflater->feed(_recvbuffer + pos, _recvcount - pos);
+					_compressionstats.compressedReceived += _recvcount - pos;
+					_recvcount = pos;
+				}
+
 				if(msg->type() == MSG_STREAMPOS) {
 					// Special handling for Stream Position message
+					// The message is also passed on in order, so the receiver
+					// can tell exactly where the announced stream begins.
 					emit expectingBytes(static_cast<StreamPos*>(msg)->bytes() + totalread);
-					delete msg;
+					QMutexLocker lock(&_mutex);
+					_recvqueue.enqueue(MessagePtr(msg));
+					gotmessage = true;
 				} else if(_expectingSnapshot) {
 					// A message preceded by SnapshotMode::SNAPSHOT goes into the snapshot queue
+					QMutexLocker lock(&_mutex);
 					_snapshot_recv.enqueue(MessagePtr(msg));
 					_expectingSnapshot = false;
 					gotsnapshot = true;
@@ -136,15 +257,18 @@ void MessageQueue::readData() {
 						delete msg;
 						_expectingSnapshot = true;
 					} else {
+						QMutexLocker lock(&_mutex);
 						_recvqueue.enqueue(MessagePtr(msg));
 						gotmessage = true;
 					}
 				}
 			}
-			if(len < _recvcount) {
-				memmove(_recvbuffer, _recvbuffer+len, _recvcount-len);
-			}
-			_recvcount -= len;
+		}
+
+		if(pos > 0) {
+			if(pos < _recvcount)
+				memmove(_recvbuffer, _recvbuffer+pos, _recvcount-pos);
+			_recvcount -= pos;
 		}
 		totalread += read;
 	} while(read>0);
@@ -157,49 +281,246 @@ void MessageQueue::readData() {
 		emit snapshotAvailable();
 }
 
-void MessageQueue::writeData() {
-	if(_sendbuflen==0) {
-		// If send buffer is empty, serialize the next message in the queue
+/**
+ * Read data from the socket, decompressing it if compression is on.
+ * @param data buffer to read into
+ * @param len length of the buffer
+ * @return number of bytes read, -1 on a socket error or INVALID_COMPRESSED_DATA
+ */
+int MessageQueue::readSocket(char *data, int len)
+{
+	if(!_inflater)
+		return _socket->read(data, len);
+
+	char buf[1024*16];
+	QElapsedTimer timer;
+	forever {
+		timer.start();
+		const int out = _inflater->decompress(data, len);
+		_compressionstats.inflateNsecs += timer.nsecsElapsed();
 
-		if(_sendqueue.isEmpty() && _snapshot_send.isEmpty()) {
-			emit allSent();
+		if(out < 0) {
+			qWarning() << "Received invalid compressed data";
+			return INVALID_COMPRESSED_DATA;
+		} else if(out > 0) {
+			_compressionstats.rawReceived += out;
+			return out;
+		}
+
+		// Decompressor needs more input
+		const int read = _socket->read(buf, sizeof buf);
+		if(read <= 0)
+			return read;
+		_compressionstats.compressedReceived += read;
+		_inflater->feed(buf, read);
+	}
+}
+
+/**
+ * Serialize as many queued messages as fit into the send buffer.
+ *
+ * Messages from the normal queue go first. Snapshot messages (each preceded
+ * by a SnapshotMode::SNAPSHOT marker) fill the rest of the buffer once the
+ * normal queue is empty.
+ */
+void MessageQueue::fillSendBuffer()
+{
+	Q_ASSERT(_sendbuflen == 0);
+
+	int count = 0;
+	while(!_sendqueue.isEmpty() && _sendbuflen + messageLength(_sendqueue.first()) <= MAX_BUF_LEN) {
+		const MessagePtr msg = _sendqueue.dequeue();
+		const int len = serializeMessage(msg, _sendbuffer + _sendbuflen);
+		_sendbuflen += len;
+		_sendqueuebytes -= len;
+		++count;
+
+		if(!_deflater && msg->type() == MSG_LOGIN && msg.cast<Login>().isCompressionMarker()) {
+			// The batches after this one are compressed
+			_deflater = new Deflater;
+			++_writestats.batches;
+			_writestats.messages += count;
 			return;
 		}
+	}
 
-		if(_sendqueue.isEmpty()) {
-			// If there is nothing in the normal send queue, there should
-			// there should be something in the lower priority snapshot queue
-			SnapshotMode mode(SnapshotMode::SNAPSHOT);
-			_sendbuflen = mode.serialize(_sendbuffer);
-			_sendbuflen += _snapshot_send.takeFirst()->serialize(_sendbuffer + _sendbuflen);
-		} else {
-			// There are messages in the higher priority queue, send one
-			_sendbuflen = _sendqueue.dequeue()->serialize(_sendbuffer);
+	if(_sendqueue.isEmpty()) {
+		const SnapshotMode mode(SnapshotMode::SNAPSHOT);
+		while(!_snapshot_send.isEmpty() && _sendbuflen + mode.length() + messageLength(_snapshot_send.first()) <= MAX_BUF_LEN) {
+			_sendbuflen += mode.serialize(_sendbuffer + _sendbuflen);
+			_sendbuflen += serializeMessage(_snapshot_send.takeFirst(), _sendbuffer + _sendbuflen);
+			++count;
 		}
 	}
 
-	if(_sentcount < _sendbuflen) {
-		int sent = _socket->write(_sendbuffer+_sentcount, _sendbuflen-_sentcount);
+	++_writestats.batches;
+	_writestats.messages += count;
+}
+
+/**
+ * Compress the batch in the send buffer. The compressed data is written
+ * from its own buffer, since it may include data held back from previous
+ * batches.
+ */
+void MessageQueue::compressSendBuffer()
+{
+	Q_ASSERT(_deflater);
+
+	QElapsedTimer timer;
+	timer.start();
+	_deflater->compress(_sendbuffer, _sendbuflen, _zsendbuffer);
+	if(_closeWhenReady)
+		_deflater->flush(_zsendbuffer);
+	_compressionstats.deflateNsecs += timer.nsecsElapsed();
+	_compressionstats.rawSent += _sendbuflen;
+
+	_sendbuflen = 0;
+}
+
+/**
+ * Batches are written one after another until the queues are empty or
+ * the IO device stops accepting data. In the latter case, writing continues
+ * when the device signals that it has written some of its data.
+ */
+void MessageQueue::writeData() {
+	QMutexLocker lock(&_mutex);
+	_writeScheduled = false;
+
+	forever {
+		while(_sendbuflen==0 && _zsendbuffer.isEmpty()) {
+			// If send buffer is empty, serialize the next batch of messages
+
+			if(_sendqueue.isEmpty() && _snapshot_send.isEmpty()) {
+				if(_deflater && _deflater->hasUnflushed()) {
+					// Hold back the compressed data for a moment, in case more messages follow
+					if(!_flushTimer->isActive())
+						_flushTimer->start();
+					return;
+				}
+				lock.unlock();
+				emit allSent();
+				return;
+			}
+
+			// Note. Compression starts after the batch containing the marker
+			const bool compress = _deflater != 0;
+			fillSendBuffer();
+			if(compress)
+				compressSendBuffer();
+		}
+
+		const bool compressed = !_zsendbuffer.isEmpty();
+		const char *buffer = compressed ? _zsendbuffer.constData() : _sendbuffer;
+		const int buflen = compressed ? _zsendbuffer.length() : _sendbuflen;
+
+		const int sent = _socket->write(buffer+_sentcount, buflen-_sentcount);
 		if(sent<0) {
 			// Error
+			lock.unlock();
 			emit socketError(_socket->errorString());
 			return;
 		}
-		emit bytesSent(sent);
+		if(compressed)
+			_compressionstats.compressedSent += sent;
 		_sentcount += sent;
-		if(_sentcount == _sendbuflen) {
+		_devicebuffered = _socket->bytesToWrite();
+
+		const bool done = _sentcount == buflen;
+		if(done) {
 			_sendbuflen=0;
+			_zsendbuffer.clear();
 			_sentcount=0;
-			if(_closeWhenReady)
-				close();
-			else
-				writeData();
 		}
+		const bool closeNow = done && _closeWhenReady;
+		lock.unlock();
+
+		emit bytesSent(sent);
+		if(closeNow) {
+			close();
+			return;
+		}
+		if(!done) {
+			// The device is full. Continue when it has written some data.
+			return;
+		}
+		lock.relock();
 	}
 }
 
+/**
+ * The statistics are collected here rather than when the data is handed
+ * to the device, since a socket buffers the data and writes it out
+ * in its own time.
+ * @param bytes number of bytes the device wrote
+ */
+void MessageQueue::deviceBytesWritten(qint64 bytes)
+{
+	{
+		QMutexLocker lock(&_mutex);
+		++_writestats.writes;
+		_writestats.bytes += bytes;
+		_devicebuffered = _socket->bytesToWrite();
+	}
+	writeData();
+	emit bytesFlushed(bytes);
+}
+
+/**
+ * Flush the data held back by the compressor
+ */
+void MessageQueue::flushCompression()
+{
+	QMutexLocker lock(&_mutex);
+	if(!_deflater || !_deflater->hasUnflushed())
+		return;
+
+	QElapsedTimer timer;
+	timer.start();
+	_deflater->flush(_zsendbuffer);
+	_compressionstats.deflateNsecs += timer.nsecsElapsed();
+
+	// If a write is in progress, the flushed data is written along with it
+	if(_sentcount == 0) {
+		lock.unlock();
+		writeData();
+	}
+}
+
+void MessageQueue::handleSocketError()
+{
+	emit socketError(_socket->errorString());
+}
+
+int MessageQueue::messageLength(const MessagePtr &msg) const
+{
+	if(_compactPenMove.loadAcquire() && msg->type() == MSG_PEN_MOVE)
+		return msg.cast<PenMove>().compactLength();
+	return msg->length();
+}
+
+/**
+ * The serialized form is cached in the message while it is queued, so a
+ * message sent through many queues (such as the server's client connections)
+ * is encoded only once. The queue's hold on the message is released here.
+ */
+int MessageQueue::serializeMessage(const MessagePtr &msg, char *data) const
+{
+	const QByteArray bytes = msg->wireBytes(_compactPenMove.loadAcquire());
+	memcpy(data, bytes.constData(), bytes.length());
+	msg->releaseWireBytes();
+	return bytes.length();
+}
+
+/**
+ * If called from another thread, the device is closed in the queue's own thread.
+ */
 void MessageQueue::close() {
+	if(QThread::currentThread() != thread()) {
+		QMetaObject::invokeMethod(this, "close", Qt::QueuedConnection);
+		return;
+	}
 	_socket->close();
+	QMutexLocker lock(&_mutex);
 	_closeWhenReady = false;
 }
 
@@ -209,10 +530,26 @@ void MessageQueue::close() {
  * has been called.
  */
 void MessageQueue::closeWhenReady() {
-	if(_sendbuflen==0)
+	QMutexLocker lock(&_mutex);
+	if(QThread::currentThread() != thread()) {
+		// Stop accepting new messages now, close in the queue's own thread
+		_closeWhenReady = true;
+		QMetaObject::invokeMethod(this, "closeWhenReady", Qt::QueuedConnection);
+		return;
+	}
+
+	if(_deflater && _deflater->hasUnflushed()) {
+		// Write out the held back data before closing
+		_closeWhenReady = true;
+		_flushTimer->stop();
+		lock.unlock();
+		flushCompression();
+	} else if(_sendbuflen==0 && _zsendbuffer.isEmpty() && _sendqueue.isEmpty() && _snapshot_send.isEmpty()) {
+		lock.unlock();
 		close();
-	else
+	} else {
 		_closeWhenReady = true;
+	}
 }
 
 #if 0
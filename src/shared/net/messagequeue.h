@@ -24,15 +24,83 @@
 
 #include <QQueue>
 #include <QObject>
+#include <QMutex>
+#include <QAtomicInt>
 
 #include "message.h"
 
 class QIODevice;
+class QTimer;
 
 namespace protocol {
 
+class Deflater;
+class Inflater;
+
+/**
+ * \brief Socket write statistics
+ */
+struct WriteStats {
+	WriteStats() : writes(0), bytes(0), batches(0), messages(0) {}
+
+	//! Number of writes the IO device has made (bytesWritten notifications)
+	quint64 writes;
+
+	//! Number of bytes the IO device has written
+	quint64 bytes;
+
+	//! Number of send buffer batches
+	quint64 batches;
+
+	//! Number of messages serialized into the batches
+	quint64 messages;
+
+	//! Average number of bytes per device write
+	double bytesPerWrite() const { return writes ? double(bytes) / writes : 0; }
+
+	//! Average number of messages per batch
+	double messagesPerBatch() const { return batches ? double(messages) / batches : 0; }
+};
+
+/**
+ * \brief Stream compression statistics
+ */
+struct CompressionStats {
+	CompressionStats() : rawSent(0), compressedSent(0), rawReceived(0), compressedReceived(0), deflateNsecs(0), inflateNsecs(0) {}
+
+	//! Number of bytes given to the compressor
+	quint64 rawSent;
+
+	//! Number of compressed bytes produced
+	quint64 compressedSent;
+
+	//! Number of bytes decompressed
+	quint64 rawReceived;
+
+	//! Number of compressed bytes received
+	quint64 compressedReceived;
+
+	//! Time spent compressing (in nanoseconds)
+	qint64 deflateNsecs;
+
+	//! Time spent decompressing (in nanoseconds)
+	qint64 inflateNsecs;
+
+	//! Compressed size of the sent data relative to the original
+	double sendRatio() const { return rawSent ? double(compressedSent) / rawSent : 1.0; }
+
+	//! Compressed size of the received data relative to the original
+	double receiveRatio() const { return rawReceived ? double(compressedReceived) / rawReceived : 1.0; }
+};
+
 /**
  * A wrapper for an IO device for sending and receiving messages.
+ *
+ * Queued messages are serialized into the send buffer as a batch (as many
+ * as fit) and the whole batch is handed to the IO device in one write.
+ *
+ * The IO device is only accessed from the thread the queue lives in, but
+ * messages can be sent and received from other threads as well.
  */
 class MessageQueue : public QObject {
 Q_OBJECT
@@ -57,6 +125,12 @@ public:
 	 */
 	MessagePtr getPending();
 
+	/**
+	 * @brief Get the number of received messages waiting to be processed
+	 * @return pending message count
+	 */
+	int pendingCount() const;
+
 	/**
 	 * @brief Check if there are new snapshot messages available
 	 * This command is used only on the server
@@ -79,38 +153,93 @@ public:
 	void send(MessagePtr message);
 
 	/**
-	 * @brief Set the snapshot to upload
+	 * @brief Add messages to the snapshot upload queue
 	 *
 	 * This method is used to enqueue a snapshot point for asynchronous upload.
 	 * Messages from the snapshot queue are sent when there is a lull in the main queue.
 	 * This command is used only on the client side.
 	 *
-	 * Note. Calling this function will overwrite the old snapshot queue, so make
-	 * sure it has been fully sent first!
+	 * The snapshot can be enqueued in parts as it is being generated.
+	 * The end of snapshot marker is added after the part marked complete.
+	 * Only one snapshot can be uploaded at a time.
+	 * This function is thread safe.
 	 * @param snapshot
+	 * @param complete is this the last part of the snapshot
 	 */
-	void sendSnapshot(const QList<MessagePtr> &snapshot);
+	void sendSnapshot(const QList<MessagePtr> &snapshot, bool complete=true);
 
 	/**
-	 * Close the IO device
+	 * @brief Discard the queued snapshot messages that haven't been sent yet
+	 *
+	 * This function is thread safe.
 	 */
-	void close();
+	void abortSnapshot();
+
 
 	/**
-	 * Close the IO device as soon as the current message has been sent.
-	 * written.
+	 * @brief Enable or disable the compact pen move encoding
+	 *
+	 * This is enabled when the protocol version agreed on at login supports it.
+	 * See PenMove for details.
+	 * @param compact
 	 */
-	void closeWhenReady();
+	void setCompactPenMove(bool compact);
+
+	/**
+	 * @brief Compress everything sent after this
+	 *
+	 * A compression marker (a Login message) is sent and all data after
+	 * it is deflate compressed. Compression turns on for the received data
+	 * in the same way when the marker is received, so compression can
+	 * be enabled separately for each direction.
+	 *
+	 * Compressed data is flushed on message boundaries, at most
+	 * COMPRESSION_FLUSH_INTERVAL milliseconds after it was queued,
+	 * so messages sent in quick succession are compressed together.
+	 *
+	 * Both ends must support compression. Use only when
+	 * it has been agreed on during login.
+	 */
+	void startCompression();
+
+	//! Is outgoing data being compressed
+	bool isCompressing() const;
+
+	/**
+	 * @brief Get the stream compression statistics
+	 * @return statistics collected since compression was turned on
+	 */
+	CompressionStats compressionStats() const;
+
+	//! The first protocol minor version that supports stream compression
+	static const int COMPRESSION_MINOR_VERSION = 6;
+
+	//! Maximum time compressed data is held back before flushing (milliseconds)
+	static const int COMPRESSION_FLUSH_INTERVAL = 10;
 
 	/**
 	 * @brief Get the number of bytes in the upload queue
+	 *
+	 * This includes the data buffered by the IO device that it hasn't
+	 * written out yet. The length of the normal queue is tracked as messages
+	 * are added and removed, so this is cheap to call (except when
+	 * a snapshot is being uploaded.)
 	 * @return
 	 */
 	int uploadQueueBytes() const;
 
+	/**
+	 * @brief Get the socket write statistics
+	 * @return statistics collected since the queue was created
+	 */
+	WriteStats writeStats() const;
+
 signals:
 	/**
 	 * @brief information about the amount of data to be received
+	 *
+	 * The StreamPos message that triggered this signal is also placed
+	 * in the receive queue.
 	 * @param count
 	 */
 	void expectingBytes(int count);
@@ -127,6 +256,15 @@ signals:
 	 */
 	void bytesSent(int count);
 
+	/**
+	 * @brief The IO device wrote out data
+	 *
+	 * Unlike bytesSent, which is emitted when data is handed to the device,
+	 * this is emitted when the data has left the device's own buffer.
+	 * @param count number of bytes written
+	 */
+	void bytesFlushed(int count);
+
 	/**
 	 * New message(s) are available. Get them with getPending().
 	 */
@@ -151,13 +289,41 @@ signals:
 
 	void socketError(const QString &errorstring);
 
+public slots:
+	/**
+	 * Close the IO device
+	 */
+	void close();
+
+	/**
+	 * Close the IO device as soon as the current batch of messages has been
+	 * written.
+	 */
+	void closeWhenReady();
+
 private slots:
 	void readData();
 	void writeData();
+	void deviceBytesWritten(qint64 bytes);
+	void flushCompression();
+	void handleSocketError();
 
 private:
+	int messageLength(const MessagePtr &msg) const;
+	int serializeMessage(const MessagePtr &msg, char *data) const;
+	void fillSendBuffer();
+	void compressSendBuffer();
+	void scheduleWrite();
+	int readSocket(char *data, int len);
+
+	// readSocket() return value when the compressed stream couldn't be inflated
+	static const int INVALID_COMPRESSED_DATA = -2;
+
 	QIODevice *_socket;
 
+	// Protects the queues and the send buffer state
+	mutable QMutex _mutex;
+
 	char *_recvbuffer;
 	char *_sendbuffer;
 	int _recvcount;
@@ -165,12 +331,28 @@ private:
 
 	QQueue<MessagePtr> _recvqueue;
 	QQueue<MessagePtr> _sendqueue;
+	int _sendqueuebytes;
+
+	// Bytes buffered by the IO device. Cached, since the device may
+	// only be accessed from the queue's own thread.
+	int _devicebuffered;
 
 	QQueue<MessagePtr> _snapshot_recv;
 	QList<MessagePtr> _snapshot_send;
 
 	bool _closeWhenReady;
 	bool _expectingSnapshot;
+	QAtomicInt _compactPenMove;
+	bool _writeScheduled;
+
+	WriteStats _writestats;
+
+	// Stream compression (zero when not enabled)
+	Deflater *_deflater;
+	Inflater *_inflater;
+	QByteArray _zsendbuffer;
+	QTimer *_flushTimer;
+	CompressionStats _compressionstats;
 };
 
 }
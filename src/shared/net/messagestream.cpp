@@ -20,21 +20,166 @@
 */
 
 #include <QDebug>
+#include <QDir>
+#include <QSet>
+#include <QTemporaryFile>
 
 #include "messagestream.h"
 #include "snapshot.h"
+#include "layer.h"
+#include "pen.h"
+#include "undo.h"
 
 namespace protocol {
 
+namespace {
+
+//! Get the context ID of a command that uses the drawing context's tool (or -1)
+int toolUser(const MessagePtr &msg)
+{
+	switch(msg->type()) {
+	case MSG_PEN_MOVE: return msg.cast<PenMove>().contextId();
+	case MSG_PEN_UP: return msg.cast<PenUp>().contextId();
+	case MSG_UNDO: return msg.cast<Undo>().contextId();
+	case MSG_REDO: return msg.cast<Redo>().contextId();
+	default: return -1;
+	}
+}
+
+/**
+ * Remove commands whose effect is overridden before anything can observe it:
+ *
+ * - tool changes followed by another tool change of the same user before the tool is used
+ * - layer attribute changes made by the server (context 0) followed by another one.
+ *   Users' attribute changes create undo points, so they must all be kept.
+ */
+QList<MessagePtr> dropSuperseded(const QList<MessagePtr> &messages)
+{
+	QSet<int> toolSet;
+	QSet<int> attrsSet;
+	QList<MessagePtr> kept;
+
+	for(int i=messages.size()-1;i>=0;--i) {
+		const MessagePtr &msg = messages.at(i);
+
+		if(msg->type() == MSG_TOOLCHANGE) {
+			const int ctx = msg.cast<ToolChange>().contextId();
+			if(toolSet.contains(ctx))
+				continue;
+			toolSet.insert(ctx);
+
+		} else if(msg->type() == MSG_LAYER_ATTR) {
+			const LayerAttributes &la = msg.cast<LayerAttributes>();
+			if(la.contextId() == 0) {
+				if(attrsSet.contains(la.id()))
+					continue;
+				attrsSet.insert(la.id());
+			} else {
+				attrsSet.remove(la.id());
+			}
+
+		} else {
+			const int ctx = toolUser(msg);
+			if(ctx>=0)
+				toolSet.remove(ctx);
+
+			// These read or save the layer attributes
+			switch(msg->type()) {
+			case MSG_LAYER_CREATE:
+			case MSG_LAYER_DUPLICATE:
+			case MSG_LAYER_DELETE:
+			case MSG_UNDO:
+			case MSG_REDO:
+				attrsSet.clear();
+				break;
+			default: break;
+			}
+		}
+
+		kept.prepend(msg);
+	}
+	return kept;
+}
+
+/**
+ * Merge pen moves of the same user that are not separated by any other command.
+ * Drawing a stroke (and saving its undo tiles) doesn't depend on how the stroke
+ * is split into messages. Non-command messages between the merged pen moves
+ * are moved after the merged message.
+ */
+QList<MessagePtr> mergePenMoves(const QList<MessagePtr> &messages)
+{
+	QList<MessagePtr> merged;
+	int lastCommand = -1;
+
+	foreach(const MessagePtr &msg, messages) {
+		if(msg->type() == MSG_PEN_MOVE && lastCommand>=0 && merged.at(lastCommand)->type() == MSG_PEN_MOVE) {
+			const PenMove &prev = merged.at(lastCommand).cast<PenMove>();
+			const PenMove &next = msg.cast<PenMove>();
+			if(prev.contextId() == next.contextId() && prev.points().size() + next.points().size() <= PenMove::MAX_POINTS) {
+				merged[lastCommand] = MessagePtr(new PenMove(prev.contextId(), prev.points() + next.points()));
+				continue;
+			}
+		}
+
+		if(msg->isCommand())
+			lastCommand = merged.size();
+		merged.append(msg);
+	}
+	return merged;
+}
+
+//! Get the number of bytes the message takes in the stream
+int streamLength(const MessagePtr &msg)
+{
+	// Snapshot points are containers: only their content is ever sent
+	return msg->type() == MSG_SNAPSHOT ? 0 : msg->length();
+}
+
+}
+
+MessageStream::Segment::Segment(int first_, quint64 bytepos_)
+	: first(first_), bytepos(bytepos_)
+{
+	messages.reserve(SEGMENT_SIZE);
+	positions.reserve(SEGMENT_SIZE);
+}
+
 MessageStream::MessageStream()
-	: _offset(0), _snapshotpointer(-1), _bytes(0)
+	: _memseg(0), _endpos(0), _offset(0), _end(0), _memstart(0), _snapshotpointer(-1), _membytes(0),
+	  _memlimit(0), _spillfile(0)
 {
 }
 
+MessageStream::~MessageStream()
+{
+	qDeleteAll(_segments);
+	delete _spillfile;
+}
+
+void MessageStream::setMemoryLimit(uint bytes, const QString &spilldir)
+{
+	_memlimit = bytes;
+	_spilldir = spilldir;
+	spill();
+}
+
 void MessageStream::append(MessagePtr msg)
 {
-	_messages.append(msg);
-	_bytes += msg->length();
+	if(_segments.isEmpty() || _segments.last()->isFull())
+		_segments.append(new Segment(_end, _endpos));
+
+	Segment *seg = _segments.last();
+	seg->messages.append(msg);
+	seg->positions.append(_endpos - seg->bytepos);
+	++_end;
+
+	const int len = streamLength(msg);
+	_endpos += len;
+	_membytes += len;
+
+	if(_memlimit>0 && _membytes > _memlimit)
+		spill();
 }
 
 void MessageStream::addSnapshotPoint()
@@ -53,23 +198,166 @@ void MessageStream::addSnapshotPoint()
 	_snapshotpointer = end()-1;
 }
 
-int MessageStream::cleanup()
+/**
+ * @param pos message index
+ * @return index of the segment containing the message
+ */
+int MessageStream::segmentIndex(int pos) const
+{
+	// Usually all the segments before this one are full
+	const int guess = (pos - _segments.first()->first) / SEGMENT_SIZE;
+	if(guess < _segments.size() && _segments.at(guess)->contains(pos))
+		return guess;
+
+	// Compaction has shortened some of them, so the segment is further on
+	int lo = qMin(guess, _segments.size()-1), hi = _segments.size()-1;
+	while(lo < hi) {
+		const int mid = (lo + hi + 1) / 2;
+		if(_segments.at(mid)->first <= pos)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+/**
+ * @param seg segment index
+ * @return total length of the messages in the segment
+ */
+uint MessageStream::segmentBytes(int seg) const
+{
+	const quint64 next = seg+1 < _segments.size() ? _segments.at(seg+1)->bytepos : _endpos;
+	return next - _segments.at(seg)->bytepos;
+}
+
+void MessageStream::updateMemStart()
+{
+	_memstart = _memseg < _segments.size() ? qMax(_segments.at(_memseg)->first, _offset) : _end;
+}
+
+/**
+ * Move the oldest segments to the spill log until the in-memory part
+ * is comfortably within the limit. The segment being appended to is never
+ * spilled, so the limit may be exceeded by up to one segment.
+ */
+void MessageStream::spill()
+{
+	if(_memlimit==0 || _membytes <= _memlimit)
+		return;
+
+	if(!_spillfile) {
+		const QString dir = _spilldir.isEmpty() ? QDir::tempPath() : _spilldir;
+		_spillfile = new QTemporaryFile(QDir(dir).filePath("drawpile-history-XXXXXX.log"));
+		if(!_spillfile->open()) {
+			qWarning() << "Couldn't create history spill log:" << _spillfile->errorString() << ". History size is not limited!";
+			delete _spillfile;
+			_spillfile = 0;
+			_memlimit = 0;
+			return;
+		}
+	}
+
+	const uint target = _memlimit / 4 * 3;
+
+	while(_membytes > target && _memseg < _segments.size()-1) {
+		Segment *seg = _segments.at(_memseg);
+
+		QByteArray buffer;
+		qint64 pos = _spillfile->size();
+		QVector<qint64> spillpos(seg->messages.size(), -1);
+
+		// Messages before the stream offset are no longer needed
+		for(int i=qMax(0, _offset - seg->first);i<seg->messages.size();++i) {
+			const MessagePtr &msg = seg->messages.at(i);
+			if(msg->type() == MSG_SNAPSHOT) {
+				// Snapshot points are containers that cannot be serialized
+				_pinned.insert(seg->first + i, msg);
+			} else {
+				const int len = msg->length();
+				buffer.resize(buffer.length() + len);
+				msg->serialize(buffer.data() + buffer.length() - len);
+				spillpos[i] = pos;
+				pos += len;
+			}
+		}
+
+		const qint64 oldsize = _spillfile->size();
+		if(!_spillfile->seek(oldsize) || _spillfile->write(buffer) != buffer.length() || !_spillfile->flush()) {
+			qWarning() << "Couldn't write history spill log:" << _spillfile->errorString() << ". History size is not limited!";
+			// Keep this segment (and everything after it) in memory
+			_spillfile->resize(oldsize);
+			for(int i=0;i<seg->messages.size();++i)
+				_pinned.remove(seg->first + i);
+			_memlimit = 0;
+			break;
+		}
+
+		_membytes -= segmentBytes(_memseg);
+		seg->spillpos = spillpos;
+		seg->messages.clear();
+		++_memseg;
+	}
+	updateMemStart();
+}
+
+MessagePtr MessageStream::readSpilled(int pos) const
+{
+	Q_ASSERT(pos >= _offset && pos < _memstart);
+
+	const Segment *seg = segment(pos);
+	const qint64 spillpos = seg->spillpos.at(pos - seg->first);
+	if(spillpos < 0) {
+		Q_ASSERT(_pinned.contains(pos));
+		return *_pinned.constFind(pos);
+	}
+
+	const int len = bytePosition(pos+1) - bytePosition(pos);
+	QByteArray data;
+	if(_spillfile->seek(spillpos))
+		data = _spillfile->read(len);
+
+	Message *msg = 0;
+	if(data.length() == len && Message::sniffLength(data.constData()) == len)
+		msg = Message::deserialize(reinterpret_cast<const uchar*>(data.constData()));
+
+	if(!msg) {
+		qWarning() << "Couldn't read message" << pos << "from the history spill log:" << _spillfile->errorString();
+		return MessagePtr();
+	}
+
+	return MessagePtr(msg);
+}
+
+int MessageStream::cleanup(int keep)
 {
 	if(hasSnapshot()) {
 		const SnapshotPoint &sp = snapshotPoint().cast<protocol::SnapshotPoint>();
 		if(sp.isComplete()) {
-			int i = _snapshotpointer - _offset;
+			int i = qMin(_snapshotpointer, qMax(keep, _offset)) - _offset;
 			Q_ASSERT(i>=0);
 			if(i>0) {
-				_messages = _messages.mid(i);
 				_offset += i;
-				_snapshotpointer = _offset;
 
-				uint newlen=0;
-				for(int j=1;j<_messages.count();++j)
-					newlen += _messages.at(j)->length();
-				_bytes = newlen;
+				// Drop the segments that are now entirely before the offset.
+				// (The last segment is kept so we know where to continue from.)
+				while(_segments.size()>1 && _segments.at(1)->first <= _offset) {
+					if(_segments.first()->isSpilled()) {
+						if(!_pinned.isEmpty()) {
+							for(int j=0;j<_segments.first()->count();++j)
+								_pinned.remove(_segments.first()->first + j);
+						}
+						--_memseg;
+					} else {
+						_membytes -= segmentBytes(0);
+					}
+					delete _segments.takeFirst();
+				}
+				updateMemStart();
 
+				// Start the log from scratch once nothing refers to it
+				if(_memseg==0 && _spillfile)
+					_spillfile->resize(0);
 			}
 			return i;
 		}
@@ -77,22 +365,112 @@ int MessageStream::cleanup()
 	return 0;
 }
 
+int MessageStream::compact(int from, int to)
+{
+	from = qMax(from, _memstart);
+	to = qMin(to, end());
+	if(from >= to)
+		return 0;
+
+	if(_snapshotpointer >= from && _snapshotpointer < to) {
+		qWarning() << "Tried to compact a range containing the snapshot point!";
+		return 0;
+	}
+
+	const int firstseg = segmentIndex(from);
+	const int lastseg = segmentIndex(to-1);
+	const Segment *first = _segments.at(firstseg);
+	const Segment *last = _segments.at(lastseg);
+
+	QList<MessagePtr> range;
+	range.reserve(to - from);
+	for(int i=from;i<to;++i)
+		range.append(at(i));
+
+	const QList<MessagePtr> compacted = mergePenMoves(dropSuperseded(range));
+	const int removed = range.size() - compacted.size();
+	if(removed == 0)
+		return 0;
+
+	// Rebuild the segments the range overlaps. The ones after it keep their
+	// messages, only their indices and byte positions are shifted down.
+	QList<MessagePtr> messages;
+	for(int i=first->first;i<from;++i)
+		messages.append(first->messages.at(i - first->first));
+	messages += compacted;
+	for(int i=to;i<last->first+last->count();++i)
+		messages.append(last->messages.at(i - last->first));
+
+	const quint64 oldend = lastseg+1 < _segments.size() ? _segments.at(lastseg+1)->bytepos : _endpos;
+	int index = first->first;
+	quint64 pos = first->bytepos;
+
+	QList<Segment*> rebuilt;
+	foreach(const MessagePtr &msg, messages) {
+		if(rebuilt.isEmpty() || rebuilt.last()->isFull())
+			rebuilt.append(new Segment(index, pos));
+		rebuilt.last()->messages.append(msg);
+		rebuilt.last()->positions.append(pos - rebuilt.last()->bytepos);
+		++index;
+		pos += streamLength(msg);
+	}
+
+	for(int i=firstseg;i<=lastseg;++i)
+		delete _segments.takeAt(firstseg);
+	for(int i=0;i<rebuilt.size();++i)
+		_segments.insert(firstseg + i, rebuilt.at(i));
+
+	const quint64 bytesRemoved = oldend - pos;
+	for(int i=firstseg+rebuilt.size();i<_segments.size();++i) {
+		_segments.at(i)->first -= removed;
+		_segments.at(i)->bytepos -= bytesRemoved;
+	}
+
+	_end -= removed;
+	_endpos -= bytesRemoved;
+	_membytes -= bytesRemoved;
+	if(_snapshotpointer >= to)
+		_snapshotpointer -= removed;
+	updateMemStart();
+
+	return removed;
+}
+
 void MessageStream::clear()
 {
 	_offset = end();
+	_memstart = _offset;
 	_snapshotpointer = -1;
-	_messages.clear();
-	_bytes = 0;
+	qDeleteAll(_segments);
+	_segments.clear();
+	_memseg = 0;
+	_pinned.clear();
+	_membytes = 0;
+	if(_spillfile)
+		_spillfile->resize(0);
 }
 
-QList<MessagePtr> MessageStream::toCommandList() const
+QList<MessagePtr> MessageStream::toList() const
 {
 	QList<MessagePtr> lst;
-	foreach(MessagePtr m, _messages)
-		if(m->isCommand())
+	lst.reserve(end() - _offset);
+	for(int i=_offset;i<end();++i) {
+		MessagePtr m = at(i);
+		if(!m.isNull())
 			lst.append(m);
+	}
 	return lst;
 }
 
+QList<MessagePtr> MessageStream::toCommandList() const
+{
+	QList<MessagePtr> lst;
+	for(int i=_offset;i<end();++i) {
+		MessagePtr m = at(i);
+		if(!m.isNull() && m->isCommand())
+			lst.append(m);
+	}
+	return lst;
 }
 
+}
@@ -22,19 +22,61 @@
 #ifndef DP_SHARED_NET_MSGSTREAM_H
 #define DP_SHARED_NET_MSGSTREAM_H
 
+#include <climits>
 #include <QList>
+#include <QVector>
+#include <QHash>
 
 #include "message.h"
 
+class QTemporaryFile;
+
 namespace protocol {
 
 /**
  * @brief The ordered stream of command messages
  *
+ * The amount of memory used by the stream can be limited by setting
+ * a memory limit. When the messages held in memory exceed the limit,
+ * the oldest ones are spilled to an append-only log file in their
+ * serialized form. Spilled messages are read back from the file when
+ * accessed. (Snapshot points are always kept in memory.)
+ *
+ * Messages are stored in segments of up to SEGMENT_SIZE messages. Appending
+ * fills the last segment, and memory is reclaimed by spilling or dropping
+ * whole segments, so neither operation has to move the rest of the stream
+ * around. Compaction rebuilds only the segments it changes.
  */
 class MessageStream {
 public:
 	MessageStream();
+	~MessageStream();
+
+	MessageStream(const MessageStream&) = delete;
+	MessageStream &operator=(const MessageStream&) = delete;
+
+	/**
+	 * @brief Limit the amount of memory used by the stream
+	 *
+	 * @param bytes maximum total length of the messages kept in memory (0 means unlimited)
+	 * @param spilldir directory where the spill log is created (if empty, the system temp directory is used)
+	 */
+	void setMemoryLimit(uint bytes, const QString &spilldir=QString());
+
+	//! Get the memory limit (0 if unlimited)
+	uint memoryLimit() const { return _memlimit; }
+
+	/**
+	 * @brief Get the total length of the messages currently held in memory
+	 * @return length in bytes
+	 */
+	uint lengthInMemory() const { return _membytes; }
+
+	/**
+	 * @brief Get the number of messages that have been spilled to disk
+	 * @return spilled message count
+	 */
+	int spilledCount() const { return _memstart - _offset; }
 
 	/**
 	 * @brief Get the current stream offset
@@ -50,7 +92,7 @@ public:
 	 * @brief Get the end index of the stream
 	 * @return
 	 */
-	int end() const { return _offset + _messages.size(); }
+	int end() const { return _end; }
 
 	/**
 	 * @brief Check if a message at the given index exists in this stream
@@ -59,9 +101,35 @@ public:
 	 */
 	bool isValidIndex(int i) const { return i >= offset() && i < end(); }
 
-	MessagePtr at(int pos) { return _messages.at(pos-_offset); }
+	/**
+	 * @brief Get the byte position of the message at the given index
+	 *
+	 * This is the total length of all the messages appended to the stream
+	 * before the given one, including ones that have since been cleaned up.
+	 * The length of any range of messages is the difference of two positions.
+	 * Snapshot points take no space, since they are never sent as such.
+	 *
+	 * @param pos message index (may be end())
+	 * @return byte position
+	 * @pre offset() <= pos <= end()
+	 */
+	quint64 bytePosition(int pos) const { return pos < end() ? segment(pos)->position(pos) : _endpos; }
 
-	const MessagePtr at(int pos) const { return _messages.at(pos-_offset); }
+	/**
+	 * @brief Get the message at the given index
+	 *
+	 * If the message has been spilled to disk, it is read back from the spill log.
+	 * @param pos message index
+	 * @return message or a null pointer if it couldn't be read back from the spill log
+	 * @pre isValidIndex(pos)
+	 */
+	MessagePtr at(int pos) const
+	{
+		if(pos < _memstart)
+			return readSpilled(pos);
+		const Segment *seg = segment(pos);
+		return seg->messages.at(pos - seg->first);
+	}
 
 	/**
 	 * @brief Add a new command to the stream
@@ -98,9 +166,33 @@ public:
 
 	/**
 	 * @brief remove all messages before the last complete snapshot point
+	 *
+	 * Messages at or after index \a keep are not removed, even if they
+	 * are before the snapshot point. This is used to keep the messages
+	 * that have not yet been sent to all recipients.
+	 * @param keep index of the first message that must be kept
 	 * @return the number of messages removed
 	 */
-	int cleanup();
+	int cleanup(int keep=INT_MAX);
+
+	/**
+	 * @brief Make a range of the command history shorter without changing its result
+	 *
+	 * Tool changes and server made layer attribute changes that are overridden
+	 * before they are used are removed and consecutive pen moves of the same
+	 * user are merged. Replaying the compacted stream produces the same canvas
+	 * (and undo history) as the original.
+	 *
+	 * Only messages held in memory are compacted. The indices of the messages
+	 * after the range are shifted down by the number of messages removed.
+	 * Only the segments the range overlaps are rebuilt.
+	 *
+	 * @param from index of the first message to compact
+	 * @param to index after the last message to compact
+	 * @return the number of messages removed
+	 * @pre the snapshot point is not in the range
+	 */
+	int compact(int from, int to);
 
 	/**
 	 * @brief remove all messages, including the snapshot point
@@ -110,16 +202,16 @@ public:
 	/**
 	 * @brief Get the length of the stored message stream in bytes.
 	 *
-	 * Note. Snapshot point is not included.
+	 * This includes spilled messages. Snapshot point substreams are not included.
 	 * @return length in bytes
 	 */
-	uint lengthInBytes() const { return _bytes; }
+	uint lengthInBytes() const { return _endpos - bytePosition(_offset); }
 
 	/**
 	 * @brief return the whole stream as a list
 	 * @return list of messages
 	 */
-	QList<MessagePtr> toList() const { return _messages; }
+	QList<MessagePtr> toList() const;
 
 	/**
 	 * @brief return a filtered copy of the stream as a list, containing only the command stream messages.
@@ -128,10 +220,67 @@ public:
 	QList<MessagePtr> toCommandList() const;
 
 private:
-	QList<MessagePtr> _messages;
+	static const int SEGMENT_SIZE = 1024;
+
+	/**
+	 * @brief A block of consecutive messages
+	 *
+	 * Segments are full, except the last one and ones rebuilt by compaction.
+	 * Messages before the stream offset may linger in the first segment until
+	 * the whole segment can be dropped.
+	 */
+	struct Segment {
+		Segment(int first_, quint64 bytepos_);
+
+		//! Index of the first message in this segment
+		int first;
+
+		//! Byte position of the first message in this segment
+		quint64 bytepos;
+
+		//! The messages (empty if the segment has been spilled)
+		QVector<MessagePtr> messages;
+
+		//! Byte positions of the messages relative to the segment's position
+		QVector<uint> positions;
+
+		//! Spill log positions of the messages (-1 for pinned snapshot points)
+		QVector<qint64> spillpos;
+
+		int count() const { return positions.size(); }
+		quint64 position(int pos) const { return bytepos + positions.at(pos - first); }
+		bool contains(int pos) const { return pos >= first && pos < first + count(); }
+		bool isFull() const { return count() == SEGMENT_SIZE; }
+		bool isSpilled() const { return !spillpos.isEmpty(); }
+	};
+
+	const Segment *segment(int pos) const { return _segments.at(segmentIndex(pos)); }
+	int segmentIndex(int pos) const;
+	uint segmentBytes(int seg) const;
+	void updateMemStart();
+
+	void spill();
+	MessagePtr readSpilled(int pos) const;
+
+	//! The segments: spilled ones first, then the ones in memory
+	QList<Segment*> _segments;
+
+	//! Index of the first segment held in memory
+	int _memseg;
+
+	//! Snapshot points in the spilled range are kept in memory
+	QHash<int, MessagePtr> _pinned;
+
+	quint64 _endpos;
 	int _offset;
+	int _end;
+	int _memstart;
 	int _snapshotpointer;
-	uint _bytes;
+	uint _membytes;
+
+	uint _memlimit;
+	QString _spilldir;
+	QTemporaryFile *_spillfile;
 };
 
 }
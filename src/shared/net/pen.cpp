@@ -108,6 +108,129 @@ int PenMove::serializePayload(uchar *data) const
 	return ptr - data;
 }
 
+namespace {
+
+// Zigzag encoding maps small negative and positive numbers to small unsigned numbers
+inline uint32_t zigzag(int32_t v) { return (uint32_t(v) << 1) ^ uint32_t(v >> 31); }
+inline int32_t unzigzag(uint32_t v) { return int32_t(v >> 1) ^ -int32_t(v & 1); }
+
+int varintLength(uint32_t v)
+{
+	int len = 1;
+	while(v >= 0x80) {
+		v >>= 7;
+		++len;
+	}
+	return len;
+}
+
+uchar *writeVarint(uchar *ptr, uint32_t v)
+{
+	while(v >= 0x80) {
+		*(ptr++) = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*(ptr++) = v;
+	return ptr;
+}
+
+/**
+ * Read a varint of at most three bytes (enough for a zigzag encoded 16 bit delta)
+ * @return false if the varint is too long or truncated
+ */
+bool readVarint(const uchar *&ptr, const uchar *end, uint32_t &v)
+{
+	v = 0;
+	for(int shift=0;shift<21;shift+=7) {
+		if(ptr == end)
+			return false;
+		const uchar b = *(ptr++);
+		v |= uint32_t(b & 0x7f) << shift;
+		if(!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+}
+
+PenMove *PenMove::deserializeCompact(const uchar *data, uint len)
+{
+	if(len<6)
+		return 0;
+
+	const uchar *end = data + len;
+	uint8_t id = *data;
+
+	int x = qFromBigEndian<quint16>(data+1);
+	int y = qFromBigEndian<quint16>(data+3);
+	int p = *(data+5);
+	data += 6;
+
+	PenPointVector pp;
+	pp.append(PenPoint(x, y, p));
+
+	while(data < end) {
+		uint32_t dx, dy, dp;
+		if(!readVarint(data, end, dx) || !readVarint(data, end, dy) || !readVarint(data, end, dp))
+			return 0;
+
+		x += unzigzag(dx);
+		y += unzigzag(dy);
+		p += unzigzag(dp);
+		if(x<0 || x>0xffff || y<0 || y>0xffff || p<0 || p>0xff || pp.size() == MAX_POINTS)
+			return 0;
+
+		pp.append(PenPoint(x, y, p));
+	}
+	return new PenMove(id, pp);
+}
+
+int PenMove::compactLength() const
+{
+	if(_points.isEmpty())
+		return 3 + 1;
+
+	int len = 3 + 6;
+	for(int i=1;i<_points.size();++i) {
+		const PenPoint &prev = _points.at(i-1);
+		const PenPoint &p = _points.at(i);
+		len += varintLength(zigzag(p.x - prev.x));
+		len += varintLength(zigzag(p.y - prev.y));
+		len += varintLength(zigzag(p.p - prev.p));
+	}
+	return len;
+}
+
+int PenMove::serializeCompact(char *data) const
+{
+	const int payloadlen = compactLength() - 3;
+	Q_ASSERT(payloadlen <= 0xffff);
+
+	qToBigEndian(quint16(payloadlen), (uchar*)data);
+	data[2] = MSG_PEN_MOVE;
+
+	uchar *ptr = (uchar*)data + 3;
+	*(ptr++) = _ctx;
+	if(!_points.isEmpty()) {
+		const PenPoint &first = _points.first();
+		qToBigEndian(first.x, ptr); ptr += 2;
+		qToBigEndian(first.y, ptr); ptr += 2;
+		*(ptr++) = first.p;
+
+		for(int i=1;i<_points.size();++i) {
+			const PenPoint &prev = _points.at(i-1);
+			const PenPoint &p = _points.at(i);
+			ptr = writeVarint(ptr, zigzag(p.x - prev.x));
+			ptr = writeVarint(ptr, zigzag(p.y - prev.y));
+			ptr = writeVarint(ptr, zigzag(p.p - prev.p));
+		}
+	}
+
+	Q_ASSERT(ptr - (uchar*)data == payloadlen + 3);
+	return ptr - (uchar*)data;
+}
+
 PenUp *PenUp::deserialize(const uchar *data, uint len)
 {
 	if(len != 1)
@@ -101,9 +101,21 @@ typedef QVector<PenPoint> PenPointVector;
 /**
  * \brief Pen move command
  * 
+ * Pen moves have two encodings. The classic encoding stores each point
+ * as absolute coordinates (5 bytes per point.) The compact encoding,
+ * used when the session's protocol minor version is at least COMPACT_MINOR_VERSION,
+ * stores the first point as is and the rest as zigzag varint encoded deltas
+ * from the previous point. Since consecutive points are usually close
+ * to each other, most deltas fit in a byte per component.
  */
 class PenMove : public Message {
 public:
+	//! The first protocol minor version that uses the compact encoding
+	static const int COMPACT_MINOR_VERSION = 5;
+
+	//! Maximum number of points in a message (so that both encodings fit in a message)
+	static const int MAX_POINTS = 8192;
+
 	PenMove(uint8_t ctx, const PenPointVector &points)
 		: Message(MSG_PEN_MOVE),
 		_ctx(ctx), _points(points)
@@ -111,6 +123,29 @@ public:
 	
 	static PenMove *deserialize(const uchar *data, uint len);
 
+	/**
+	 * @brief Deserialize a compact encoded pen move
+	 * @param data payload
+	 * @param len payload length
+	 * @return message or 0 if the payload is invalid
+	 */
+	static PenMove *deserializeCompact(const uchar *data, uint len);
+
+	/**
+	 * @brief Get the length of the compact encoded message, header included
+	 * @return message length in bytes
+	 */
+	int compactLength() const;
+
+	/**
+	 * @brief Serialize this message using the compact encoding
+	 *
+	 * The data buffer must be long enough to hold compactLength() bytes.
+	 * @param data buffer where to write the message
+	 * @return number of bytes written
+	 */
+	int serializeCompact(char *data) const;
+
 	uint8_t contextId() const { return _ctx; }
 	const PenPointVector &points() const { return _points; }
 	
@@ -52,8 +52,10 @@ void SnapshotPoint::append(MessagePtr msg)
 
 	if(msg->type() == MSG_SNAPSHOT && msg.cast<SnapshotMode>().mode() == SnapshotMode::END)
 		_complete = true;
-	else
+	else {
 		_substream.append(msg);
+		_bytes += msg->length();
+	}
 }
 
 }
@@ -59,7 +59,7 @@ private:
  */
 class SnapshotPoint : public Message {
 public:
-	SnapshotPoint() : Message(MSG_SNAPSHOT), _complete(false) {}
+	SnapshotPoint() : Message(MSG_SNAPSHOT), _bytes(0), _complete(false) {}
 
 	/**
 	 * @brief Get the snapshot point substream
@@ -67,6 +67,12 @@ public:
 	 */
 	const QList<MessagePtr> &substream() const { return _substream; }
 
+	/**
+	 * @brief Get the total length of the substream messages added so far
+	 * @return length in bytes
+	 */
+	uint substreamLength() const { return _bytes; }
+
 	/**
 	 * @brief Add a message to the snapshot point
 	 *
@@ -92,6 +98,7 @@ protected:
 
 private:
 	QList<MessagePtr> _substream;
+	uint _bytes;
 	bool _complete;
 
 };
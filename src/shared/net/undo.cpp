@@ -1,5 +1,3 @@
-#ifndef DP_NET_UTILS_H
-#define DP_NET_UTILS_H
 /*
    DrawPile - a collaborative drawing program.
 
@@ -21,26 +19,65 @@
 
 */
 
-#include "../shared/net/message.h"
-#include "../shared/net/pen.h"
-#include "core/point.h"
+#include "undo.h"
 
-namespace dpcore {
-	class Brush;
+namespace protocol {
+
+Undo *Undo::deserialize(const uchar *data, uint len)
+{
+	if(len != 1)
+		return 0;
+
+	return new Undo(*data);
+}
+
+int Undo::payloadLength() const
+{
+	return 1;
+}
+
+int Undo::serializePayload(uchar *data) const
+{
+	*data = _ctx;
+	return 1;
+}
+
+Redo *Redo::deserialize(const uchar *data, uint len)
+{
+	if(len != 1)
+		return 0;
+
+	return new Redo(*data);
 }
 
-namespace net {
+int Redo::payloadLength() const
+{
+	return 1;
+}
 
-//! Generate a list of PutImage commands from a QImage
-QList<protocol::MessagePtr> putQImage(int layer, int x, int y, const QImage &image, bool blend);
+int Redo::serializePayload(uchar *data) const
+{
+	*data = _ctx;
+	return 1;
+}
 
-//! Generate a tool change message
-protocol::MessagePtr brushToToolChange(int userid, int layer, const dpcore::Brush &brush);
+UndoHorizon *UndoHorizon::deserialize(const uchar *data, uint len)
+{
+	if(len != 1 || *data == 0)
+		return 0;
 
+	return new UndoHorizon(*data);
+}
 
-protocol::PenPoint pointToProtocol(const dpcore::Point &p);
-protocol::PenPointVector pointsToProtocol(const dpcore::PointVector &points);
+int UndoHorizon::payloadLength() const
+{
+	return 1;
+}
 
+int UndoHorizon::serializePayload(uchar *data) const
+{
+	*data = _limit;
+	return 1;
 }
 
-#endif
+}
@@ -0,0 +1,124 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+#ifndef DP_NET_UNDO_H
+#define DP_NET_UNDO_H
+
+#include <cstdint>
+
+#include "message.h"
+
+namespace protocol {
+
+/**
+ * \brief Undo the latest undoable action of a user
+ *
+ * The undoable actions are: a pen stroke (from the first PenMove to PenUp),
+ * a PutImage and the layer commands.
+ */
+class Undo : public Message {
+public:
+	Undo(uint8_t ctx)
+		: Message(MSG_UNDO),
+		_ctx(ctx)
+		{}
+
+	static Undo *deserialize(const uchar *data, uint len);
+
+	uint8_t contextId() const { return _ctx; }
+
+	void setOrigin(uint8_t userid) { _ctx = userid; }
+
+protected:
+	int payloadLength() const;
+	int serializePayload(uchar *data) const;
+
+private:
+	uint8_t _ctx;
+};
+
+/**
+ * \brief Redo the latest undone action of a user
+ *
+ * The redo history of a user is cleared when the user performs
+ * a new undoable action.
+ */
+class Redo : public Message {
+public:
+	Redo(uint8_t ctx)
+		: Message(MSG_REDO),
+		_ctx(ctx)
+		{}
+
+	static Redo *deserialize(const uchar *data, uint len);
+
+	uint8_t contextId() const { return _ctx; }
+
+	void setOrigin(uint8_t userid) { _ctx = userid; }
+
+protected:
+	int payloadLength() const;
+	int serializePayload(uchar *data) const;
+
+private:
+	uint8_t _ctx;
+};
+
+/**
+ * \brief Forget the undo history of every user
+ *
+ * The server adds this to the command stream right after each snapshot point.
+ * Users who join from the snapshot have no undo history from before it,
+ * so the users already in the session must forget theirs too, or an undo
+ * would be applied by some of them but not others.
+ *
+ * The command also carries the number of undoable groups kept per user,
+ * chosen by the host when the session was started. Since whether an undo
+ * can be applied depends on what is still in the history, every user must
+ * use the same limit from the same point on.
+ *
+ * This command is sent by the server only.
+ */
+class UndoHorizon : public Message {
+public:
+	UndoHorizon(uint8_t undoLimit) : Message(MSG_UNDO_HORIZON), _limit(undoLimit) {}
+
+	static UndoHorizon *deserialize(const uchar *data, uint len);
+
+	//! The first protocol minor version with this command
+	static const int HORIZON_MINOR_VERSION = 8;
+
+	//! Undo limit used when the host doesn't choose one
+	static const int DEFAULT_UNDO_LIMIT = 30;
+
+	//! Number of undoable groups kept per user from this point on
+	uint8_t undoLimit() const { return _limit; }
+
+protected:
+	int payloadLength() const;
+	int serializePayload(uchar *data) const;
+
+private:
+	uint8_t _limit;
+};
+
+}
+
+#endif
@@ -0,0 +1,126 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <QDebug>
+
+#include "canvas.h"
+
+#include "../net/annotation.h"
+#include "../net/meta.h"
+
+namespace server {
+
+SessionCanvas::SessionCanvas()
+	: _state(&_image)
+{
+	// The canvas is never shown
+	_image.suspendUpdates(true);
+	_state.setPreviewsEnabled(false);
+
+	// Annotations move along with the image content
+	QObject::connect(&_state, &drawingboard::CanvasState::canvasResized, [this](const QPoint &offset) {
+		QMutableHashIterator<int, drawingboard::CanvasCheckpoint::Annotation> a(_annotations);
+		while(a.hasNext()) {
+			a.next();
+			a.value().geometry.translate(offset);
+		}
+	});
+}
+
+bool SessionCanvas::isInitialized() const
+{
+	return _image.width() > 0;
+}
+
+void SessionCanvas::receiveMessage(const protocol::MessagePtr &msg)
+{
+	using namespace protocol;
+
+	if(msg->type() == MSG_SESSION_TITLE) {
+		_title = msg.cast<SessionTitle>().title();
+		return;
+	}
+
+	if(!msg->isCommand())
+		return;
+
+	// Annotations are not part of the canvas state
+	if(_state.receiveCommand(msg))
+		return;
+
+	switch(msg->type()) {
+		case MSG_ANNOTATION_CREATE: handleAnnotationCreate(msg.cast<AnnotationCreate>()); break;
+		case MSG_ANNOTATION_RESHAPE: handleAnnotationReshape(msg.cast<AnnotationReshape>()); break;
+		case MSG_ANNOTATION_EDIT: handleAnnotationEdit(msg.cast<AnnotationEdit>()); break;
+		case MSG_ANNOTATION_DELETE: handleAnnotationDelete(msg.cast<AnnotationDelete>()); break;
+		default: break;
+	}
+}
+
+/**
+ * User introductions and layer ACLs are not part of the canvas: those
+ * are added by the session.
+ */
+QSharedPointer<drawingboard::CanvasCheckpoint> SessionCanvas::checkpoint(bool previews) const
+{
+	Q_ASSERT(isInitialized());
+	Q_ASSERT(isIdle());
+
+	return QSharedPointer<drawingboard::CanvasCheckpoint>(
+		new drawingboard::CanvasCheckpoint(&_state, _title, _annotations.values(), previews)
+	);
+}
+
+void SessionCanvas::handleAnnotationCreate(const protocol::AnnotationCreate &cmd)
+{
+	drawingboard::CanvasCheckpoint::Annotation a;
+	a.id = cmd.id();
+	a.geometry = QRect(cmd.x(), cmd.y(), cmd.w(), cmd.h());
+	a.color = 0;
+	_annotations[cmd.id()] = a;
+}
+
+void SessionCanvas::handleAnnotationReshape(const protocol::AnnotationReshape &cmd)
+{
+	if(!_annotations.contains(cmd.id())) {
+		qWarning() << "Got annotation reshape for non-existent annotation" << cmd.id();
+		return;
+	}
+	_annotations[cmd.id()].geometry = QRect(cmd.x(), cmd.y(), cmd.w(), cmd.h());
+}
+
+void SessionCanvas::handleAnnotationEdit(const protocol::AnnotationEdit &cmd)
+{
+	if(!_annotations.contains(cmd.id())) {
+		qWarning() << "Got annotation edit for non-existent annotation" << cmd.id();
+		return;
+	}
+	drawingboard::CanvasCheckpoint::Annotation &a = _annotations[cmd.id()];
+	a.color = cmd.bg();
+	a.text = cmd.text();
+}
+
+void SessionCanvas::handleAnnotationDelete(const protocol::AnnotationDelete &cmd)
+{
+	if(!_annotations.remove(cmd.id()))
+		qWarning() << "Got annotation delete for non-existent annotation" << cmd.id();
+}
+
+}
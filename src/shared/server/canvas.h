@@ -0,0 +1,107 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#ifndef DP_SHARED_SERVER_CANVAS_H
+#define DP_SHARED_SERVER_CANVAS_H
+
+#include <QHash>
+#include <QSharedPointer>
+
+#include "../net/message.h"
+#include "../../core/layerstack.h"
+#include "../../core/canvasstate.h"
+#include "../../core/checkpoint.h"
+
+namespace protocol {
+	class AnnotationCreate;
+	class AnnotationReshape;
+	class AnnotationEdit;
+	class AnnotationDelete;
+}
+
+namespace server {
+
+/**
+ * \brief The serverside copy of the canvas
+ *
+ * The canvas is kept up to date by applying the session's command stream
+ * to it, just like the clients do. This lets the server generate snapshots
+ * by itself, without needing to synchronize the clients and ask one of them
+ * to upload its canvas.
+ *
+ * The canvas is headless: only the paint engine is used.
+ */
+class SessionCanvas {
+public:
+	SessionCanvas();
+
+	SessionCanvas(const SessionCanvas&) = delete;
+	SessionCanvas &operator=(const SessionCanvas&) = delete;
+
+	/**
+	 * @brief Apply a message to the canvas
+	 *
+	 * Non-drawing commands (except the session title) are ignored.
+	 * @param msg
+	 */
+	void receiveMessage(const protocol::MessagePtr &msg);
+
+	/**
+	 * @brief Has the canvas been initialized
+	 * @return true if the canvas has a size
+	 */
+	bool isInitialized() const;
+
+	/**
+	 * @brief Can a snapshot be made right now?
+	 *
+	 * A snapshot cannot capture a stroke that is in progress, so snapshots
+	 * should only be made when no-one's pen is down.
+	 * @return true if there are no strokes in progress
+	 */
+	bool isIdle() const { return _state.isIdle(); }
+
+	/**
+	 * @brief Save the current state of the canvas
+	 *
+	 * The checkpoint has the same form as the ones the clients make.
+	 * It shares the canvas' pixel data, so this is cheap to do. The slow
+	 * part, encoding the checkpoint, can be done in another thread.
+	 * @param previews include low resolution layer previews in the snapshot
+	 * @return new checkpoint
+	 */
+	QSharedPointer<drawingboard::CanvasCheckpoint> checkpoint(bool previews) const;
+
+private:
+	void handleAnnotationCreate(const protocol::AnnotationCreate &cmd);
+	void handleAnnotationReshape(const protocol::AnnotationReshape &cmd);
+	void handleAnnotationEdit(const protocol::AnnotationEdit &cmd);
+	void handleAnnotationDelete(const protocol::AnnotationDelete &cmd);
+
+	dpcore::LayerStack _image;
+	drawingboard::CanvasState _state;
+
+	QHash<int, drawingboard::CanvasCheckpoint::Annotation> _annotations;
+	QString _title;
+};
+
+}
+
+#endif
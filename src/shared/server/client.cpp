@@ -20,10 +20,12 @@
 
 #include <QTcpSocket>
 #include <QStringList>
+#include <QThread>
 
 #include "config.h"
 
 #include "server.h"
+#include "session.h"
 #include "client.h"
 #include "exceptions.h"
 
@@ -35,15 +37,18 @@
 #include "../net/meta.h"
 #include "../net/pen.h"
 #include "../net/snapshot.h"
+#include "../net/undo.h"
 
 namespace server {
 
 using protocol::MessagePtr;
 
-Client::Client(Server *server, QTcpSocket *socket)
-	: QObject(server),
+Client::Client(Server *server, QTcpSocket *socket, QThread *iothread)
+	: QObject(0),
 	  _server(server),
+	  _session(0),
 	  _socket(socket),
+	  _peerAddress(socket->peerAddress()),
 	  _state(LOGIN), _substate(0),
 	  _awaiting_snapshot(false),
 	  _uploading_snapshot(false),
@@ -51,20 +56,63 @@ Client::Client(Server *server, QTcpSocket *socket)
 	  _id(0),
 	  _isOperator(false),
 	  _userLock(false),
+	  _compressionOffered(false),
 	  _barrierlock(BARRIER_NOTLOCKED)
 {
-	_msgqueue = new protocol::MessageQueue(socket, this);
+	_msgqueue = new protocol::MessageQueue(socket);
+
+	if(iothread) {
+		// The socket and the message queue are only touched from the I/O thread.
+		// Session state is handled by this object in the session's thread.
+		_socket->setParent(0);
+		_socket->moveToThread(iothread);
+		_msgqueue->moveToThread(iothread);
+	} else {
+		// Socket I/O is done in the session's thread: the socket and
+		// the queue follow this object when it is moved to a session.
+		_socket->setParent(this);
+		_msgqueue->setParent(this);
+	}
 
 	connect(_socket, SIGNAL(disconnected()), this, SLOT(socketDisconnect()));
-	connect(_socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socketError()));
+	connect(_msgqueue, SIGNAL(socketError(QString)), this, SLOT(socketError(QString)));
 	connect(_msgqueue, SIGNAL(messageAvailable()), this, SLOT(receiveMessages()));
 	connect(_msgqueue, SIGNAL(snapshotAvailable()), this, SLOT(receiveSnapshot()));
 	connect(_msgqueue, SIGNAL(badData(int,int)), this, SLOT(gotBadData(int,int)));
+	connect(_msgqueue, SIGNAL(bytesFlushed(int)), this, SLOT(sendAvailableCommands()));
+}
+
+Client::~Client()
+{
+	if(_socket->thread() == thread()) {
+		delete _msgqueue;
+		delete _socket;
+	} else {
+		_msgqueue->deleteLater();
+		_socket->deleteLater();
+	}
+}
 
-	// Client just connected, start by saying hello
-	QString hello = QString("DRAWPILE %1.%2").arg(DRAWPILE_PROTO_MAJOR_VERSION).arg(_server->session().minorVersion);
+QHostAddress Client::peerAddress() const
+{
+	return _peerAddress;
+}
 
-	if(!server->session().password.isEmpty()) {
+void Client::setSession(Session *session)
+{
+	Q_ASSERT(session->thread() == thread());
+	_session = session;
+}
+
+void Client::greet()
+{
+	Q_ASSERT(_session);
+
+	// Say hello. This is sent again if the client switches sessions,
+	// since the version and password requirement are session specific.
+	QString hello = QString("DRAWPILE %1.%2").arg(DRAWPILE_PROTO_MAJOR_VERSION).arg(_session->state().minorVersion);
+
+	if(!_session->state().password.isEmpty()) {
 		// expect password
 		hello = hello + " PASS";
 		_substate = 0;
@@ -74,68 +122,121 @@ Client::Client(Server *server, QTcpSocket *socket)
 	}
 
 	_msgqueue->send(MessagePtr(new protocol::Login(hello)));
-}
 
-Client::~Client()
-{
-	delete _socket;
-}
-
-QHostAddress Client::peerAddress() const
-{
-	return _socket->peerAddress();
+	// Handle any messages that arrived while the client was moving
+	if(_msgqueue->isPending())
+		QMetaObject::invokeMethod(this, "receiveMessages", Qt::QueuedConnection);
 }
 
+/**
+ * Messages are pulled from the session's stream as the socket drains,
+ * so at most SEND_WINDOW bytes are queued for a client at a time, counting
+ * the socket's own write buffer. A slow client simply falls behind in the
+ * stream instead of growing its queue.
+ */
 void Client::sendAvailableCommands()
 {
 	if(_state != IN_SESSION)
 		return;
 
-	if(_substreampointer>=0) {
-		// Are we downloading a substream?
-		const protocol::MessagePtr sptr = _server->mainstream().at(_streampointer);
-		Q_ASSERT(sptr->type() == protocol::MSG_SNAPSHOT);
-		const protocol::SnapshotPoint &sp = sptr.cast<const protocol::SnapshotPoint>();
-
-		if(_substreampointer == 0) {
-			// User is in the beginning of a stream, send stream position message
-			uint streamlen = 0;
-			for(int i=0;i<sp.substream().length();++i)
-				streamlen += sp.substream().at(i)->length();
-			for(int i=_streampointer+1;i<_server->mainstream().end();++i)
-				streamlen += _server->mainstream().at(i)->length();
-
-			_msgqueue->send(MessagePtr(new protocol::StreamPos(streamlen)));
-		}
-		// Enqueue substream
-		while(_substreampointer < sp.substream().length())
-			_msgqueue->send(sp.substream().at(_substreampointer++));
+	const protocol::MessageStream &stream = _session->mainstream();
+
+	while(_msgqueue->uploadQueueBytes() < SEND_WINDOW) {
+		if(_substreampointer>=0) {
+			// Are we downloading a substream?
+			const protocol::MessagePtr sptr = stream.at(_streampointer);
+			Q_ASSERT(sptr->type() == protocol::MSG_SNAPSHOT);
+			const protocol::SnapshotPoint &sp = sptr.cast<const protocol::SnapshotPoint>();
+
+			if(_substreampointer == 0) {
+				// User is in the beginning of a stream, send stream position message
+				const uint streamlen = sp.substreamLength() +
+					(stream.bytePosition(stream.end()) - stream.bytePosition(_streampointer+1));
+
+				_msgqueue->send(MessagePtr(new protocol::StreamPos(streamlen)));
+			}
+
+			if(_substreampointer < sp.substream().length()) {
+				_msgqueue->send(sp.substream().at(_substreampointer++));
+			} else if(sp.isComplete()) {
+				_substreampointer = -1;
+				++_streampointer;
+			} else {
+				// Wait for the rest of the snapshot
+				break;
+			}
 
-		if(sp.isComplete()) {
-			_substreampointer = -1;
+		} else if(_streampointer < stream.end()) {
+			// No substream in progress, enqueue normal commands
+			// Snapshot points (substreams) are skipped.
+			MessagePtr msg = stream.at(_streampointer);
+			if(msg.isNull()) {
+				streamReadError();
+				return;
+			}
 			++_streampointer;
-			sendAvailableCommands();
-		}
-	} else {
-		// No substream in progress, enqueue normal commands
-		// Snapshot points (substreams) are skipped.
-		while(_streampointer < _server->mainstream().end()) {
-			MessagePtr msg = _server->mainstream().at(_streampointer++);
 			if(msg->type() != protocol::MSG_SNAPSHOT)
 				_msgqueue->send(msg);
+
+		} else {
+			// Up to date
+			break;
+		}
+	}
+}
+
+void Client::streamCompacted(int end, int removed)
+{
+	if(_state == IN_SESSION && _streampointer >= end)
+		_streampointer -= removed;
+}
+
+/**
+ * Messages sent directly to the client (rather than through the stream)
+ * are sometimes only valid once the client has seen the whole stream.
+ */
+void Client::flushStream()
+{
+	if(_state != IN_SESSION || _substreampointer>=0)
+		return;
+
+	const protocol::MessageStream &stream = _session->mainstream();
+	while(_streampointer < stream.end()) {
+		MessagePtr msg = stream.at(_streampointer);
+		if(msg.isNull()) {
+			streamReadError();
+			return;
 		}
+		++_streampointer;
+		if(msg->type() != protocol::MSG_SNAPSHOT)
+			_msgqueue->send(msg);
 	}
+}
 
+/**
+ * The part of the session history this client is at couldn't be read back
+ * from the spill log. The client can't continue without it, but the session
+ * and the other clients are fine, so only this client is disconnected.
+ */
+void Client::streamReadError()
+{
+	_session->printError(QString("Couldn't read message %1 of the session history. Disconnecting %2").arg(_streampointer).arg(peerAddress().toString()));
+	_msgqueue->close();
 }
 
 void Client::receiveMessages()
 {
-	while(_msgqueue->isPending()) {
+	// Stop if the client was moved to another session (and thread)
+	// by the last message. The rest are handled there.
+	while(thread() == QThread::currentThread() && _session && _msgqueue->isPending()) {
 		MessagePtr msg = _msgqueue->getPending();
 
 		switch(_state) {
 		case LOGIN:
-			handleLoginMessage(msg.cast<protocol::Login>());
+			if(msg->type() == protocol::MSG_LOGIN)
+				handleLoginMessage(msg.cast<protocol::Login>());
+			else
+				_session->printDebug(QString("Warning: got non-login message %1 in login state").arg(msg->type()));
 			break;
 		case WAIT_FOR_SYNC:
 		case IN_SESSION:
@@ -148,25 +249,25 @@ void Client::receiveMessages()
 void Client::handleSnapshotStart(const protocol::SnapshotMode &msg)
 {
 	if(!_awaiting_snapshot) {
-		_server->printDebug(QString("Got unexpected snapshot message from user %1").arg(_id));
+		_session->printDebug(QString("Got unexpected snapshot message from user %1").arg(_id));
 		return;
 	}
 	if(msg.mode() != protocol::SnapshotMode::ACK) {
-		_server->printError(QString("Got unexpected snapshot message from user %1. Expected ACK, got mode %2").arg(_id).arg(msg.mode()));
+		_session->printError(QString("Got unexpected snapshot message from user %1. Expected ACK, got mode %2").arg(_id).arg(msg.mode()));
 		// TODO abort sync
 		return;
 	}
 
 	_awaiting_snapshot = false;
-	_server->snapshotSyncStarted();
+	_session->snapshotSyncStarted();
 	_uploading_snapshot = true;
 }
 
 void Client::receiveSnapshot()
 {
 	if(!_uploading_snapshot) {
-		_server->printError(QString("Received snapshot data from client %1 when not expecting it!").arg(_id));
-		_socket->disconnect();
+		_session->printError(QString("Received snapshot data from client %1 when not expecting it!").arg(_id));
+		_msgqueue->close();
 		return;
 	}
 
@@ -179,28 +280,29 @@ void Client::receiveSnapshot()
 		case MSG_LOGIN:
 		case MSG_SESSION_CONFIG:
 		case MSG_STREAMPOS:
+		case MSG_UNDO_HORIZON:
 			continue;
 		default: break;
 		}
 
 		// Add message
-		if(_server->addToSnapshotStream(msg)) {
+		if(_session->addToSnapshotStream(msg)) {
 			// TODO add layer ACLs
-			_server->printDebug(QString("Finished getting snapshot from client %1").arg(_id));
+			_session->printDebug(QString("Finished getting snapshot from client %1").arg(_id));
 			_uploading_snapshot = false;
-			_server->cleanupCommandStream();
+			_session->cleanupCommandStream();
 
 			// Graduate to session
 			if(_state == WAIT_FOR_SYNC) {
-				_server->session().syncInitialState(_server->mainstream().snapshotPoint().cast<protocol::SnapshotPoint>().substream());
+				_session->state().syncInitialState(_session->mainstream().snapshotPoint().cast<protocol::SnapshotPoint>().substream());
 				_state = IN_SESSION;
 				enqueueHeldCommands();
 				sendAvailableCommands();
 			}
 
 			if(_msgqueue->isPendingSnapshot()) {
-				_server->printError(QString("Client %1 sent too much snapshot data!").arg(_id));
-				_socket->disconnect();
+				_session->printError(QString("Client %1 sent too much snapshot data!").arg(_id));
+				_msgqueue->close();
 			}
 			break;
 		}
@@ -209,24 +311,46 @@ void Client::receiveSnapshot()
 
 void Client::gotBadData(int len, int type)
 {
-	_server->printError(QString("Received unknown message type #%1 of length %2 from %3").arg(type).arg(len).arg(peerAddress().toString()));
-	_socket->abort();
+	_session->printError(QString("Received unknown message type #%1 of length %2 from %3").arg(type).arg(len).arg(peerAddress().toString()));
+	_msgqueue->close();
 }
 
-void Client::socketError()
+void Client::socketError(const QString &error)
 {
-	_server->printError(QString("Socket error %1 (from %2)").arg(_socket->errorString()).arg(peerAddress().toString()));
-	_socket->abort();
+	_session->printError(QString("Socket error %1 (from %2)").arg(error).arg(peerAddress().toString()));
+	_msgqueue->close();
 }
 
 void Client::socketDisconnect()
 {
+	const protocol::WriteStats stats = _msgqueue->writeStats();
+	_session->printDebug(QString("Client %1 disconnected. Sent %2 bytes in %3 writes (%4 bytes per write, %5 messages per batch)")
+		.arg(_id)
+		.arg(stats.bytes)
+		.arg(stats.writes)
+		.arg(stats.bytesPerWrite(), 0, 'f', 1)
+		.arg(stats.messagesPerBatch(), 0, 'f', 1));
+
+	if(_msgqueue->isCompressing()) {
+		const protocol::CompressionStats cs = _msgqueue->compressionStats();
+		_session->printDebug(QString("Client %1 compression: sent %2 -> %3 bytes (%4%) in %5 ms, received %6 -> %7 bytes (%8%) in %9 ms")
+			.arg(_id)
+			.arg(cs.rawSent)
+			.arg(cs.compressedSent)
+			.arg(cs.sendRatio() * 100, 0, 'f', 1)
+			.arg(cs.deflateNsecs / 1000000.0, 0, 'f', 1)
+			.arg(cs.rawReceived)
+			.arg(cs.compressedReceived)
+			.arg(cs.receiveRatio() * 100, 0, 'f', 1)
+			.arg(cs.inflateNsecs / 1000000.0, 0, 'f', 1));
+	}
+
 	if(_id>0) {
-		_server->session().userids.release(_id);
-		_server->addToCommandStream(MessagePtr(new protocol::UserLeave(_id)));
+		_session->state().userids.release(_id);
+		_session->addToCommandStream(MessagePtr(new protocol::UserLeave(_id)));
 
-		if(!_server->session().drawingctx[_id].penup)
-			_server->addToCommandStream(MessagePtr(new protocol::PenUp(_id)));
+		if(!_session->state().drawingctx[_id].penup)
+			_session->addToCommandStream(MessagePtr(new protocol::PenUp(_id)));
 	}
 	emit disconnected(this);
 }
@@ -234,20 +358,23 @@ void Client::socketDisconnect()
 void Client::requestSnapshot(bool forcenew)
 {
 	Q_ASSERT(_state != LOGIN);
+
+	// The snapshot must include everything in the stream so far
+	flushStream();
 	_msgqueue->send(MessagePtr(new protocol::SnapshotMode(forcenew ? protocol::SnapshotMode::REQUEST_NEW : protocol::SnapshotMode::REQUEST)));
 	_awaiting_snapshot = true;
 
-	_server->addSnapshotPoint();
+	_session->addSnapshotPoint();
 
 	// Add user introductions to snapshot point
-	foreach(const Client *c, _server->clients()) {
+	foreach(const Client *c, _session->clients()) {
 		if(c->id()>0) {
-			_server->addToSnapshotStream(protocol::MessagePtr(new protocol::UserJoin(c->id(), c->username())));
-			_server->addToSnapshotStream(protocol::MessagePtr(new protocol::UserAttr(c->id(), c->isUserLocked(), c->isOperator())));
+			_session->addToSnapshotStream(protocol::MessagePtr(new protocol::UserJoin(c->id(), c->username())));
+			_session->addToSnapshotStream(protocol::MessagePtr(new protocol::UserAttr(c->id(), c->isUserLocked(), c->isOperator())));
 		}
 	}
 
-	_server->printDebug(QString("Created a new snapshot point and requested data from client %1").arg(_id));
+	_session->printDebug(QString("Created a new snapshot point and requested data from client %1").arg(_id));
 }
 
 /**
@@ -260,6 +387,15 @@ void Client::requestSnapshot(bool forcenew)
  */
 void Client::handleSessionMessage(MessagePtr msg)
 {
+	// The client accepted stream compression: compress our end too
+	if(msg->type() == protocol::MSG_LOGIN && msg.cast<protocol::Login>().isCompressionMarker()) {
+		if(_compressionOffered && !_msgqueue->isCompressing()) {
+			_session->printDebug(QString("Stream compression enabled for client %1").arg(_id));
+			_msgqueue->startCompression();
+		}
+		return;
+	}
+
 	// Filter away blatantly unallowed messages
 	switch(msg->type()) {
 	using namespace protocol;
@@ -269,13 +405,14 @@ void Client::handleSessionMessage(MessagePtr msg)
 	case MSG_USER_LEAVE:
 	case MSG_SESSION_CONFIG:
 	case MSG_STREAMPOS:
-		_server->printDebug(QString("Warning: user #%1 sent server-to-user only command %2").arg(_id).arg(msg->type()));
+	case MSG_UNDO_HORIZON:
+		_session->printDebug(QString("Warning: user #%1 sent server-to-user only command %2").arg(_id).arg(msg->type()));
 		return;
 	default: break;
 	}
 
 	if(msg->isOpCommand() && !_isOperator) {
-		_server->printDebug(QString("Warning: normal user #%1 tried to use operator command %2").arg(_id).arg(msg->type()));
+		_session->printDebug(QString("Warning: normal user #%1 tried to use operator command %2").arg(_id).arg(msg->type()));
 		return;
 	}
 
@@ -293,7 +430,7 @@ void Client::handleSessionMessage(MessagePtr msg)
 		switch(msg->type()) {
 		using namespace protocol;
 		case MSG_PEN_MOVE:
-			if(isLayerLocked(_server->session().drawingctx[_id].currentLayer))
+			if(isLayerLocked(_session->state().drawingctx[_id].currentLayer))
 				return;
 			break;
 		case MSG_LAYER_ATTR:
@@ -308,6 +445,10 @@ void Client::handleSessionMessage(MessagePtr msg)
 			if(isLayerLocked(msg.cast<PutImage>().layer()))
 				return;
 			break;
+		case MSG_PUTTILE:
+			if(isLayerLocked(msg.cast<PutTile>().layer()))
+				return;
+			break;
 		default: /* other types are always allowed */ break;
 		}
 	}
@@ -319,40 +460,45 @@ void Client::handleSessionMessage(MessagePtr msg)
 	switch(msg->type()) {
 	using namespace protocol;
 	case MSG_TOOLCHANGE:
-		_server->session().drawingContextToolChange(msg.cast<ToolChange>());
+		_session->state().drawingContextToolChange(msg.cast<ToolChange>());
 		break;
 	case MSG_PEN_MOVE:
-		_server->session().drawingContextPenDown(msg.cast<PenMove>());
+		_session->state().drawingContextPenDown(msg.cast<PenMove>());
 		break;
 	case MSG_PEN_UP:
-		_server->session().drawingContextPenUp(msg.cast<PenUp>());
+		_session->state().drawingContextPenUp(msg.cast<PenUp>());
 		if(_barrierlock == BARRIER_WAIT) {
 			_barrierlock = BARRIER_LOCKED;
 			emit barrierLocked();
 		}
 		break;
 	case MSG_LAYER_CREATE:
-		_server->session().createLayer(msg.cast<LayerCreate>(), true);
+		_session->state().createLayer(msg.cast<LayerCreate>(), true);
+		break;
+	case MSG_LAYER_DUPLICATE:
+		// drop message if source layer didn't exist
+		if(!_session->state().duplicateLayer(msg.cast<LayerDuplicate>(), true))
+			return;
 		break;
 	case MSG_LAYER_ORDER:
-		_server->session().reorderLayers(msg.cast<LayerOrder>());
+		_session->state().reorderLayers(msg.cast<LayerOrder>());
 		break;
 	case MSG_LAYER_DELETE:
 		// drop message if layer didn't exist
-		if(!_server->session().deleteLayer(msg.cast<LayerDelete>().id()))
+		if(!_session->state().deleteLayer(msg.cast<LayerDelete>().id()))
 			return;
 		break;
 	case MSG_LAYER_ACL:
 		// drop message if layer didn't exist
-		if(!_server->session().updateLayerAcl(msg.cast<LayerACL>()))
+		if(!_session->state().updateLayerAcl(msg.cast<LayerACL>()))
 			return;
 		break;
 	case MSG_ANNOTATION_CREATE:
-		_server->session().createAnnotation(msg.cast<AnnotationCreate>(), true);
+		_session->state().createAnnotation(msg.cast<AnnotationCreate>(), true);
 		break;
 	case MSG_ANNOTATION_DELETE:
 		// drop message if annotation didn't exist
-		if(!_server->session().deleteAnnotation(msg.cast<AnnotationDelete>().id()))
+		if(!_session->state().deleteAnnotation(msg.cast<AnnotationDelete>().id()))
 			return;
 		break;
 	case MSG_CHAT:
@@ -369,7 +515,7 @@ void Client::handleSessionMessage(MessagePtr msg)
 	}
 
 	// Add to main command stream to be distributed to everyone
-	_server->addToCommandStream(msg);
+	_session->addToCommandStream(msg);
 }
 
 bool Client::isHoldLocked() const
@@ -379,46 +525,46 @@ bool Client::isHoldLocked() const
 
 bool Client::isDropLocked() const
 {
-	return _userLock || _server->session().locked;
+	return _userLock || _session->state().locked;
 }
 
 bool Client::isLayerLocked(int layerid)
 {
-	const LayerState *layer = _server->session().getLayerById(layerid);
+	const LayerState *layer = _session->state().getLayerById(layerid);
 	return layer==0 || layer->locked || !(layer->exclusive.isEmpty() || layer->exclusive.contains(_id));
 }
 
 void Client::grantOp()
 {
-	_server->printDebug(QString("Granted operator privileges to user #%1 (%2)").arg(_id).arg(_username));
+	_session->printDebug(QString("Granted operator privileges to user #%1 (%2)").arg(_id).arg(_username));
 	_isOperator = true;
 	sendUpdatedAttrs();
 }
 
 void Client::deOp()
 {
-	_server->printDebug(QString("Revoked operator privileges from user #%1 (%2)").arg(_id).arg(_username));
+	_session->printDebug(QString("Revoked operator privileges from user #%1 (%2)").arg(_id).arg(_username));
 	_isOperator = false;
 	sendUpdatedAttrs();
 }
 
 void Client::lockUser()
 {
-	_server->printDebug(QString("Locked user #%1 (%2)").arg(_id).arg(_username));
+	_session->printDebug(QString("Locked user #%1 (%2)").arg(_id).arg(_username));
 	_userLock = true;
 	sendUpdatedAttrs();
 }
 
 void Client::unlockUser()
 {
-	_server->printDebug(QString("Unlocked user #%1 (%2)").arg(_id).arg(_username));
+	_session->printDebug(QString("Unlocked user #%1 (%2)").arg(_id).arg(_username));
 	_userLock = false;
 	sendUpdatedAttrs();
 }
 
 void Client::barrierLock()
 {
-	if(_server->session().drawingctx[_id].penup) {
+	if(_session->state().drawingctx[_id].penup) {
 		_barrierlock = BARRIER_LOCKED;
 		emit barrierLocked();
 	} else {
@@ -433,8 +579,8 @@ void Client::barrierUnlock()
 
 void Client::kick(int kickedBy)
 {
-	_server->printDebug(QString("User #%1 (%2) kicked by #%3").arg(_id).arg(_username).arg(kickedBy));
-	_socket->disconnectFromHost();
+	_session->printDebug(QString("User #%1 (%2) kicked by #%3").arg(_id).arg(_username).arg(kickedBy));
+	_msgqueue->close();
 }
 
 void Client::sendUpdatedAttrs()
@@ -442,7 +588,7 @@ void Client::sendUpdatedAttrs()
 	// Note. These changes are applied immediately on the server, but may take some
 	// time to reach the clients. This doesn't matter much though, since locks and operator
 	// privileges are enforced by the server only.
-	_server->addToCommandStream(MessagePtr(new protocol::UserAttr(_id, _userLock, _isOperator)));
+	_session->addToCommandStream(MessagePtr(new protocol::UserAttr(_id, _userLock, _isOperator)));
 }
 
 void Client::enqueueHeldCommands()
@@ -459,7 +605,7 @@ void Client::snapshotNowAvailable()
 {
 	if(_state == WAIT_FOR_SYNC) {
 		_state = IN_SESSION;
-		_streampointer = _server->mainstream().snapshotPointIndex();
+		_streampointer = _session->mainstream().snapshotPointIndex();
 		_substreampointer = 0;
 		sendAvailableCommands();
 		enqueueHeldCommands();
@@ -478,6 +624,10 @@ void Client::snapshotNowAvailable()
  * The client responds to OK (or initial hello) with "HOST ***" or "JOIN ***"
  * Server responds with BADNAME, NOSESSION, CLOSED or OK <userid>
  *
+ * At any point before that, the client may select another session
+ * with "SESSION <name>". The server moves the client to that session
+ * (creating it if necessary) and sends the session's hello.
+ *
  * @param loginmsg login message
  */
 void Client::handleLoginMessage(const protocol::Login &loginmsg)
@@ -486,6 +636,11 @@ void Client::handleLoginMessage(const protocol::Login &loginmsg)
 	QByteArray errormsg = "WHAT?";
 
 	try {
+		if(msg.startsWith("SESSION ")) {
+			handleSelectSession(msg);
+			return;
+		}
+
 		switch(_substate) {
 		case 0: /* expecting a password */
 			handleLoginPassword(msg);
@@ -504,14 +659,35 @@ void Client::handleLoginMessage(const protocol::Login &loginmsg)
 	}
 
 	// Unexpected input
-	_server->printError(QString("Error (%1) during login from %2").arg(QString(errormsg)).arg(peerAddress().toString()));
+	_session->printError(QString("Error (%1) during login from %2").arg(QString(errormsg)).arg(peerAddress().toString()));
 	_msgqueue->send(MessagePtr(new protocol::Login(errormsg)));
 	_msgqueue->closeWhenReady();
 }
 
+void Client::handleSelectSession(const QString &msg)
+{
+	// Expected form is "SESSION <name>"
+	QString name = msg.mid(msg.indexOf(' ') + 1).trimmed();
+	if(name.isEmpty() || name.length() > 64)
+		throw ProtocolViolation("WHAT?");
+
+	if(name == _session->name()) {
+		greet();
+		return;
+	}
+
+	_session->printDebug(QString("Client from %1 moves to session \"%2\"").arg(peerAddress().toString()).arg(name));
+
+	// The session may be discarded when detaching: don't touch it after this
+	Session *old = _session;
+	_session = 0;
+	old->detachClient(this);
+	_server->moveToSession(this, name);
+}
+
 void Client::handleLoginPassword(const QString &pass)
 {
-	if(pass != _server->session().password)
+	if(pass != _session->state().password)
 		throw ProtocolViolation("BADPASS");
 
 	// Password OK, expect HOST/JOIN
@@ -522,11 +698,12 @@ void Client::handleLoginPassword(const QString &pass)
 void Client::handleHostSession(const QString &msg)
 {
 	// Cannot host if session has already started
-	if(_server->isSessionStarted())
+	if(_session->isStarted())
 		throw ProtocolViolation("CLOSED");
 
 	// Parse and validate command
-	// Expected form is "HOST <version> <userid> <username>"
+	// Expected form is "HOST <version> <userid> <username>",
+	// or "HOST <version> <userid> <undolimit> <username>" since the undo horizon
 	QStringList tokens = msg.split(' ', QString::SkipEmptyParts);
 	if(tokens.length() < 4)
 		throw ProtocolViolation("WHAT?");
@@ -540,22 +717,35 @@ void Client::handleHostSession(const QString &msg)
 	if(!ok || userid<1 || userid>255)
 		throw ProtocolViolation("WHAT?");
 
-	QString username = QStringList(tokens.mid(3)).join(' ');
+	int nametoken = 3;
+	if(minorVersion >= protocol::UndoHorizon::HORIZON_MINOR_VERSION) {
+		if(tokens.length() < 5)
+			throw ProtocolViolation("WHAT?");
+
+		const int undolimit = tokens[3].toInt(&ok);
+		if(!ok || undolimit<1 || undolimit>255)
+			throw ProtocolViolation("WHAT?");
+		_session->state().undolimit = undolimit;
+		nametoken = 4;
+	}
+
+	QString username = QStringList(tokens.mid(nametoken)).join(' ');
 	if(!validateUsername(username))
 		throw ProtocolViolation("BADNAME");
 
 	_id = userid;
 	_username = username;
-	_server->session().minorVersion = minorVersion;
+	_session->state().minorVersion = minorVersion;
 
 	// Reserve ID
-	_server->session().userids.reserve(_id);
+	_session->state().userids.reserve(_id);
 
 	emit loggedin(this);
 
-	_server->printDebug(QString("User %1 hosts the session").arg(_id));
+	_session->printDebug(QString("User %1 hosts the session").arg(_id));
 
-	_msgqueue->send(MessagePtr(new protocol::Login(QString("OK %1").arg(_id))));
+	_msgqueue->setCompactPenMove(minorVersion >= protocol::PenMove::COMPACT_MINOR_VERSION);
+	_msgqueue->send(MessagePtr(new protocol::Login(loginOk(minorVersion))));
 
 	// Initial state for host is always WAIT_FOR_SYNC, because the server
 	// is not yet in sync with the user!
@@ -566,9 +756,9 @@ void Client::handleHostSession(const QString &msg)
 	_msgqueue->send(MessagePtr(new protocol::UserJoin(_id, _username)));
 
 	// Send request for initial state
-	_server->startSession();
+	_session->start();
 	requestSnapshot(false);
-	_streampointer = _server->mainstream().snapshotPointIndex();
+	_streampointer = _session->mainstream().snapshotPointIndex();
 
 	// First user is operator
 	grantOp();
@@ -577,11 +767,11 @@ void Client::handleHostSession(const QString &msg)
 void Client::handleJoinSession(const QString &msg)
 {
 	// Cannot join a session that hasn't started yet
-	if(!_server->isSessionStarted())
+	if(!_session->isStarted())
 		throw ProtocolViolation("NOSESSION");
 
 	// Session may be closed or full
-	if(_server->session().closed || _server->userCount() >= _server->session().maxusers)
+	if(_session->state().closed || _session->userCount() >= _session->state().maxusers)
 		throw ProtocolViolation("CLOSED");
 
 	// Parse and validate command
@@ -593,33 +783,51 @@ void Client::handleJoinSession(const QString &msg)
 	_username = username;
 
 	// Assign ID
-	_id = _server->session().userids.takeNext();
+	_id = _session->state().userids.takeNext();
 	if(_id<1) {
 		// Out of space!
 		throw ProtocolViolation("CLOSED");
 	}
 
 	emit loggedin(this);
-	_msgqueue->send(MessagePtr(new protocol::Login(QString("OK %1").arg(_id))));
+	_msgqueue->setCompactPenMove(_session->state().minorVersion >= protocol::PenMove::COMPACT_MINOR_VERSION);
+	_msgqueue->send(MessagePtr(new protocol::Login(loginOk(_session->state().minorVersion))));
+
+	// Shorten the history the new user is about to download
+	_session->compactCommandStream();
 
-	_state = _server->mainstream().hasSnapshot() ? IN_SESSION : WAIT_FOR_SYNC;
+	_state = _session->mainstream().hasSnapshot() ? IN_SESSION : WAIT_FOR_SYNC;
 	if(_state == IN_SESSION) {
-		_streampointer = _server->mainstream().snapshotPointIndex();
+		_streampointer = _session->mainstream().snapshotPointIndex();
 		_substreampointer = 0;
 	}
 
-	_server->printDebug(QString("User %1 joined, wait_for_sync is=%2").arg(_id).arg(_state==WAIT_FOR_SYNC));
+	_session->printDebug(QString("User %1 joined, wait_for_sync is=%2").arg(_id).arg(_state==WAIT_FOR_SYNC));
 
-	_server->addToCommandStream(MessagePtr(new protocol::UserJoin(_id, _username)));
+	_session->addToCommandStream(MessagePtr(new protocol::UserJoin(_id, _username)));
 
 	// Give op to this user if it is the only one here
-	if(_server->userCount() == 1)
+	if(_session->userCount() == 1)
 		grantOp();
-	else if(_server->session().lockdefault)
+	else if(_session->state().lockdefault)
 		lockUser();
 
 }
 
+/**
+ * Clients that support it are offered stream compression in the login reply.
+ * A client accepts the offer by sending a compression marker.
+ * @param minorVersion the protocol version of the session
+ * @return "OK <userid> [DEFLATE]"
+ */
+QString Client::loginOk(int minorVersion)
+{
+	_compressionOffered = minorVersion >= protocol::MessageQueue::COMPRESSION_MINOR_VERSION;
+	if(_compressionOffered)
+		return QString("OK %1 %2").arg(_id).arg(protocol::Login::COMPRESSION_MARKER);
+	return QString("OK %1").arg(_id);
+}
+
 bool Client::validateUsername(const QString &username)
 {
 	if(username.isEmpty())
@@ -660,66 +868,66 @@ bool Client::handleOperatorCommand(const QString &cmd)
 	QStringList tokens = cmd.split(' ', QString::SkipEmptyParts);
 	if(tokens[0] == "/lock" && tokens.count()==2) {
 		bool ok;
-		Client *c = _server->getClientById(tokens[1].toInt(&ok));
+		Client *c = _session->getClientById(tokens[1].toInt(&ok));
 		if(c && ok) {
 			c->lockUser();
 			return true;
 		}
 	} else if(tokens[0] == "/unlock" && tokens.count()==2) {
 		bool ok;
-		Client *c = _server->getClientById(tokens[1].toInt(&ok));
+		Client *c = _session->getClientById(tokens[1].toInt(&ok));
 		if(c && ok) {
 			c->unlockUser();
 			return true;
 		}
 	} else if(tokens[0] == "/kick" && tokens.count()==2) {
 		bool ok;
-		Client *c = _server->getClientById(tokens[1].toInt(&ok));
+		Client *c = _session->getClientById(tokens[1].toInt(&ok));
 		if(c && ok) {
 			c->kick(_id); // TODO inform of the reason
 			return true;
 		}
 	} else if(tokens[0] == "/lock" && tokens.count()==1) {
-		_server->session().locked = true;
-		_server->addToCommandStream(_server->session().sessionConf());
+		_session->state().locked = true;
+		_session->addToCommandStream(_session->state().sessionConf());
 		return true;
 	} else if(tokens[0] == "/unlock" && tokens.count()==1) {
-		_server->session().locked = false;
-		_server->addToCommandStream(_server->session().sessionConf());
+		_session->state().locked = false;
+		_session->addToCommandStream(_session->state().sessionConf());
 		return true;
 	} else if(tokens[0] == "/close" && tokens.count()==1) {
-		_server->session().closed = true;
-		_server->addToCommandStream(_server->session().sessionConf());
+		_session->state().closed = true;
+		_session->addToCommandStream(_session->state().sessionConf());
 		return true;
 	} else if(tokens[0] == "/open" && tokens.count()==1) {
-		_server->session().closed = false;
-		_server->addToCommandStream(_server->session().sessionConf());
+		_session->state().closed = false;
+		_session->addToCommandStream(_session->state().sessionConf());
 		return true;
 	} else if(tokens[0] == "/title" && tokens.count()>1) {
 		QString title = QStringList(tokens.mid(1)).join(' ');
-		_server->addToCommandStream(protocol::MessagePtr(new protocol::SessionTitle(title)));
+		_session->addToCommandStream(protocol::MessagePtr(new protocol::SessionTitle(title)));
 		return true;
 	} else if(tokens[0] == "/maxusers" && tokens.count()==2) {
 		bool ok;
 		int limit = tokens[1].toInt(&ok);
 		if(ok && limit>=0) {
-			_server->session().maxusers = limit;
+			_session->state().maxusers = limit;
 			return true;
 		}
 	} else if(tokens[0] == "/lockdefault" && tokens.count()==1) {
-		_server->session().lockdefault = true;
+		_session->state().lockdefault = true;
 		return true;
 	} else if(tokens[0] == "/unlockdefault" && tokens.count()==1) {
-		_server->session().lockdefault = false;
+		_session->state().lockdefault = false;
 		return true;
 	} else if(tokens[0] == "/password") {
 		if(tokens.length()==1)
-			_server->session().password = QString();
+			_session->state().password = QString();
 		else // note: password may contain spaces
-			_server->session().password = cmd.mid(cmd.indexOf(' ') + 1);
+			_session->state().password = cmd.mid(cmd.indexOf(' ') + 1);
 		return true;
 	} else if(tokens[0] == "/force_snapshot" && tokens.count()==1) {
-		_server->startSnapshotSync();
+		_session->startSnapshotSync();
 		return true;
 	}
 
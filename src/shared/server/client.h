@@ -26,6 +26,7 @@
 #include "../net/message.h"
 
 class QTcpSocket;
+class QThread;
 
 namespace protocol {
 	class MessageQueue;
@@ -36,10 +37,14 @@ namespace protocol {
 namespace server {
 
 class Server;
+class Session;
 
 class Client : public QObject
 {
     Q_OBJECT
+	//! Maximum number of bytes to queue from the session's stream at a time
+	static const int SEND_WINDOW = 1024 * 128;
+
 	enum State {
 		LOGIN,
 		WAIT_FOR_SYNC,
@@ -47,9 +52,33 @@ class Client : public QObject
 	};
 
 public:
-	Client(Server *server, QTcpSocket *socket);
+	/**
+	 * @brief Construct a client
+	 * @param server the server
+	 * @param socket client connection
+	 * @param iothread thread where socket I/O is done (if 0, same thread as the session)
+	 */
+	Client(Server *server, QTcpSocket *socket, QThread *iothread=0);
 	~Client();
 
+	/**
+	 * @brief Set the session this client belongs to
+	 *
+	 * This is called by the session when the client is added to it.
+	 * @param session
+	 */
+	void setSession(Session *session);
+
+	//! Get the session this client belongs to
+	Session *session() const { return _session; }
+
+	/**
+	 * @brief Send the login greeting
+	 *
+	 * This starts the login process in the current session.
+	 */
+	void greet();
+
 	//! Get the user's host address
 	QHostAddress peerAddress() const;
 
@@ -61,6 +90,24 @@ public:
 	 */
 	int id() const { return _id; }
 
+	/**
+	 * @brief Get the position of this client in the session's main stream
+	 *
+	 * Messages before this index have been queued for sending.
+	 * @return stream index or -1 if the client is not in the session yet
+	 */
+	int streamPosition() const { return _state == IN_SESSION ? _streampointer : -1; }
+
+	/**
+	 * @brief Messages were removed from the stream by compaction
+	 *
+	 * If the stream position of this client is after the compacted range,
+	 * it is moved back by the number of messages removed.
+	 * @param end the end of the compacted range (before compaction)
+	 * @param removed the number of messages removed
+	 */
+	void streamCompacted(int end, int removed);
+
 	/**
 	 * @brief Get the user name of this client
 	 * @return user name
@@ -164,12 +211,13 @@ private slots:
 	void gotBadData(int len, int type);
 	void receiveMessages();
 	void receiveSnapshot();
-	void socketError();
+	void socketError(const QString &error);
 	void socketDisconnect();
 
 private:
 	void handleSessionMessage(protocol::MessagePtr msg);
 	void handleLoginMessage(const protocol::Login &msg);
+	void handleSelectSession(const QString &msg);
 	void handleLoginPassword(const QString &pass);
 	void handleHostSession(const QString &msg);
 	void handleJoinSession(const QString &msg);
@@ -178,15 +226,20 @@ private:
 	bool handleOperatorCommand(const QString &cmd);
 
 	bool validateUsername(const QString &username);
+	QString loginOk(int minorVersion);
 	void updateState(protocol::MessagePtr msg);
 
 	void enqueueHeldCommands();
+	void flushStream();
+	void streamReadError();
 	void sendUpdatedAttrs();
 
 	bool isLayerLocked(int layerid);
 
 	Server *_server;
+	Session *_session;
 	QTcpSocket *_socket;
+	QHostAddress _peerAddress;
 	protocol::MessageQueue *_msgqueue;
 	QList<protocol::MessagePtr> _holdqueue;
 
@@ -207,6 +260,9 @@ private:
 	//! Is this user locked? (by an operator)
 	bool _userLock;
 
+	//! Was stream compression offered to this user at login
+	bool _compressionOffered;
+
 	//! User's barrier (snapshot sync) lock status
 	enum {BARRIER_NOTLOCKED, BARRIER_WAIT, BARRIER_LOCKED } _barrierlock;
 
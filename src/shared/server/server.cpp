@@ -17,14 +17,16 @@
    along with this program; if not, write to the Free Software Foundation,
    Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
-
 #include <QTcpServer>
 #include <QTcpSocket>
+#include <QTextStream>
+#include <QThread>
+#include <QTimer>
+#include <QStringList>
 
 #include "server.h"
 #include "client.h"
-
-#include "../net/snapshot.h"
+#include "session.h"
 
 namespace server {
 
@@ -33,7 +35,13 @@ Server::Server(QObject *parent)
 	  _server(0),
 	  _errors(0),
 	  _debug(0),
-	  _hasSession(false),
+	  _iothreadCount(0),
+	  _sessionthreadCount(0),
+	  _nextIoThread(0),
+	  _nextSessionThread(0),
+	  _historyLimit(0),
+	  _serverCanvas(false),
+	  _compactHistory(false),
 	  _stopping(false)
 
 {
@@ -41,9 +49,62 @@ Server::Server(QObject *parent)
 
 Server::~Server()
 {
+	// Sessions (and their clients) must be deleted after their threads
+	// have stopped, but before the I/O threads are stopped.
+	stopThreads(_sessionthreads);
+	qDeleteAll(_sessions);
+	_sessions.clear();
+	stopThreads(_iothreads);
+
 	delete _server;
 }
 
+void Server::setIoThreads(int threads)
+{
+	Q_ASSERT(_server==0);
+	_iothreadCount = qMax(0, threads);
+}
+
+void Server::setSessionThreads(int threads)
+{
+	Q_ASSERT(_server==0);
+	_sessionthreadCount = qMax(0, threads);
+}
+
+QList<QThread*> Server::startThreads(int count, const QString &name)
+{
+	QList<QThread*> threads;
+	for(int i=0;i<count;++i) {
+		QThread *t = new QThread;
+		t->setObjectName(QString("%1 %2").arg(name).arg(i+1));
+		t->start();
+		threads.append(t);
+	}
+	return threads;
+}
+
+void Server::stopThreads(QList<QThread*> &threads)
+{
+	foreach(QThread *t, threads) {
+		t->quit();
+		t->wait();
+		delete t;
+	}
+	threads.clear();
+}
+
+/**
+ * Get the next thread from the pool. Threads are assigned round-robin.
+ * @return thread or 0 if the pool is empty
+ */
+QThread *Server::nextThread(const QList<QThread*> &threads, int &next)
+{
+	if(threads.isEmpty())
+		return 0;
+	next = (next + 1) % threads.size();
+	return threads.at(next);
+}
+
 /**
  * Start listening on the specified address.
  * @param port the port to listen on
@@ -69,7 +130,11 @@ bool Server::start(quint16 port, bool anyport, const QHostAddress& address) {
 		return false;
 	}
 
-	printDebug(QString("Started listening on port %1 at address %2").arg(port).arg(address.toString()));
+	_iothreads = startThreads(_iothreadCount, "I/O thread");
+	_sessionthreads = startThreads(_sessionthreadCount, "Session thread");
+
+	printDebug(QString("Started listening on port %1 at address %2 with %3 session and %4 I/O threads")
+		.arg(port).arg(address.toString()).arg(_sessionthreads.size()).arg(_iothreads.size()));
 	return true;
 }
 
@@ -87,81 +152,54 @@ void Server::newClient()
 	QTcpSocket *socket = _server->nextPendingConnection();
 
 	printDebug(QString("Accepted new client from adderss %1").arg(socket->peerAddress().toString()));
-	printDebug(QString("Number of connected clients is now %1").arg(_clients.size() + 1));
 
-	Client *client = new Client(this, socket);
-	_clients.append(client);
+	Client *client = new Client(this, socket, nextThread(_iothreads, _nextIoThread));
 
-	connect(client, SIGNAL(disconnected(Client*)), this, SLOT(removeClient(Client*)));
-	connect(client, SIGNAL(loggedin(Client*)), this, SLOT(clientLoggedIn(Client*)));
-	connect(client, SIGNAL(barrierLocked()), this, SLOT(userBarrierLocked()));
+	// Clients start out in the default session
+	moveToSession(client, QString());
 }
 
-void Server::removeClient(Client *client)
+void Server::moveToSession(Client *client, const QString &name)
 {
-	printDebug(QString("Client %1 from %2 disconnected").arg(client->id()).arg(client->peerAddress().toString()));
-
-	client->deleteLater();
-
-	bool removed = _clients.removeOne(client);
-	Q_ASSERT(removed);
+	Q_ASSERT(client->thread() == QThread::currentThread());
 
-	// Make sure there is at least one operator in the server
-	bool hasOp=false, hasUsers=false;
-	foreach(const Client *c, _clients) {
-		if(c->id()>0)
-			hasUsers=true;
-		if(c->isOperator()) {
-			hasOp=true;
-			break;
-		}
-	}
-	if(!hasOp) {
-		// Make the first fully logged in user the new operator
-		foreach(Client *c, _clients) {
-			if(c->id()>0) {
-				c->grantOp();
-				break;
-			}
-		}
-	}
-	if(!hasUsers) {
-		// The last user left the session.
-		_session.closed = false;
-		addToCommandStream(_session.sessionConf());
-
-		emit lastClientLeft();
-
-		if(!_mainstream.hasSnapshot() && _hasSession) {
-			// No snapshot and no one to provide one? The server is gone...
-			stop();
+	Session *session;
+	{
+		QMutexLocker lock(&_sessionMutex);
+		session = _sessions.value(name);
+		if(!session) {
+			session = new Session(this, name);
+			QThread *thread = nextThread(_sessionthreads, _nextSessionThread);
+			session->moveToThread(thread ? thread : this->thread());
+			connect(session, SIGNAL(lastClientLeft()), this, SIGNAL(lastClientLeft()));
+			_sessions[name] = session;
+			printDebug(QString("Created session \"%1\"").arg(name));
 		}
 
+		// Keep the session alive until the client has arrived
+		session->_incoming.ref();
 	}
-}
 
-void Server::clientLoggedIn(Client *client)
-{
-	connect(this, SIGNAL(newCommandsAvailable()), client, SLOT(sendAvailableCommands()));
+	client->moveToThread(session->thread());
+	QTimer::singleShot(0, session, [session, client]() { session->addClient(client); });
 }
 
-int Server::userCount() const
+void Server::endSessionIfUnused(Session *session)
 {
-	int count=0;
-	foreach(const Client *c, _clients)
-		if(c->id() > 0)
-			++count;
-	return count;
+	Q_ASSERT(session->thread() == QThread::currentThread());
+
+	QMutexLocker lock(&_sessionMutex);
+	if(session->isUnused()) {
+		_sessions.remove(session->name());
+		session->deleteLater();
+		printDebug(QString("Session \"%1\" ended").arg(session->name()));
+	}
 }
 
-Client *Server::getClientById(int id)
+QStringList Server::sessionNames() const
 {
-	foreach(Client *c, _clients) {
-		if(c->id() == id) {
-			return c;
-		}
-	}
-	return 0;
+	QMutexLocker lock(&_sessionMutex);
+	return _sessions.keys();
 }
 
 /**
@@ -171,89 +209,16 @@ void Server::stop() {
 	_stopping = true;
 	_server->close();
 
-	foreach(Client *c, _clients)
-		c->kick(0);
+	QMutexLocker lock(&_sessionMutex);
+	foreach(Session *s, _sessions)
+		QMetaObject::invokeMethod(s, "stop", Qt::QueuedConnection);
 
 	emit serverStopped();
 }
 
-void Server::addToCommandStream(protocol::MessagePtr msg)
-{
-	// TODO history size limit. Can clear up to lowest stream pointer index.
-	_mainstream.append(msg);
-	emit newCommandsAvailable();
-}
-
-void Server::addSnapshotPoint()
-{
-	_mainstream.addSnapshotPoint();
-	emit snapshotCreated();
-}
-
-bool Server::addToSnapshotStream(protocol::MessagePtr msg)
-{
-	if(!_mainstream.hasSnapshot()) {
-		printError("Tried to add a snapshot command, but there is no snapshot point!");
-		return true;
-	}
-	protocol::SnapshotPoint &sp = _mainstream.snapshotPoint().cast<protocol::SnapshotPoint>();
-	if(sp.isComplete()) {
-		printError("Tried to add a snapshot command, but the snapshot point is already complete!");
-		return true;
-	}
-
-	sp.append(msg);
-
-	emit newCommandsAvailable();
-
-	return sp.isComplete();
-}
-
-void Server::cleanupCommandStream()
-{
-	int removed = _mainstream.cleanup();
-	printDebug(QString("Cleaned up %1 messages from the command stream.").arg(removed));
-}
-
-void Server::startSnapshotSync()
-{
-	printDebug("Starting snapshot sync!");
-
-	// Barrier lock all clients
-	foreach(Client *c, _clients)
-		c->barrierLock();
-}
-
-void Server::snapshotSyncStarted()
-{
-	printDebug("Snapshot sync started!");
-	// Lift barrier lock
-	foreach(Client *c, _clients)
-		c->barrierUnlock();
-}
-
-void Server::userBarrierLocked()
-{
-	// Count locked users
-	int locked=0;
-	foreach(const Client *c, _clients)
-		if(c->isHoldLocked() || c->isDropLocked())
-			++locked;
-
-	if(locked == _clients.count()) {
-		// All locked, we can now send the snapshot sync request
-		foreach(Client *c, _clients) {
-			if(c->isOperator()) {
-				c->requestSnapshot(true);
-				break;
-			}
-		}
-	}
-}
-
-
 void Server::printError(const QString &message)
 {
+	QMutexLocker lock(&_printMutex);
 	if(_errors) {
 		*_errors << message << '\n';
 		_errors->flush();
@@ -262,6 +227,7 @@ void Server::printError(const QString &message)
 
 void Server::printDebug(const QString &message)
 {
+	QMutexLocker lock(&_printMutex);
 	if(_debug) {
 		*_debug << message << '\n';
 		_debug->flush();
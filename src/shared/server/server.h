@@ -17,27 +17,36 @@
    along with this program; if not, write to the Free Software Foundation,
    Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
-
 #ifndef DP_SERVER_H
 #define DP_SERVER_H
 
 #include <QObject>
 #include <QHostAddress>
 #include <QHash>
-
-#include "../util/idlist.h"
-#include "../net/messagestream.h"
-
-#include "session.h"
+#include <QMutex>
+#include <QStringList>
 
 class QTcpServer;
+class QThread;
+class QTextStream;
 
 namespace server {
 
 class Client;
+class Session;
 
 /**
  * The drawpile server.
+ *
+ * The server listens for connections and keeps a registry of sessions,
+ * keyed by session name. New connections start in the default session
+ * (the one with an empty name) and may select another one during login.
+ *
+ * Each session's state is handled in the thread the session is pinned to.
+ * Sessions can optionally be distributed to a pool of session threads,
+ * otherwise they live in the server's thread. Client socket I/O (reading,
+ * parsing, serializing and writing messages) can likewise be distributed
+ * to a pool of I/O threads.
  */
 class Server : public QObject {
 Q_OBJECT
@@ -53,88 +62,91 @@ public:
 	//! Set the stream where debug messages are written
 	void setDebugStream(QTextStream *stream) { _debug = stream; }
 
-	//! Start the server.
-	bool start(quint16 port, bool anyport=false, const QHostAddress& address = QHostAddress::Any);
-
-	//! Get the port the server is listening on
-	int port() const;
-
 	/**
-	 * @brief Is there a session
+	 * @brief Set the number of I/O threads
 	 *
-	 * A session is considered to be started after the first user has logged in.
-	 * @return true if session started
+	 * If zero (the default), client I/O is done in the session's thread.
+	 * This must be set before the server is started.
+	 * @param threads number of I/O threads
 	 */
-	bool isSessionStarted() const { return _hasSession; }
+	void setIoThreads(int threads);
 
 	/**
-	 * @brief get the main command stream
-	 * @return reference to main command stream
+	 * @brief Set the number of session threads
+	 *
+	 * Sessions are pinned to the threads round-robin. If zero (the default),
+	 * all sessions live in the server's thread.
+	 * This must be set before the server is started.
+	 * @param threads number of session threads
 	 */
-	const protocol::MessageStream &mainstream() const { return _mainstream; }
+	void setSessionThreads(int threads);
 
 	/**
-	 * @brief Add a command to the message stream.
+	 * @brief Let sessions keep their own copy of the canvas
 	 *
-	 * Emits newCommandsAvailable
-	 * @param msg
+	 * With a server canvas, snapshots are generated by the server without
+	 * synchronizing the clients. This is only available if the server
+	 * was built with SERVER_CANVAS.
+	 * @param enable
 	 */
-	void addToCommandStream(protocol::MessagePtr msg);
+	void setServerCanvas(bool enable) { _serverCanvas = enable; }
 
-	/**
-	 * @brief Add a new snapshot point.
-	 * @pre there are no unfinished snapshot points
-	 */
-	void addSnapshotPoint();
+	//! Do sessions keep their own copy of the canvas?
+	bool hasServerCanvas() const { return _serverCanvas; }
 
 	/**
-	 * @brief Add a message to the latest snapshot point.
-	 * @param msg
-	 * @pre there is an unfinished snapshot point
-	 * @return true if this was the command that completed the snapshot
+	 * @brief Limit the amount of session history kept in memory
+	 *
+	 * Older parts of each session's command stream are spilled to disk.
+	 * @param bytes maximum length of in-memory history per session (0 means unlimited)
 	 */
-	bool addToSnapshotStream(protocol::MessagePtr msg);
+	void setHistoryMemoryLimit(uint bytes) { _historyLimit = bytes; }
 
-	/**
-	 * @brief Remove all pre-snapshot messages from the command stream
-	 */
-	void cleanupCommandStream();
+	//! Get the per session in-memory history limit
+	uint historyMemoryLimit() const { return _historyLimit; }
 
 	/**
-	 * @brief Synchronize clients so that a new snapshot point can be generated
-	 */
-	void startSnapshotSync();
-
-	/**
-	 * @brief Snapshot synchronization has started
+	 * @brief Compact session history before new users download it
+	 *
+	 * Commands whose effect is overridden are dropped and consecutive
+	 * pen moves are merged. The result of replaying the history is unchanged.
+	 * @param enable
 	 */
-	void snapshotSyncStarted();
+	void setHistoryCompaction(bool enable) { _compactHistory = enable; }
 
-	void startSession() { _hasSession = true; }
+	//! Is session history compacted?
+	bool hasHistoryCompaction() const { return _compactHistory; }
 
-	SessionState &session() { return _session; }
+	//! Start the server.
+	bool start(quint16 port, bool anyport=false, const QHostAddress& address = QHostAddress::Any);
 
-	/**
-	 * @brief Get the number of logged in users.
-	 * @return number of logged in users
-	 */
-	int userCount() const;
+	//! Get the port the server is listening on
+	int port() const;
 
 	/**
-	 * @brief Get the list of clients
-	 * @return
+	 * @brief Move a client to the named session
+	 *
+	 * The session is created if it doesn't exist yet. The client is moved
+	 * to the session's thread and added to the session there.
+	 * This must be called from the client's thread.
+	 *
+	 * @param client a client that is not part of any session
+	 * @param name session name
 	 */
-	const QList<Client*> &clients() { return _clients; }
+	void moveToSession(Client *client, const QString &name);
 
 	/**
-	 * @brief Get the client with the specified ID
+	 * @brief Discard the session if it is no longer needed
 	 *
-	 * Client must be a logged in member of the session
-	 * @param id client ID
-	 * @return client or 0 if not found
+	 * This is called by the session (from its own thread) when a client leaves.
+	 * @param session
 	 */
-	Client *getClientById(int id);
+	void endSessionIfUnused(Session *session);
 
+	//! Get the names of the sessions currently hosted
+	QStringList sessionNames() const;
+
+	// These are thread safe
 	void printError(const QString &message);
 	void printDebug(const QString &message);
 
@@ -144,37 +156,39 @@ public slots:
 
 private slots:
 	void newClient();
-	void removeClient(Client *client);
-	void clientLoggedIn(Client *client);
-	void userBarrierLocked();
 
 signals:
-	//! This signal is emitted when the server becomes empty
+	//! This signal is emitted when the last client of a session leaves
 	void lastClientLeft();
 
-	//! New commands have been added to the main stream
-	void newCommandsAvailable();
-
-	//! A new snapshot was just created
-	void snapshotCreated();
-
 	void serverStopped();
 
 private:
+	static QList<QThread*> startThreads(int count, const QString &name);
+	static void stopThreads(QList<QThread*> &threads);
+	static QThread *nextThread(const QList<QThread*> &threads, int &next);
+
 	QTcpServer *_server;
-	QList<Client*> _clients;
 
 	QTextStream *_errors;
 	QTextStream *_debug;
+	QMutex _printMutex;
 
-	protocol::MessageStream _mainstream;
+	// Session registry
+	mutable QMutex _sessionMutex;
+	QHash<QString, Session*> _sessions;
 
-	bool _hasSession;
-	SessionState _session;
+	QList<QThread*> _iothreads;
+	QList<QThread*> _sessionthreads;
+	int _iothreadCount, _sessionthreadCount;
+	int _nextIoThread, _nextSessionThread;
+
+	uint _historyLimit;
+	bool _serverCanvas;
+	bool _compactHistory;
 	bool _stopping;
 };
 
 }
 
 #endif
-
@@ -18,11 +18,22 @@
    Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
 
+#include "config.h"
+
 #include "session.h"
+#include "server.h"
+#include "client.h"
+#ifdef SERVER_CANVAS
+#include "canvas.h"
+#include "../../core/snapshotgenerator.h"
+#endif
 #include "../net/annotation.h"
+#include "../net/image.h"
 #include "../net/layer.h"
 #include "../net/meta.h"
 #include "../net/pen.h"
+#include "../net/snapshot.h"
+#include "../net/undo.h"
 
 namespace server {
 
@@ -44,6 +55,9 @@ void SessionState::syncInitialState(const QList<protocol::MessagePtr> &messages)
 		case MSG_LAYER_CREATE:
 			createLayer(msg.cast<LayerCreate>(), false);
 			break;
+		case MSG_LAYER_DUPLICATE:
+			duplicateLayer(msg.cast<LayerDuplicate>(), false);
+			break;
 		case MSG_LAYER_ORDER:
 			reorderLayers(msg.cast<LayerOrder>());
 			break;
@@ -84,6 +98,19 @@ void SessionState::createLayer(protocol::LayerCreate &cmd, bool assign)
 	layers.append(LayerState(cmd.id()));
 }
 
+bool SessionState::duplicateLayer(protocol::LayerDuplicate &cmd, bool assign)
+{
+	if(!getLayerById(cmd.source()))
+		return false;
+
+	if(assign)
+		cmd.setId(layerids.takeNext());
+	else
+		layerids.reserve(cmd.id());
+	layers.append(LayerState(cmd.id()));
+	return true;
+}
+
 void SessionState::reorderLayers(protocol::LayerOrder &cmd)
 {
 	QVector<LayerState> newlayers;
@@ -182,4 +209,421 @@ protocol::MessagePtr SessionState::sessionConf() const
 	));
 }
 
+Session::Session(Server *server, const QString &name)
+	: QObject(0), _server(server), _name(name), _started(false),
+	  _canvas(0), _canvasSynced(false), _snapshotPending(false), _snapshotEncoding(false), _compactedTo(0),
+	  _fanoutPending(false), _fanoutMessages(0), _fanoutWakeups(0)
+{
+	_mainstream.setMemoryLimit(server->historyMemoryLimit());
+
+#ifdef SERVER_CANVAS
+	if(server->hasServerCanvas())
+		_canvas = new SessionCanvas;
+#endif
+}
+
+Session::~Session()
+{
+	qDeleteAll(_clients);
+#ifdef SERVER_CANVAS
+	delete _canvas;
+#endif
+}
+
+void Session::addClient(Client *client)
+{
+	Q_ASSERT(client->thread() == thread());
+	_incoming.deref();
+
+	_clients.append(client);
+	client->setSession(this);
+
+	connect(client, SIGNAL(disconnected(Client*)), this, SLOT(removeClient(Client*)));
+	connect(client, SIGNAL(loggedin(Client*)), this, SLOT(clientLoggedIn(Client*)));
+	connect(client, SIGNAL(barrierLocked()), this, SLOT(userBarrierLocked()));
+
+	printDebug(QString("Number of connected clients is now %1").arg(_clients.size()));
+
+	client->greet();
+}
+
+void Session::detachClient(Client *client)
+{
+	Q_ASSERT(client->id() == 0);
+	disconnect(client, 0, this, 0);
+	bool removed = _clients.removeOne(client);
+	Q_ASSERT(removed);
+
+	_server->endSessionIfUnused(this);
+}
+
+void Session::removeClient(Client *client)
+{
+	printDebug(QString("Client %1 from %2 disconnected").arg(client->id()).arg(client->peerAddress().toString()));
+
+	client->deleteLater();
+
+	bool removed = _clients.removeOne(client);
+	Q_ASSERT(removed);
+
+	// Make sure there is at least one operator in the session
+	bool hasOp=false, hasUsers=false;
+	foreach(const Client *c, _clients) {
+		if(c->id()>0)
+			hasUsers=true;
+		if(c->isOperator()) {
+			hasOp=true;
+			break;
+		}
+	}
+	if(!hasOp) {
+		// Make the first fully logged in user the new operator
+		foreach(Client *c, _clients) {
+			if(c->id()>0) {
+				c->grantOp();
+				break;
+			}
+		}
+	}
+	if(!hasUsers) {
+		// The last user left the session.
+		printDebug(QString("Last user left. %1 commands added, %2 client wakeups per command")
+			.arg(_fanoutMessages)
+			.arg(wakeupsPerMessage(), 0, 'f', 2));
+
+		_state.closed = false;
+		addToCommandStream(_state.sessionConf());
+
+		emit lastClientLeft();
+
+		if(!_mainstream.hasSnapshot() && _started) {
+			// No snapshot and no one to provide one? The session is gone...
+			stop();
+		}
+	}
+
+	_server->endSessionIfUnused(this);
+}
+
+/**
+ * A session is kept as long as it has clients (or some are on their way)
+ * or a snapshot that new users can join.
+ */
+bool Session::isUnused() const
+{
+	return _clients.isEmpty() && _incoming.load()==0 && !(_started && _mainstream.hasSnapshot());
+}
+
+void Session::clientLoggedIn(Client *client)
+{
+	connect(this, SIGNAL(newCommandsAvailable()), client, SLOT(sendAvailableCommands()));
+}
+
+int Session::userCount() const
+{
+	int count=0;
+	foreach(const Client *c, _clients)
+		if(c->id() > 0)
+			++count;
+	return count;
+}
+
+Client *Session::getClientById(int id)
+{
+	foreach(Client *c, _clients) {
+		if(c->id() == id) {
+			return c;
+		}
+	}
+	return 0;
+}
+
+void Session::stop()
+{
+	foreach(Client *c, _clients)
+		c->kick(0);
+}
+
+void Session::addToCommandStream(protocol::MessagePtr msg)
+{
+	_mainstream.append(msg);
+	scheduleFanout();
+
+#ifdef SERVER_CANVAS
+	if(_canvasSynced) {
+		applyToCanvas(msg);
+
+		// Keep the history short by making a new snapshot every now and then
+		if(_mainstream.lengthInBytes() > AUTO_SNAPSHOT_BYTES && !_snapshotPending && !_snapshotEncoding)
+			startSnapshotSync();
+	}
+#endif
+}
+
+void Session::scheduleFanout()
+{
+	++_fanoutMessages;
+	if(!_fanoutPending) {
+		_fanoutPending = true;
+		QMetaObject::invokeMethod(this, "notifyNewCommands", Qt::QueuedConnection);
+	}
+}
+
+/**
+ * Let clients know there are new commands in the stream. This is called
+ * at most once per event loop iteration, no matter how many commands were added.
+ */
+void Session::notifyNewCommands()
+{
+	_fanoutPending = false;
+	_fanoutWakeups += receivers(SIGNAL(newCommandsAvailable()));
+	emit newCommandsAvailable();
+}
+
+void Session::addSnapshotPoint()
+{
+	_mainstream.addSnapshotPoint();
+
+	// Users joining from the new snapshot have no undo history from before it,
+	// so everyone else must forget theirs at the same point.
+	if(_state.minorVersion >= protocol::UndoHorizon::HORIZON_MINOR_VERSION) {
+		const protocol::MessagePtr horizon(new protocol::UndoHorizon(_state.undolimit));
+		_mainstream.append(horizon);
+		scheduleFanout();
+#ifdef SERVER_CANVAS
+		if(_canvasSynced)
+			_canvas->receiveMessage(horizon);
+#endif
+	}
+
+	emit snapshotCreated();
+}
+
+bool Session::addToSnapshotStream(protocol::MessagePtr msg)
+{
+	if(!_mainstream.hasSnapshot()) {
+		printError("Tried to add a snapshot command, but there is no snapshot point!");
+		return true;
+	}
+	protocol::SnapshotPoint &sp = _mainstream.snapshotPoint().cast<protocol::SnapshotPoint>();
+	if(sp.isComplete()) {
+		printError("Tried to add a snapshot command, but the snapshot point is already complete!");
+		return true;
+	}
+
+	sp.append(msg);
+
+	scheduleFanout();
+
+#ifdef SERVER_CANVAS
+	// The canvas is initialized from the first snapshot the host uploads
+	if(sp.isComplete() && _canvas && !_canvasSynced)
+		syncCanvas();
+#endif
+
+	return sp.isComplete();
+}
+
+void Session::compactCommandStream()
+{
+	if(!_server->hasHistoryCompaction() || !_mainstream.hasSnapshot())
+		return;
+
+	// Messages not yet sent to some client can't be changed anymore
+	int to = _mainstream.end();
+	foreach(const Client *c, _clients) {
+		if(c->streamPosition() >= 0)
+			to = qMin(to, c->streamPosition());
+	}
+
+	// Only the part added since the last pass needs compacting
+	const int from = qMax(_mainstream.snapshotPointIndex() + 1, _compactedTo);
+	if(from >= to)
+		return;
+
+	const uint before = _mainstream.lengthInBytes();
+	const int removed = _mainstream.compact(from, to);
+	_compactedTo = qMax(_compactedTo, to - removed);
+
+	if(removed>0) {
+		foreach(Client *c, _clients)
+			c->streamCompacted(to, removed);
+
+		printDebug(QString("Compacted history by %1 messages: %2 bytes before, %3 bytes after")
+			.arg(removed)
+			.arg(before)
+			.arg(_mainstream.lengthInBytes()));
+	}
+}
+
+void Session::cleanupCommandStream()
+{
+	// Clients that are still catching up keep their part of the stream alive
+	int keep = INT_MAX;
+	foreach(const Client *c, _clients) {
+		if(c->streamPosition() >= 0)
+			keep = qMin(keep, c->streamPosition());
+	}
+
+	int removed = _mainstream.cleanup(keep);
+	printDebug(QString("Cleaned up %1 messages from the command stream.").arg(removed));
+}
+
+void Session::startSnapshotSync()
+{
+#ifdef SERVER_CANVAS
+	if(_canvasSynced) {
+		// No need to bother the clients. A snapshot that is
+		// already being made will do just as well.
+		if(_snapshotEncoding)
+			return;
+		_snapshotPending = true;
+		if(_canvas->isIdle())
+			makeServerSnapshot();
+		return;
+	}
+#endif
+
+	printDebug("Starting snapshot sync!");
+
+	// Barrier lock all clients
+	foreach(Client *c, _clients)
+		c->barrierLock();
+}
+
+void Session::snapshotSyncStarted()
+{
+	printDebug("Snapshot sync started!");
+	// Lift barrier lock
+	foreach(Client *c, _clients)
+		c->barrierUnlock();
+}
+
+void Session::userBarrierLocked()
+{
+	// Count locked users
+	int locked=0;
+	foreach(const Client *c, _clients)
+		if(c->isHoldLocked() || c->isDropLocked())
+			++locked;
+
+	if(locked == _clients.count()) {
+		// All locked, we can now send the snapshot sync request
+		foreach(Client *c, _clients) {
+			if(c->isOperator()) {
+				c->requestSnapshot(true);
+				break;
+			}
+		}
+	}
+}
+
+#ifdef SERVER_CANVAS
+/**
+ * Bring the canvas up to date: apply the snapshot and the commands
+ * received after it.
+ */
+void Session::syncCanvas()
+{
+	Q_ASSERT(_canvas && _mainstream.hasSnapshot());
+
+	const protocol::SnapshotPoint &sp = _mainstream.snapshotPoint().cast<protocol::SnapshotPoint>();
+	foreach(const protocol::MessagePtr &msg, sp.substream())
+		_canvas->receiveMessage(msg);
+
+	for(int i=_mainstream.snapshotPointIndex()+1;i<_mainstream.end();++i) {
+		const protocol::MessagePtr msg = _mainstream.at(i);
+		if(msg.isNull()) {
+			printError(QString("Couldn't read message %1 of the session history! Server canvas disabled.").arg(i));
+			delete _canvas;
+			_canvas = 0;
+			return;
+		}
+		_canvas->receiveMessage(msg);
+	}
+
+	if(_canvas->isInitialized()) {
+		_canvasSynced = true;
+		printDebug("Server canvas initialized. Snapshots will be made by the server.");
+	} else {
+		printError("Snapshot did not initialize the canvas! Server canvas disabled.");
+		delete _canvas;
+		_canvas = 0;
+	}
+}
+
+void Session::applyToCanvas(const protocol::MessagePtr &msg)
+{
+	_canvas->receiveMessage(msg);
+
+	if(_snapshotPending && _canvas->isIdle())
+		makeServerSnapshot();
+}
+
+/**
+ * Generate a new snapshot point from the server's canvas. The snapshot
+ * contains the same things a client generated one would.
+ *
+ * The snapshot point is added right away, but the canvas is encoded in
+ * a background thread, so the session can keep serving its clients in the
+ * meantime. The snapshot is filled in as the encoded parts arrive.
+ */
+void Session::makeServerSnapshot()
+{
+	Q_ASSERT(_canvasSynced && _canvas->isIdle());
+	Q_ASSERT(!_snapshotEncoding);
+	_snapshotPending = false;
+
+	addSnapshotPoint();
+
+	// User introductions
+	foreach(const Client *c, _clients) {
+		if(c->id()>0) {
+			addToSnapshotStream(protocol::MessagePtr(new protocol::UserJoin(c->id(), c->username())));
+			addToSnapshotStream(protocol::MessagePtr(new protocol::UserAttr(c->id(), c->isUserLocked(), c->isOperator())));
+		}
+	}
+
+	// Layer access controls come after the layers. They are taken now,
+	// since later changes are in the command stream after the snapshot point.
+	QList<protocol::MessagePtr> trailer;
+	foreach(const LayerState &layer, _state.layers) {
+		if(layer.locked || !layer.exclusive.isEmpty())
+			trailer.append(protocol::MessagePtr(new protocol::LayerACL(layer.id, layer.locked, layer.exclusive)));
+	}
+	trailer.append(protocol::MessagePtr(new protocol::SnapshotMode(protocol::SnapshotMode::END)));
+
+	drawingboard::SnapshotGenerator *generator = new drawingboard::SnapshotGenerator(
+		_canvas->checkpoint(_state.minorVersion >= protocol::PutImage::PREVIEW_MINOR_VERSION),
+		trailer,
+		this
+	);
+	connect(generator, SIGNAL(snapshotPart(QList<protocol::MessagePtr>,bool)), this, SLOT(addServerSnapshotPart(QList<protocol::MessagePtr>,bool)));
+	_snapshotEncoding = true;
+	generator->start();
+}
+#endif
+
+void Session::addServerSnapshotPart(const QList<protocol::MessagePtr> &messages, bool complete)
+{
+	foreach(const protocol::MessagePtr &msg, messages)
+		addToSnapshotStream(msg);
+
+	if(complete) {
+		_snapshotEncoding = false;
+		printDebug("Server generated a new snapshot");
+		cleanupCommandStream();
+	}
+}
+
+void Session::printError(const QString &message)
+{
+	_server->printError(_name.isEmpty() ? message : QString("[%1] %2").arg(_name, message));
+}
+
+void Session::printDebug(const QString &message)
+{
+	_server->printDebug(_name.isEmpty() ? message : QString("[%1] %2").arg(_name, message));
+}
+
 }
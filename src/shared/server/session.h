@@ -21,12 +21,16 @@
 #ifndef DP_SHARED_SERVER_SESSION_H
 #define DP_SHARED_SERVER_SESSION_H
 
+#include <QObject>
 #include <QVector>
 #include <QHash>
 #include <QString>
+#include <QAtomicInt>
 
 #include "../util/idlist.h"
 #include "../net/message.h"
+#include "../net/messagestream.h"
+#include "../net/undo.h"
 
 namespace protocol {
 	class ToolChange;
@@ -34,6 +38,7 @@ namespace protocol {
 	class PenUp;
 	class LayerCreate;
 	class LayerOrder;
+	class LayerDuplicate;
 	class LayerACL;
 	class AnnotationCreate;
 	class SessionConf;
@@ -41,6 +46,10 @@ namespace protocol {
 
 namespace server {
 
+class Server;
+class Client;
+class SessionCanvas;
+
 struct LayerState {
 	LayerState() : id(0), locked(false) {}
 	LayerState(int id) : id(id), locked(false) {}
@@ -62,7 +71,8 @@ struct DrawingContext {
  */
 struct SessionState {
 	SessionState() : layerids(255), annotationids(255), userids(255), minorVersion(0),
-		locked(false), closed(false), maxusers(255), lockdefault(false), syncstate(NOT_SYNCING) { }
+		locked(false), closed(false), maxusers(255), lockdefault(false),
+		undolimit(protocol::UndoHorizon::DEFAULT_UNDO_LIMIT), syncstate(NOT_SYNCING) { }
 
 	//! Used layer IDs
 	UsedIdList layerids;
@@ -94,6 +104,9 @@ struct SessionState {
 	//! Lock new users by default
 	bool lockdefault;
 
+	//! Number of undoable groups kept per user (chosen by the host)
+	int undolimit;
+
 	//! If set, the session is password protected
 	QString password;
 
@@ -122,6 +135,14 @@ struct SessionState {
 	 */
 	void createLayer(protocol::LayerCreate &cmd, bool assign);
 
+	/**
+	 * @brief Add a copy of a layer to the list
+	 * @param cmd layer duplication command (will be updated with the new ID)
+	 * @param assign if true, assign an ID for the layer
+	 * @return false if the source layer does not exist
+	 */
+	bool duplicateLayer(protocol::LayerDuplicate &cmd, bool assign);
+
 	/**
 	 * @brief Reorder layers
 	 *
@@ -183,6 +204,211 @@ struct SessionState {
 	protocol::MessagePtr sessionConf() const;
 };
 
+/**
+ * \brief A drawing session hosted by the server
+ *
+ * A session holds the command stream, the session state and the clients
+ * taking part in it (including the ones still logging in.) All of these
+ * are accessed only from the thread the session lives in.
+ */
+class Session : public QObject {
+Q_OBJECT
+	friend class Server;
+public:
+	//! With a server canvas, a new snapshot is made when the history grows this long
+	static const uint AUTO_SNAPSHOT_BYTES = 10 * 1024 * 1024;
+
+	Session(Server *server, const QString &name);
+	~Session();
+
+	//! Get the name of this session (the default session has an empty name)
+	const QString &name() const { return _name; }
+
+	/**
+	 * @brief Has the session been started
+	 *
+	 * A session is considered to be started after the first user has logged in.
+	 * @return true if session started
+	 */
+	bool isStarted() const { return _started; }
+
+	//! Mark the session as started
+	void start() { _started = true; }
+
+	//! Get the session state
+	SessionState &state() { return _state; }
+
+	/**
+	 * @brief get the main command stream
+	 * @return reference to main command stream
+	 */
+	const protocol::MessageStream &mainstream() const { return _mainstream; }
+
+	/**
+	 * @brief Add a client to this session
+	 *
+	 * The client must already live in the same thread as the session.
+	 * The session takes ownership of the client and greets it.
+	 * @param client
+	 */
+	void addClient(Client *client);
+
+	/**
+	 * @brief Remove a client that is moving to another session
+	 *
+	 * This is only possible during the login phase.
+	 * @param client
+	 */
+	void detachClient(Client *client);
+
+	/**
+	 * @brief Add a command to the message stream.
+	 *
+	 * Clients are notified of new commands once per event loop iteration,
+	 * so a batch of received messages wakes up each client only once.
+	 * @param msg
+	 */
+	void addToCommandStream(protocol::MessagePtr msg);
+
+	/**
+	 * @brief Add a new snapshot point.
+	 * @pre there are no unfinished snapshot points
+	 */
+	void addSnapshotPoint();
+
+	/**
+	 * @brief Add a message to the latest snapshot point.
+	 * @param msg
+	 * @pre there is an unfinished snapshot point
+	 * @return true if this was the command that completed the snapshot
+	 */
+	bool addToSnapshotStream(protocol::MessagePtr msg);
+
+	/**
+	 * @brief Remove all pre-snapshot messages from the command stream
+	 */
+	void cleanupCommandStream();
+
+	/**
+	 * @brief Compact the part of the command stream new users must download
+	 *
+	 * This does nothing unless history compaction is enabled on the server.
+	 * Only messages that have been sent to every client are compacted.
+	 */
+	void compactCommandStream();
+
+	/**
+	 * @brief Synchronize clients so that a new snapshot point can be generated
+	 *
+	 * If the session has its own canvas, the snapshot is generated by the
+	 * server instead and no synchronization is needed.
+	 */
+	void startSnapshotSync();
+
+	/**
+	 * @brief Snapshot synchronization has started
+	 */
+	void snapshotSyncStarted();
+
+	/**
+	 * @brief Get the number of logged in users.
+	 * @return number of logged in users
+	 */
+	int userCount() const;
+
+	/**
+	 * @brief Get the list of clients
+	 * @return
+	 */
+	const QList<Client*> &clients() { return _clients; }
+
+	/**
+	 * @brief Get the client with the specified ID
+	 *
+	 * Client must be a logged in member of the session
+	 * @param id client ID
+	 * @return client or 0 if not found
+	 */
+	Client *getClientById(int id);
+
+	void printError(const QString &message);
+	void printDebug(const QString &message);
+
+	/**
+	 * @brief Get the average number of client wakeups per added command
+	 *
+	 * This is the number of times clients have been notified of new
+	 * commands divided by the number of commands added.
+	 * @return wakeups per message
+	 */
+	double wakeupsPerMessage() const { return _fanoutMessages ? double(_fanoutWakeups) / _fanoutMessages : 0; }
+
+public slots:
+	//! Disconnect all clients
+	void stop();
+
+private slots:
+	void removeClient(Client *client);
+	void clientLoggedIn(Client *client);
+	void userBarrierLocked();
+	void notifyNewCommands();
+	void addServerSnapshotPart(const QList<protocol::MessagePtr> &messages, bool complete);
+
+signals:
+	//! The last logged in user left the session
+	void lastClientLeft();
+
+	//! New commands have been added to the main stream
+	void newCommandsAvailable();
+
+	//! A new snapshot was just created
+	void snapshotCreated();
+
+private:
+	//! Can this session be discarded (no clients and nothing worth keeping)?
+	bool isUnused() const;
+
+	void scheduleFanout();
+
+	void syncCanvas();
+	void applyToCanvas(const protocol::MessagePtr &msg);
+	void makeServerSnapshot();
+
+	Server *_server;
+	QString _name;
+	QList<Client*> _clients;
+
+	protocol::MessageStream _mainstream;
+
+	bool _started;
+	SessionState _state;
+
+	//! Number of clients on their way to this session (see Server::moveToSession)
+	QAtomicInt _incoming;
+
+	//! The server's copy of the canvas (if enabled)
+	SessionCanvas *_canvas;
+
+	//! Is the canvas up to date with the command stream
+	bool _canvasSynced;
+
+	//! Make a snapshot as soon as no strokes are in progress
+	bool _snapshotPending;
+
+	//! Is a server made snapshot being encoded in the background
+	bool _snapshotEncoding;
+
+	//! The stream has been compacted up to this index
+	int _compactedTo;
+
+	//! Has a new commands notification been scheduled
+	bool _fanoutPending;
+
+	//! Fan-out instrumentation: commands added and client wakeups made
+	quint64 _fanoutMessages;
+	quint64 _fanoutWakeups;
+};
+
 }
 
 #endif